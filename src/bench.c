@@ -0,0 +1,192 @@
+/*
+ * bench.c: per-stage timing for "kartvid bench"
+ *
+ * Each stage has a histogram of how long it took each time, with one bucket per
+ * power of two nanoseconds.  Stages are timed from many threads at once, so
+ * everything is updated atomically.  Percentiles are reported as the upper
+ * bound of the bucket they fall in (but no more than the maximum), so they're
+ * only accurate to within a factor of two, which is plenty for seeing where
+ * the time goes.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "bench.h"
+
+#define	BENCH_NBUCKETS	48	/* up to about 78 hours */
+
+typedef struct {
+	atomic_ulong	bh_count;
+	atomic_ulong	bh_total;		/* nanoseconds */
+	atomic_ulong	bh_max;			/* nanoseconds */
+	atomic_ulong	bh_buckets[BENCH_NBUCKETS];
+} bench_hist_t;
+
+static const char *bench_names[BENCH_NSTAGES] = {
+	"demux",
+	"decode",
+	"convert",
+	"ident",
+	"ident:pos",
+	"ident:char",
+	"ident:item",
+	"ident:start",
+	"ident:track",
+	"frame",
+	"emit",
+};
+
+static boolean_t bench_enabled = B_FALSE;
+static uint64_t bench_t0;			/* when enabled */
+static struct rusage bench_ru0;			/* usage when enabled */
+static bench_hist_t bench_hists[BENCH_NSTAGES];
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+void
+bench_enable(void)
+{
+	bench_enabled = B_TRUE;
+	(void) getrusage(RUSAGE_SELF, &bench_ru0);
+	bench_t0 = bench_now();
+}
+
+uint64_t
+bench_start(void)
+{
+	return (bench_enabled ? bench_now() : 0);
+}
+
+void
+bench_done(bench_stage_t stage, uint64_t start)
+{
+	bench_hist_t *bhp = &bench_hists[stage];
+	unsigned long ns, max;
+	unsigned int b;
+
+	if (start == 0)
+		return;
+
+	ns = bench_now() - start;
+	for (b = 0; b < BENCH_NBUCKETS - 1 && (ns >> (b + 1)) != 0; b++)
+		continue;
+
+	(void) atomic_fetch_add(&bhp->bh_buckets[b], 1);
+	(void) atomic_fetch_add(&bhp->bh_count, 1);
+	(void) atomic_fetch_add(&bhp->bh_total, ns);
+
+	max = atomic_load(&bhp->bh_max);
+	while (ns > max &&
+	    !atomic_compare_exchange_weak(&bhp->bh_max, &max, ns))
+		continue;
+}
+
+/*
+ * Returns the "pct"th percentile of a stage's times, in microseconds.
+ */
+static double
+bench_percentile(bench_hist_t *bhp, unsigned long count, double pct)
+{
+	unsigned long want, seen, max;
+	unsigned int b;
+
+	max = atomic_load(&bhp->bh_max);
+	want = (unsigned long)(count * pct / 100 + 0.999999);
+	seen = 0;
+	for (b = 0; b < BENCH_NBUCKETS; b++) {
+		seen += atomic_load(&bhp->bh_buckets[b]);
+		if (seen >= want)
+			break;
+	}
+
+	if (b < BENCH_NBUCKETS - 1 && (2UL << b) - 1 < max)
+		max = (2UL << b) - 1;
+
+	return (max / 1000.0);
+}
+
+void
+bench_report(FILE *fp, boolean_t json)
+{
+	struct rusage ru;
+	bench_hist_t *bhp;
+	unsigned long nframes, count;
+	double secs, fps, mean, p50, p90, p99, max;
+	long maxrss, minflt, majflt;
+	int i;
+
+	secs = (bench_now() - bench_t0) / 1e9;
+	nframes = atomic_load(&bench_hists[BENCH_FRAME].bh_count);
+	fps = secs > 0 ? nframes / secs : 0;
+
+	/*
+	 * The peak RSS is in kilobytes except on OS X, where it's in bytes.
+	 * Some systems (like illumos) don't keep track of it, so it's 0.
+	 */
+	(void) getrusage(RUSAGE_SELF, &ru);
+	maxrss = ru.ru_maxrss;
+#ifdef __APPLE__
+	maxrss /= 1024;
+#endif
+	minflt = ru.ru_minflt - bench_ru0.ru_minflt;
+	majflt = ru.ru_majflt - bench_ru0.ru_majflt;
+
+	if (json) {
+		(void) fprintf(fp, "{ \"frames\": %lu, \"seconds\": %.3f, "
+		    "\"fps\": %.1f, \"maxrss_kb\": %ld, \"minflt\": %ld, "
+		    "\"majflt\": %ld, \"stages\": { ", nframes, secs, fps,
+		    maxrss, minflt, majflt);
+	} else {
+		(void) fprintf(fp, "frames: %lu in %.3fs (%.1f fps)\n",
+		    nframes, secs, fps);
+		if (maxrss != 0)
+			(void) fprintf(fp, "peak RSS: %ld KB\n", maxrss);
+		(void) fprintf(fp, "page faults: %ld minor, %ld major\n\n",
+		    minflt, majflt);
+		(void) fprintf(fp, "%-12s %9s %10s %9s %9s %9s %9s %9s\n",
+		    "STAGE", "COUNT", "TOTAL(ms)", "MEAN(us)", "P50(us)",
+		    "P90(us)", "P99(us)", "MAX(us)");
+	}
+
+	for (i = 0; i < BENCH_NSTAGES; i++) {
+		bhp = &bench_hists[i];
+		count = atomic_load(&bhp->bh_count);
+		mean = count == 0 ? 0 :
+		    atomic_load(&bhp->bh_total) / 1000.0 / count;
+		p50 = count == 0 ? 0 : bench_percentile(bhp, count, 50);
+		p90 = count == 0 ? 0 : bench_percentile(bhp, count, 90);
+		p99 = count == 0 ? 0 : bench_percentile(bhp, count, 99);
+		max = atomic_load(&bhp->bh_max) / 1000.0;
+
+		if (json) {
+			(void) fprintf(fp, "%s\"%s\": { \"count\": %lu, "
+			    "\"total_ms\": %.3f, \"mean_us\": %.1f, "
+			    "\"p50_us\": %.1f, \"p90_us\": %.1f, "
+			    "\"p99_us\": %.1f, \"max_us\": %.1f }",
+			    i == 0 ? "" : ", ", bench_names[i], count,
+			    atomic_load(&bhp->bh_total) / 1e6, mean, p50, p90,
+			    p99, max);
+		} else {
+			(void) fprintf(fp, "%-12s %9lu %10.1f %9.1f %9.1f "
+			    "%9.1f %9.1f %9.1f\n", bench_names[i], count,
+			    atomic_load(&bhp->bh_total) / 1e6, mean, p50, p90,
+			    p99, max);
+		}
+	}
+
+	if (json)
+		(void) fprintf(fp, " } }\n");
+
+	(void) fflush(fp);
+}
@@ -0,0 +1,54 @@
+/*
+ * bench.h: per-stage timing for "kartvid bench"
+ */
+
+#ifndef BENCH_H
+#define	BENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "compat.h"
+
+/*
+ * The stages of processing a video that are timed.  Some stages contain
+ * others: "frame" (kv_vidctx_frame()) includes "emit", and when frames aren't
+ * identified ahead of time, "ident" as well.  "ident" (all of kv_ident() for
+ * one frame) includes the evaluation of each mask, which is broken down by
+ * mask class, in the same order as kv.c ranks the classes.  When several
+ * threads are used, the stages overlap, so their totals can add up to more
+ * than the elapsed time.
+ */
+typedef enum {
+	BENCH_DEMUX,		/* reading a packet */
+	BENCH_DECODE,		/* decoding a packet */
+	BENCH_CONVERT,		/* converting (or copying) a decoded frame */
+	BENCH_IDENT,		/* identifying a frame */
+	BENCH_MASK_POS,		/* evaluating a position mask */
+	BENCH_MASK_CHAR,	/* evaluating a character mask */
+	BENCH_MASK_ITEM,	/* evaluating an item mask */
+	BENCH_MASK_START,	/* evaluating a race start mask */
+	BENCH_MASK_TRACK,	/* evaluating a track mask */
+	BENCH_FRAME,		/* kv_vidctx_frame() */
+	BENCH_EMIT,		/* emitting a changed frame */
+	BENCH_NSTAGES
+} bench_stage_t;
+
+/*
+ * Timing is off until bench_enable() is called, and bench_start() returns 0
+ * while it's off, which bench_done() ignores.  This lets the stages be timed
+ * unconditionally at negligible cost.  Enabling must be done before any other
+ * threads are using these.
+ */
+void bench_enable(void);
+uint64_t bench_start(void);
+void bench_done(bench_stage_t, uint64_t);
+
+/*
+ * Reports the frame rate (based on how many frames reached "frame"), a
+ * histogram summary for each stage, and the process's resource usage since
+ * bench_enable(), either as a table or as JSON.
+ */
+void bench_report(FILE *, boolean_t);
+
+#endif
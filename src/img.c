@@ -11,8 +11,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "img.h"
+#include "img_cmp.h"
 
 static img_t *img_read_ppm(FILE *, const char *);
 static img_t *img_read_png(FILE *, const char *);
@@ -97,7 +99,7 @@ img_read(const char *filename)
 			i = img_coord(rv, x, y);
 			imagepx = &rv->img_pixels[i];
 
-			if (imagepx->r < 2 && imagepx->g < 2 && imagepx->b < 2)
+			if (IMG_PX_BLACK(imagepx))
 				continue;
 
 			if (x < rv->img_minx)
@@ -372,8 +374,13 @@ img_pix_rgb2hsv(img_pixelhsv_t *hsv, img_pixel_t *rgb)
 	hsv->h = h;
 }
 
-double
-img_compare(img_t *image, img_t *mask, img_t **dbgmask)
+/*
+ * This is the original pixel-at-a-time implementation of img_compare(), which
+ * we still use when generating a debug image or printing details about the
+ * comparison.
+ */
+static double
+img_compare_debug(img_t *image, img_t *mask, img_t **dbgmask)
 {
 	unsigned int x, y, i;
 	unsigned int dr, dg, db, dz2;
@@ -386,9 +393,6 @@ img_compare(img_t *image, img_t *mask, img_t **dbgmask)
 	if (dbgmask != NULL)
 		*dbgmask = img_alloc(image->img_width, image->img_height);
 
-	assert(image->img_width == mask->img_width);
-	assert(image->img_height == mask->img_height);
-
 	for (y = mask->img_miny; y < mask->img_maxy; y++) {
 		for (x = mask->img_minx; x < mask->img_maxx; x++) {
 			i = img_coord(image, x, y);
@@ -398,7 +402,7 @@ img_compare(img_t *image, img_t *mask, img_t **dbgmask)
 			/*
 			 * Ignore nearly-black pixels in the mask.
 			 */
-			if (maskpx->r < 2 && maskpx->g < 2 && maskpx->b < 2) {
+			if (IMG_PX_BLACK(maskpx)) {
 				nignored++;
 				continue;
 			}
@@ -443,6 +447,1020 @@ img_compare(img_t *image, img_t *mask, img_t **dbgmask)
 	return (score);
 }
 
+/*
+ * Returns the floating-point score that img_compare_debug() computes, which is
+ * the reference that the fixed-point scores are checked against.
+ */
+double
+img_compare_float(img_t *image, img_t *mask)
+{
+	assert(image->img_width == mask->img_width);
+	assert(image->img_height == mask->img_height);
+
+	return (img_compare_debug(image, mask, NULL));
+}
+
+double
+img_compare(img_t *image, img_t *mask, img_t **dbgmask)
+{
+	img_mask_t *compiled;
+	double score;
+
+	assert(image->img_width == mask->img_width);
+	assert(image->img_height == mask->img_height);
+
+	if (dbgmask != NULL || kv_debug > 3)
+		return (img_compare_debug(image, mask, dbgmask));
+
+	if ((compiled = img_mask_compile(mask)) == NULL) {
+		warn("img_compare");
+		return (img_compare_debug(image, mask, NULL));
+	}
+
+	score = IMG_SCORE_DOUBLE(img_mask_compare(image, compiled));
+	img_mask_free(compiled);
+	return (score);
+}
+
+/*
+ * Computes the average of the bs x bs block of pixels whose top-left corner is
+ * at (bs * bx, bs * by), rounding each subpixel to the nearest integer.
+ * Returns true if any pixel in the block is black.
+ */
+static boolean_t
+img_block_mean(img_t *image, unsigned int bx, unsigned int by,
+    unsigned int bs, img_pixel_t *meanp)
+{
+	img_pixel_t *px;
+	unsigned int x, y, r, g, b;
+	boolean_t black = B_FALSE;
+
+	r = g = b = 0;
+	for (y = by * bs; y < (by + 1) * bs; y++) {
+		px = &image->img_pixels[img_coord(image, bx * bs, y)];
+		for (x = 0; x < bs; x++, px++) {
+			black |= IMG_PX_BLACK(px);
+			r += px->r;
+			g += px->g;
+			b += px->b;
+		}
+	}
+
+	meanp->r = (r + bs * bs / 2) / (bs * bs);
+	meanp->g = (g + bs * bs / 2) / (bs * bs);
+	meanp->b = (b + bs * bs / 2) / (bs * bs);
+	return (black);
+}
+
+static img_mask_t *img_mask_compile_runs(img_t *);
+
+/*
+ * Compute the coarse views of a mask.  Only blocks containing no black pixels
+ * are included, since a lower bound on the distance between an image and a
+ * mask can only be computed for those (see img_mask_coarse_reject()).
+ */
+static int
+img_mask_levels(img_mask_t *mask, img_t *image)
+{
+	img_t *coarse;
+	img_pixel_t mean;
+	unsigned int l, bs, bx, by;
+
+	for (l = 0; l < IMG_PYR_NLEVELS; l++) {
+		bs = IMG_PYR_BLOCK(l);
+		if ((coarse = img_alloc(image->img_width / bs,
+		    image->img_height / bs)) == NULL)
+			return (-1);
+
+		coarse->img_minx = (mask->imm_minx + bs - 1) / bs;
+		coarse->img_maxx = mask->imm_maxx / bs;
+		coarse->img_miny = (mask->imm_miny + bs - 1) / bs;
+		coarse->img_maxy = mask->imm_maxy / bs;
+
+		for (by = coarse->img_miny; by < coarse->img_maxy; by++) {
+			for (bx = coarse->img_minx; bx < coarse->img_maxx;
+			    bx++) {
+				if (!img_block_mean(image, bx, by, bs, &mean))
+					coarse->img_pixels[
+					    img_coord(coarse, bx, by)] = mean;
+			}
+		}
+
+		mask->imm_levels[l] = img_mask_compile_runs(coarse);
+		img_free(coarse);
+		if (mask->imm_levels[l] == NULL)
+			return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Compile a mask image into the compact form used for matching: just the runs
+ * of non-black pixels inside the bounding box computed by img_read(), plus
+ * coarse views of the same.
+ */
+img_mask_t *
+img_mask_compile(img_t *image)
+{
+	img_mask_t *rv;
+
+	if ((rv = img_mask_compile_runs(image)) == NULL)
+		return (NULL);
+
+	if (img_mask_levels(rv, image) != 0) {
+		img_mask_free(rv);
+		return (NULL);
+	}
+
+	return (rv);
+}
+
+static img_mask_t *
+img_mask_compile_runs(img_t *image)
+{
+	img_mask_t *rv;
+	img_run_t *runp;
+	img_pixel_t *px;
+	unsigned int x, y, npixels, nruns;
+	boolean_t inrun;
+
+	assert(image->img_width <= UINT16_MAX);
+	assert(image->img_height <= UINT16_MAX);
+
+	npixels = nruns = 0;
+	for (y = image->img_miny; y < image->img_maxy; y++) {
+		inrun = B_FALSE;
+		for (x = image->img_minx; x < image->img_maxx; x++) {
+			px = &image->img_pixels[img_coord(image, x, y)];
+			if (IMG_PX_BLACK(px)) {
+				inrun = B_FALSE;
+				continue;
+			}
+
+			if (!inrun)
+				nruns++;
+			inrun = B_TRUE;
+			npixels++;
+		}
+	}
+
+	if ((rv = calloc(1, sizeof (*rv))) == NULL)
+		return (NULL);
+
+	rv->imm_runs = calloc(nruns + 1, sizeof (rv->imm_runs[0]));
+	rv->imm_pixels = calloc(npixels + 1, sizeof (rv->imm_pixels[0]));
+	if (rv->imm_runs == NULL || rv->imm_pixels == NULL) {
+		img_mask_free(rv);
+		return (NULL);
+	}
+
+	rv->imm_width = image->img_width;
+	rv->imm_height = image->img_height;
+	rv->imm_minx = image->img_minx;
+	rv->imm_maxx = image->img_maxx;
+	rv->imm_miny = image->img_miny;
+	rv->imm_maxy = image->img_maxy;
+
+	runp = NULL;
+	for (y = image->img_miny; y < image->img_maxy; y++) {
+		inrun = B_FALSE;
+		for (x = image->img_minx; x < image->img_maxx; x++) {
+			px = &image->img_pixels[img_coord(image, x, y)];
+			if (IMG_PX_BLACK(px)) {
+				inrun = B_FALSE;
+				continue;
+			}
+
+			if (!inrun) {
+				runp = &rv->imm_runs[rv->imm_nruns++];
+				runp->ir_x = x;
+				runp->ir_y = y;
+				runp->ir_off = rv->imm_npixels;
+			}
+
+			inrun = B_TRUE;
+			runp->ir_len++;
+			rv->imm_pixels[rv->imm_npixels++] = *px;
+		}
+	}
+
+	assert(rv->imm_nruns == nruns);
+	assert(rv->imm_npixels == npixels);
+	return (rv);
+}
+
+/*
+ * Returns the pixel at (x, y) in a mask whose runs are in raster order, or
+ * NULL if that pixel is black.  "cursorp" is the index of a run in the mask.
+ * It's advanced past any runs that end before (x, y), so a caller that looks
+ * up pixels in raster order visits each run just once.
+ */
+static const img_pixel_t *
+img_mask_pixel(const img_mask_t *mask, unsigned int *cursorp, unsigned int x,
+    unsigned int y)
+{
+	const img_run_t *runp;
+
+	for (; *cursorp < mask->imm_nruns; (*cursorp)++) {
+		runp = &mask->imm_runs[*cursorp];
+		if (runp->ir_y > y || (runp->ir_y == y &&
+		    runp->ir_x + runp->ir_len > x))
+			break;
+	}
+
+	if (*cursorp == mask->imm_nruns)
+		return (NULL);
+
+	runp = &mask->imm_runs[*cursorp];
+	if (runp->ir_y != y || x < runp->ir_x)
+		return (NULL);
+
+	return (&mask->imm_pixels[runp->ir_off + x - runp->ir_x]);
+}
+
+static double
+img_pixel_dist(const img_pixel_t *p1, const img_pixel_t *p2)
+{
+	int dr, dg, db;
+
+	dr = p1->r - p2->r;
+	dg = p1->g - p2->g;
+	db = p1->b - p2->b;
+	return (sqrt(dr * dr + dg * dg + db * db));
+}
+
+typedef struct {
+	img_run_t	ims_run;	/* segment of an original run */
+	double		ims_weight;	/* how distinctive the segment is */
+} img_mask_seg_t;
+
+static int
+img_mask_seg_compare(const void *v1, const void *v2)
+{
+	const img_mask_seg_t *s1 = v1, *s2 = v2;
+
+	if (s1->ims_weight != s2->ims_weight)
+		return (s1->ims_weight > s2->ims_weight ? -1 : 1);
+
+	/* Fall back to raster order so that the result is deterministic. */
+	return (s1->ims_run.ir_off < s2->ims_run.ir_off ? -1 :
+	    s1->ims_run.ir_off > s2->ims_run.ir_off);
+}
+
+/*
+ * Splits the runs of mask "which" into segments and computes how distinctive
+ * each one is.  A pixel is distinctive if it differs a lot from the pixels at
+ * the same location in other masks, since those are what the mask is most
+ * often compared against when it doesn't match.  Pixels that no other mask
+ * covers are weighed by how much they differ from the mask's average color.
+ */
+static img_mask_seg_t *
+img_mask_segments(img_mask_t **masks, unsigned int nmasks, unsigned int which,
+    unsigned int *nsegsp)
+{
+	img_mask_t *mask = masks[which];
+	img_mask_t **others, *omask;
+	unsigned int *cursors;
+	img_mask_seg_t *segs, *segp;
+	const img_pixel_t *px, *opx;
+	img_pixel_t avg;
+	img_run_t *runp;
+	unsigned int i, j, k, x, nsegs, nothers, ncovering;
+	double r, g, b, pxweight;
+
+	nsegs = 0;
+	for (i = 0; i < mask->imm_nruns; i++) {
+		nsegs += (mask->imm_runs[i].ir_len + IMG_MASK_SEGLEN - 1) /
+		    IMG_MASK_SEGLEN;
+	}
+
+	segs = calloc(nsegs + 1, sizeof (segs[0]));
+	others = calloc(nmasks + 1, sizeof (others[0]));
+	cursors = calloc(nmasks + 1, sizeof (cursors[0]));
+	if (segs == NULL || others == NULL || cursors == NULL) {
+		free(segs);
+		free(others);
+		free(cursors);
+		return (NULL);
+	}
+
+	/* Only masks whose bounding boxes overlap this one's matter. */
+	nothers = 0;
+	for (k = 0; k < nmasks; k++) {
+		omask = masks[k];
+		if (k != which &&
+		    omask->imm_minx < mask->imm_maxx &&
+		    mask->imm_minx < omask->imm_maxx &&
+		    omask->imm_miny < mask->imm_maxy &&
+		    mask->imm_miny < omask->imm_maxy)
+			others[nothers++] = omask;
+	}
+
+	r = g = b = 0;
+	avg.r = avg.g = avg.b = 0;
+	for (i = 0; i < mask->imm_npixels; i++) {
+		r += mask->imm_pixels[i].r;
+		g += mask->imm_pixels[i].g;
+		b += mask->imm_pixels[i].b;
+	}
+
+	if (mask->imm_npixels > 0) {
+		avg.r = (uint8_t)(r / mask->imm_npixels + 0.5);
+		avg.g = (uint8_t)(g / mask->imm_npixels + 0.5);
+		avg.b = (uint8_t)(b / mask->imm_npixels + 0.5);
+	}
+
+	segp = segs;
+	for (i = 0; i < mask->imm_nruns; i++) {
+		runp = &mask->imm_runs[i];
+		for (j = 0; j < runp->ir_len; j += IMG_MASK_SEGLEN, segp++) {
+			segp->ims_run.ir_x = runp->ir_x + j;
+			segp->ims_run.ir_y = runp->ir_y;
+			segp->ims_run.ir_off = runp->ir_off + j;
+			segp->ims_run.ir_len = runp->ir_len - j;
+			if (segp->ims_run.ir_len > IMG_MASK_SEGLEN)
+				segp->ims_run.ir_len = IMG_MASK_SEGLEN;
+
+			for (x = 0; x < segp->ims_run.ir_len; x++) {
+				px = &mask->imm_pixels[
+				    segp->ims_run.ir_off + x];
+				pxweight = 0;
+				ncovering = 0;
+
+				for (k = 0; k < nothers; k++) {
+					if ((opx = img_mask_pixel(others[k],
+					    &cursors[k], segp->ims_run.ir_x + x,
+					    runp->ir_y)) == NULL)
+						continue;
+
+					pxweight += img_pixel_dist(px, opx);
+					ncovering++;
+				}
+
+				segp->ims_weight += ncovering > 0 ?
+				    pxweight / ncovering :
+				    img_pixel_dist(px, &avg);
+			}
+
+			segp->ims_weight /= segp->ims_run.ir_len;
+		}
+	}
+
+	assert(segp == segs + nsegs);
+	free(others);
+	free(cursors);
+	*nsegsp = nsegs;
+	return (segs);
+}
+
+/*
+ * Reorders the runs of each of the given masks, all of which must be freshly
+ * compiled, so that their most distinctive pixels come first (see
+ * img_mask_segments()).  This doesn't change the result of img_mask_compare(),
+ * since scores are summed in fixed point.
+ */
+int
+img_mask_order(img_mask_t **masks, unsigned int nmasks)
+{
+	img_mask_seg_t **segs;
+	unsigned int *nsegs;
+	img_run_t *runs;
+	img_pixel_t *pixels;
+	unsigned int i, j, off;
+	int rv = -1;
+
+	segs = calloc(nmasks + 1, sizeof (segs[0]));
+	nsegs = calloc(nmasks + 1, sizeof (nsegs[0]));
+	if (segs == NULL || nsegs == NULL)
+		goto out;
+
+	/*
+	 * We must compute all of the weights before modifying any masks
+	 * because img_mask_pixel() relies on the runs being in raster order.
+	 */
+	for (i = 0; i < nmasks; i++) {
+		if ((segs[i] = img_mask_segments(masks, nmasks, i,
+		    &nsegs[i])) == NULL)
+			goto out;
+
+		qsort(segs[i], nsegs[i], sizeof (segs[i][0]),
+		    img_mask_seg_compare);
+	}
+
+	/*
+	 * Repack each mask's pixels in the new order, too, so that we still
+	 * read them sequentially.
+	 */
+	for (i = 0; i < nmasks; i++) {
+		runs = calloc(nsegs[i] + 1, sizeof (runs[0]));
+		pixels = calloc(masks[i]->imm_npixels + 1, sizeof (pixels[0]));
+		if (runs == NULL || pixels == NULL) {
+			free(runs);
+			free(pixels);
+			goto out;
+		}
+
+		for (j = 0, off = 0; j < nsegs[i]; j++) {
+			runs[j] = segs[i][j].ims_run;
+			runs[j].ir_off = off;
+			(void) memcpy(&pixels[off],
+			    &masks[i]->imm_pixels[segs[i][j].ims_run.ir_off],
+			    runs[j].ir_len * sizeof (pixels[0]));
+			off += runs[j].ir_len;
+		}
+
+		assert(off == masks[i]->imm_npixels);
+		free(masks[i]->imm_runs);
+		free(masks[i]->imm_pixels);
+		masks[i]->imm_runs = runs;
+		masks[i]->imm_pixels = pixels;
+		masks[i]->imm_nruns = nsegs[i];
+	}
+
+	rv = 0;
+
+out:
+	if (segs != NULL) {
+		for (i = 0; i < nmasks; i++)
+			free(segs[i]);
+	}
+
+	free(segs);
+	free(nsegs);
+	return (rv);
+}
+
+/*
+ * Returns a copy of a compiled mask whose pixels hold BT.601 limited-range
+ * (Y, Cb, Cr) values in place of (R, G, B), for use with
+ * img_mask_compare_yuv().  Each mask pixel keeps its own chroma, so comparing
+ * it against a frame's subsampled chroma is the same comparison we'd make
+ * after converting the frame to RGB with point sampling.  The copy has no
+ * coarse views.
+ */
+img_mask_t *
+img_mask_yuv(const img_mask_t *mask)
+{
+	img_mask_t *rv;
+	const img_pixel_t *src;
+	img_pixel_t *dst;
+	unsigned int i;
+
+	if ((rv = calloc(1, sizeof (*rv))) == NULL)
+		return (NULL);
+
+	*rv = *mask;
+	bzero(rv->imm_levels, sizeof (rv->imm_levels));
+	rv->imm_runs = calloc(mask->imm_nruns + 1, sizeof (rv->imm_runs[0]));
+	rv->imm_pixels = calloc(mask->imm_npixels + 1,
+	    sizeof (rv->imm_pixels[0]));
+	if (rv->imm_runs == NULL || rv->imm_pixels == NULL) {
+		img_mask_free(rv);
+		return (NULL);
+	}
+
+	bcopy(mask->imm_runs, rv->imm_runs,
+	    mask->imm_nruns * sizeof (rv->imm_runs[0]));
+
+	for (i = 0; i < mask->imm_npixels; i++) {
+		src = &mask->imm_pixels[i];
+		dst = &rv->imm_pixels[i];
+		dst->r = (16829 * src->r + 33039 * src->g + 6416 * src->b +
+		    (16 << 16) + (1 << 15)) >> 16;
+		dst->g = (-9714 * src->r - 19070 * src->g + 28784 * src->b +
+		    (128 << 16) + (1 << 15)) >> 16;
+		dst->b = (28784 * src->r - 24103 * src->g - 4681 * src->b +
+		    (128 << 16) + (1 << 15)) >> 16;
+	}
+
+	return (rv);
+}
+
+/*
+ * Like img_mask_compare_thresh() without a pyramid, but for a YUV frame and a
+ * mask built by img_mask_yuv().
+ */
+img_score_t
+img_mask_compare_yuv(const img_yuv_t *image, const img_mask_t *mask,
+    img_score_t thresh, unsigned int *npixelsp)
+{
+	unsigned int i, y, ncompared;
+	uint64_t sum, limit;
+	const img_run_t *runp;
+
+	assert(image->iy_width == mask->imm_width);
+	assert(image->iy_height == mask->imm_height);
+
+	limit = img_cmp_limit(thresh, mask->imm_npixels);
+	sum = 0;
+	ncompared = 0;
+
+	for (i = 0; i < mask->imm_nruns && sum <= limit; i++) {
+		runp = &mask->imm_runs[i];
+		y = runp->ir_y;
+		ncompared += runp->ir_len;
+		sum += img_cmp_span_yuv(
+		    image->iy_planes[0] + y * image->iy_strides[0],
+		    image->iy_planes[1] +
+		    (y >> image->iy_yshift) * image->iy_strides[1],
+		    image->iy_planes[2] +
+		    (y >> image->iy_yshift) * image->iy_strides[2],
+		    runp->ir_x, image->iy_xshift,
+		    &mask->imm_pixels[runp->ir_off], runp->ir_len);
+	}
+
+	if (npixelsp != NULL)
+		*npixelsp += ncompared;
+	return (img_cmp_score(sum, mask->imm_npixels));
+}
+
+/*
+ * A region's copy holds its rows one after another (for YUV frames, the rows
+ * of each plane in turn), so two frames' regions are the same exactly when
+ * their copies are.  Returns whether the copy had to be resized, in which case
+ * it can't match; if that fails, the copy is left empty so that it never
+ * matches anything.
+ */
+static boolean_t
+img_region_size(img_region_t *rp, unsigned int width, unsigned int height,
+    size_t size)
+{
+	uint8_t *bytes;
+
+	if (rp->irg_width == width && rp->irg_height == height &&
+	    rp->irg_size == size)
+		return (B_FALSE);
+
+	rp->irg_width = 0;
+	rp->irg_height = 0;
+	rp->irg_size = 0;
+	if (size > rp->irg_alloc) {
+		if ((bytes = realloc(rp->irg_bytes, size)) == NULL)
+			return (B_TRUE);
+		rp->irg_bytes = bytes;
+		rp->irg_alloc = size;
+	}
+
+	rp->irg_width = width;
+	rp->irg_height = height;
+	rp->irg_size = size;
+	return (B_TRUE);
+}
+
+/*
+ * Compare one plane's rows of a region to the copy starting at *offp, and save
+ * every row from the first that differs.
+ */
+static boolean_t
+img_region_plane(img_region_t *rp, size_t *offp, boolean_t same,
+    const uint8_t *plane, size_t stride, size_t bpp, unsigned int minx,
+    unsigned int maxx, unsigned int miny, unsigned int maxy)
+{
+	const uint8_t *row;
+	size_t len;
+	unsigned int y;
+
+	len = (maxx - minx) * bpp;
+	for (y = miny; y < maxy; y++, *offp += len) {
+		row = plane + y * stride + minx * bpp;
+		if (same && bcmp(rp->irg_bytes + *offp, row, len) == 0)
+			continue;
+
+		same = B_FALSE;
+		bcopy(row, rp->irg_bytes + *offp, len);
+	}
+
+	return (same);
+}
+
+/*
+ * Returns whether the given region of an image is byte-for-byte the same as
+ * the copy in "rp", which must have come from an image of the same size.  If
+ * it's not, the region is copied into "rp" for next time.  An all-zero
+ * img_region_t matches nothing.
+ */
+boolean_t
+img_region_same(img_region_t *rp, const img_t *image, const img_box_t *box)
+{
+	unsigned int maxx, maxy;
+	boolean_t resized;
+	size_t size, off;
+
+	maxx = MIN(box->ib_maxx, image->img_width);
+	maxy = MIN(box->ib_maxy, image->img_height);
+	size = 0;
+	if (box->ib_minx < maxx && box->ib_miny < maxy)
+		size = (size_t)(maxx - box->ib_minx) * (maxy - box->ib_miny) *
+		    sizeof (img_pixel_t);
+
+	resized = img_region_size(rp, image->img_width, image->img_height,
+	    size);
+	if (rp->irg_width == 0)
+		return (B_FALSE);
+
+	if (size == 0)
+		return (!resized);
+
+	off = 0;
+	return (img_region_plane(rp, &off, !resized,
+	    (const uint8_t *)image->img_pixels,
+	    image->img_width * sizeof (img_pixel_t), sizeof (img_pixel_t),
+	    box->ib_minx, maxx, box->ib_miny, maxy));
+}
+
+/*
+ * Like img_region_same(), but for a YUV frame, covering all of the chroma
+ * samples that any pixel in the box uses.
+ */
+boolean_t
+img_region_same_yuv(img_region_t *rp, const img_yuv_t *image,
+    const img_box_t *box)
+{
+	unsigned int i, maxx, maxy, xs, ys;
+	unsigned int minxs[3], maxxs[3], minys[3], maxys[3];
+	boolean_t resized, same;
+	size_t size, off;
+
+	maxx = MIN(box->ib_maxx, image->iy_width);
+	maxy = MIN(box->ib_maxy, image->iy_height);
+	size = 0;
+	if (box->ib_minx < maxx && box->ib_miny < maxy) {
+		for (i = 0; i < 3; i++) {
+			xs = i == 0 ? 0 : image->iy_xshift;
+			ys = i == 0 ? 0 : image->iy_yshift;
+			minxs[i] = box->ib_minx >> xs;
+			maxxs[i] = ((maxx - 1) >> xs) + 1;
+			minys[i] = box->ib_miny >> ys;
+			maxys[i] = ((maxy - 1) >> ys) + 1;
+			size += (size_t)(maxxs[i] - minxs[i]) *
+			    (maxys[i] - minys[i]);
+		}
+	}
+
+	resized = img_region_size(rp, image->iy_width, image->iy_height, size);
+	if (rp->irg_width == 0)
+		return (B_FALSE);
+
+	if (size == 0)
+		return (!resized);
+
+	same = !resized;
+	off = 0;
+	for (i = 0; i < 3; i++)
+		same = img_region_plane(rp, &off, same, image->iy_planes[i],
+		    image->iy_strides[i], 1, minxs[i], maxxs[i], minys[i],
+		    maxys[i]);
+
+	return (same);
+}
+
+void
+img_region_fini(img_region_t *rp)
+{
+	free(rp->irg_bytes);
+	bzero(rp, sizeof (*rp));
+}
+
+void
+img_mask_free(img_mask_t *mask)
+{
+	unsigned int l;
+
+	if (mask == NULL)
+		return;
+
+	for (l = 0; l < IMG_PYR_NLEVELS; l++)
+		img_mask_free(mask->imm_levels[l]);
+
+	free(mask->imm_runs);
+	free(mask->imm_pixels);
+	free(mask);
+}
+
+/*
+ * Compare an image to a compiled mask using the best kernel available on this
+ * CPU.  See img_compare_debug() for a description of the score, which we
+ * compute here entirely in fixed point.
+ */
+img_score_t
+img_mask_compare(img_t *image, img_mask_t *mask)
+{
+	unsigned int i;
+	uint64_t sum = 0;
+	img_score_t score;
+	img_run_t *runp;
+	img_cmp_span_f span;
+
+	assert(image->img_width == mask->imm_width);
+	assert(image->img_height == mask->imm_height);
+
+	span = img_cmp_impl()->icm_span;
+	for (i = 0; i < mask->imm_nruns; i++) {
+		runp = &mask->imm_runs[i];
+		sum += span(&image->img_pixels[
+		    img_coord(image, runp->ir_x, runp->ir_y)],
+		    &mask->imm_pixels[runp->ir_off], runp->ir_len);
+	}
+
+	score = img_cmp_score(sum, mask->imm_npixels);
+
+	if (kv_debug > 3) {
+		(void) printf("compared pixels:  %d\n", mask->imm_npixels);
+		(void) printf("difference score: %f\n",
+		    IMG_SCORE_DOUBLE(score));
+	}
+
+	return (score);
+}
+
+/*
+ * Compares the runs of "mask" against "image" until the sum of the fixed-point
+ * distances exceeds "limit", and returns the sum.  The number of pixels
+ * compared is returned in "ncomparedp".
+ */
+static uint64_t
+img_mask_sum(img_t *image, img_mask_t *mask, uint64_t limit,
+    unsigned int *ncomparedp)
+{
+	unsigned int i, ncompared;
+	uint64_t sum;
+	img_run_t *runp;
+	img_cmp_span_f span;
+
+	span = img_cmp_impl()->icm_span;
+	sum = 0;
+	ncompared = 0;
+
+	for (i = 0; i < mask->imm_nruns; i++) {
+		runp = &mask->imm_runs[i];
+		sum += span(&image->img_pixels[
+		    img_coord(image, runp->ir_x, runp->ir_y)],
+		    &mask->imm_pixels[runp->ir_off], runp->ir_len);
+		ncompared += runp->ir_len;
+
+		if (sum > limit)
+			break;
+	}
+
+	*ncomparedp = ncompared;
+	return (sum);
+}
+
+/*
+ * Returns true if the coarse view of a mask at level "l" shows that comparing
+ * the mask to the image whose pyramid is "pyr" at full resolution would produce
+ * a sum greater than "limit".
+ *
+ * By the triangle inequality, the sum of the distances between the pixels of a
+ * block is at least the block size times the distance between the block
+ * averages, and pixels outside the mask's coarse view can only add to that.
+ * The slack accounts for the errors from rounding the averages (up to sqrt(3)
+ * per pixel) and from the square root table (just over 1/2 for each of the
+ * fine and coarse distances), so the test never rejects a mask that would
+ * actually have matched.
+ */
+#define	IMG_PYR_SLACK	223	/* ceil(sqrt(3) * 2^IMG_SQRT_SHIFT + 1) */
+
+static boolean_t
+img_mask_coarse_reject(const img_pyramid_t *pyr, const img_mask_t *mask,
+    unsigned int l, uint64_t limit, unsigned int *ncomparedp)
+{
+	img_mask_t *coarse = mask->imm_levels[l];
+	unsigned int bs, ncompared;
+	uint64_t climit;
+	boolean_t rv;
+
+	if (coarse == NULL || coarse->imm_npixels == 0)
+		return (B_FALSE);
+
+	bs = IMG_PYR_BLOCK(l);
+	climit = limit / (bs * bs) +
+	    (uint64_t)IMG_PYR_SLACK * coarse->imm_npixels;
+	rv = img_mask_sum((img_t *)&pyr->ipy_levels[l], coarse, climit,
+	    &ncompared) > climit;
+	*ncomparedp += ncompared;
+	return (rv);
+}
+
+/*
+ * Like img_mask_compare(), but gives up as soon as it's clear that the score
+ * will exceed "thresh".  In that case, the returned score is greater than
+ * "thresh" but is otherwise meaningless.  If "pyr" is not NULL, it must be the
+ * pyramid for "image", and we first check the mask's coarse views against it,
+ * from coarsest to finest.  The full-resolution comparison is most effective on
+ * masks that have been processed with img_mask_order().  If "npixelsp" is not
+ * NULL, the number of pixels actually compared (including those of the coarse
+ * views) is added to it.
+ */
+img_score_t
+img_mask_compare_thresh(img_t *image, const img_pyramid_t *pyr,
+    img_mask_t *mask, img_score_t thresh, unsigned int *npixelsp)
+{
+	unsigned int l, ncoarse, ncompared;
+	uint64_t sum, limit;
+
+	assert(image->img_width == mask->imm_width);
+	assert(image->img_height == mask->imm_height);
+
+	limit = img_cmp_limit(thresh, mask->imm_npixels);
+	ncoarse = 0;
+
+	for (l = IMG_PYR_NLEVELS; pyr != NULL && l-- > 0; ) {
+		if (!img_mask_coarse_reject(pyr, mask, l, limit, &ncoarse))
+			continue;
+
+		if (kv_debug > 3)
+			(void) printf("rejected at %dx\n", IMG_PYR_BLOCK(l));
+
+		if (npixelsp != NULL)
+			*npixelsp += ncoarse;
+		return (img_cmp_score(limit + 1, mask->imm_npixels));
+	}
+
+	sum = img_mask_sum(image, mask, limit, &ncompared);
+
+	if (kv_debug > 3)
+		(void) printf("compared pixels:  %d of %d%s\n", ncompared,
+		    mask->imm_npixels, sum > limit ? " (over threshold)" : "");
+
+	if (npixelsp != NULL)
+		*npixelsp += ncoarse + ncompared;
+	return (img_cmp_score(sum, mask->imm_npixels));
+}
+
+/*
+ * Records that the given mask will be compared against images using this
+ * pyramid.  If this is called at all, img_pyramid_build() only computes the
+ * parts of each level that are covered by the coarse views of these masks,
+ * which are usually a small part of the image.  Coverage is tracked in tiles
+ * the size of a block at the coarsest level.
+ */
+int
+img_pyramid_need(img_pyramid_t *pyr, img_mask_t *mask)
+{
+	img_mask_t *coarse;
+	img_run_t *runp;
+	unsigned int l, i, x, shift;
+
+	if (pyr->ipy_need == NULL) {
+		pyr->ipy_needw =
+		    mask->imm_width / IMG_PYR_BLOCK(IMG_PYR_NLEVELS - 1);
+		pyr->ipy_needh =
+		    mask->imm_height / IMG_PYR_BLOCK(IMG_PYR_NLEVELS - 1);
+		if ((pyr->ipy_need = calloc(pyr->ipy_needw * pyr->ipy_needh + 1,
+		    sizeof (pyr->ipy_need[0]))) == NULL)
+			return (-1);
+	}
+
+	for (l = 0; l < IMG_PYR_NLEVELS; l++) {
+		if ((coarse = mask->imm_levels[l]) == NULL)
+			continue;
+
+		shift = IMG_PYR_NLEVELS - 1 - l;
+		for (i = 0; i < coarse->imm_nruns; i++) {
+			runp = &coarse->imm_runs[i];
+			for (x = runp->ir_x; x < runp->ir_x + runp->ir_len;
+			    x++) {
+				if ((x >> shift) < pyr->ipy_needw &&
+				    (runp->ir_y >> shift) < pyr->ipy_needh)
+					pyr->ipy_need[(x >> shift) +
+					    pyr->ipy_needw *
+					    (runp->ir_y >> shift)] = 1;
+			}
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Compute the pyramid for an image, reusing the pyramid's existing buffers if
+ * they're big enough.  The pyramid should be zero-filled initially and freed
+ * with img_pyramid_fini().  We keep the exact block sums for each level so that
+ * the next level can be computed from them without compounding rounding errors.
+ */
+int
+img_pyramid_build(img_pyramid_t *pyr, img_t *image)
+{
+	unsigned int l, bs, x, y, w, pw, shift, half, tshift;
+	unsigned int r, g, b;
+	uint8_t *need;
+	size_t size;
+	img_t *coarse;
+	img_pixel_t *px, *src;
+	uint16_t *sums, *psums, *sp;
+
+	size = 0;
+	for (l = 0; l < IMG_PYR_NLEVELS; l++) {
+		bs = IMG_PYR_BLOCK(l);
+		size += (size_t)(image->img_width / bs) *
+		    (image->img_height / bs);
+	}
+
+	if (size > pyr->ipy_size) {
+		free(pyr->ipy_levels[0].img_pixels);
+		free(pyr->ipy_sums);
+		pyr->ipy_levels[0].img_pixels = calloc(size,
+		    sizeof (img_pixel_t));
+		pyr->ipy_sums = calloc(3 * size, sizeof (uint16_t));
+		pyr->ipy_size = size;
+
+		if (pyr->ipy_levels[0].img_pixels == NULL ||
+		    pyr->ipy_sums == NULL) {
+			free(pyr->ipy_levels[0].img_pixels);
+			free(pyr->ipy_sums);
+			pyr->ipy_levels[0].img_pixels = NULL;
+			pyr->ipy_sums = NULL;
+			pyr->ipy_size = 0;
+			return (-1);
+		}
+	}
+
+	px = pyr->ipy_levels[0].img_pixels;
+	sums = pyr->ipy_sums;
+	psums = NULL;
+	pw = 0;
+
+	need = pyr->ipy_need;
+	if (need != NULL && (pyr->ipy_needw !=
+	    image->img_width / IMG_PYR_BLOCK(IMG_PYR_NLEVELS - 1) ||
+	    pyr->ipy_needh !=
+	    image->img_height / IMG_PYR_BLOCK(IMG_PYR_NLEVELS - 1)))
+		need = NULL;
+
+	for (l = 0; l < IMG_PYR_NLEVELS; l++) {
+		bs = IMG_PYR_BLOCK(l);
+		shift = 2 * (l + 1);
+		half = bs * bs / 2;
+		tshift = IMG_PYR_NLEVELS - 1 - l;
+		coarse = &pyr->ipy_levels[l];
+		coarse->img_width = w = image->img_width / bs;
+		coarse->img_height = image->img_height / bs;
+		coarse->img_minx = 0;
+		coarse->img_maxx = coarse->img_width;
+		coarse->img_miny = 0;
+		coarse->img_maxy = coarse->img_height;
+		coarse->img_pixels = px;
+
+		for (y = 0; y < coarse->img_height; y++) {
+			for (x = 0; x < w; x++, px++, sums += 3) {
+				if (need != NULL && !need[(x >> tshift) +
+				    pyr->ipy_needw * (y >> tshift)])
+					continue;
+
+				/*
+				 * Each block is made up of a 2x2 square of
+				 * blocks from the previous level (or pixels,
+				 * for the first level).
+				 */
+				if (l == 0) {
+					src = &image->img_pixels[
+					    img_coord(image, 2 * x, 2 * y)];
+					r = src[0].r + src[1].r +
+					    src[image->img_width].r +
+					    src[image->img_width + 1].r;
+					g = src[0].g + src[1].g +
+					    src[image->img_width].g +
+					    src[image->img_width + 1].g;
+					b = src[0].b + src[1].b +
+					    src[image->img_width].b +
+					    src[image->img_width + 1].b;
+				} else {
+					sp = &psums[3 * (2 * x + pw * 2 * y)];
+					r = sp[0] + sp[3] +
+					    sp[3 * pw] + sp[3 * pw + 3];
+					g = sp[1] + sp[4] +
+					    sp[3 * pw + 1] + sp[3 * pw + 4];
+					b = sp[2] + sp[5] +
+					    sp[3 * pw + 2] + sp[3 * pw + 5];
+				}
+
+				sums[0] = r;
+				sums[1] = g;
+				sums[2] = b;
+				px->r = (r + half) >> shift;
+				px->g = (g + half) >> shift;
+				px->b = (b + half) >> shift;
+			}
+		}
+
+		psums = sums - 3 * w * coarse->img_height;
+		pw = w;
+	}
+
+	return (0);
+}
+
+void
+img_pyramid_fini(img_pyramid_t *pyr)
+{
+	free(pyr->ipy_levels[0].img_pixels);
+	free(pyr->ipy_sums);
+	free(pyr->ipy_need);
+	bzero(pyr, sizeof (*pyr));
+}
+
 void
 img_and(img_t *image, img_t *mask)
 {
@@ -5,6 +5,7 @@
 #ifndef IMG_H
 #define	IMG_H
 
+#include <stdint.h>
 #include <stdio.h>
 
 #include <png.h>
@@ -17,6 +18,18 @@ typedef struct img_pixel {
 	uint8_t b;
 } img_pixel_t;
 
+/*
+ * Scores computed by img_mask_compare() are fixed-point values between 0 and 1
+ * with IMG_SCORE_SHIFT fractional bits.
+ */
+typedef uint32_t img_score_t;
+
+#define	IMG_SCORE_SHIFT		24
+#define	IMG_SCORE_ONE		(1U << IMG_SCORE_SHIFT)
+#define	IMG_SCORE_MAX		UINT32_MAX
+#define	IMG_SCORE(d)		((img_score_t)((d) * IMG_SCORE_ONE + 0.5))
+#define	IMG_SCORE_DOUBLE(s)	((double)(s) / IMG_SCORE_ONE)
+
 typedef struct img_pixelhsv {
 	uint8_t	h;
 	uint8_t s;
@@ -33,6 +46,104 @@ typedef struct img {
 	img_pixel_t	*img_pixels;
 } img_t;
 
+/*
+ * A frame in planar YUV (Y'CbCr, with BT.601 limited-range coding) as produced
+ * by a video decoder.  Plane 0 is luma at full resolution, and planes 1 and 2
+ * are Cb and Cr, subsampled by 2^iy_xshift horizontally and 2^iy_yshift
+ * vertically.  Frames are compared against masks in this form with
+ * img_mask_compare_yuv(), without converting them to RGB.
+ */
+typedef struct img_yuv {
+	unsigned int	iy_width;
+	unsigned int	iy_height;
+	unsigned int	iy_xshift;
+	unsigned int	iy_yshift;
+	uint8_t		*iy_planes[3];
+	unsigned int	iy_strides[3];	/* bytes per row of each plane */
+} img_yuv_t;
+
+/*
+ * A rectangular region of an image: columns [ib_minx, ib_maxx) of rows
+ * [ib_miny, ib_maxy).
+ */
+typedef struct img_box {
+	unsigned int	ib_minx;
+	unsigned int	ib_maxx;
+	unsigned int	ib_miny;
+	unsigned int	ib_maxy;
+} img_box_t;
+
+/*
+ * A copy of the bytes in a region of an image, used by img_region_same() to
+ * tell whether that part of another frame is exactly the same.
+ */
+typedef struct img_region {
+	unsigned int	irg_width;	/* dimensions of the image copied */
+	unsigned int	irg_height;
+	size_t		irg_size;	/* bytes copied */
+	size_t		irg_alloc;	/* bytes allocated */
+	uint8_t		*irg_bytes;
+} img_region_t;
+
+/*
+ * Masks are images in which every pixel is black except for the object we're
+ * looking for.  Pixels whose subpixels are all less than 2 are considered
+ * black, and they're ignored when comparing a mask to an image.
+ */
+#define	IMG_PX_BLACK(px)	((px)->r < 2 && (px)->g < 2 && (px)->b < 2)
+
+/*
+ * Since most of a mask is black, masks used for matching are compiled into a
+ * compact form that stores only the non-black pixels.  These are grouped into
+ * runs of horizontally adjacent pixels, and the pixels for all runs are packed
+ * together in imm_pixels.
+ *
+ * img_mask_compile() emits runs in raster order.  img_mask_order() splits them
+ * into segments of at most IMG_MASK_SEGLEN pixels and sorts the segments so
+ * that img_mask_compare_thresh() can rule out a non-matching image as early as
+ * possible.
+ */
+#define	IMG_MASK_SEGLEN	64
+
+typedef struct img_run {
+	uint16_t	ir_x;		/* starting column */
+	uint16_t	ir_y;		/* row */
+	uint32_t	ir_len;		/* number of pixels in the run */
+	uint32_t	ir_off;		/* index of first pixel in imm_pixels */
+} img_run_t;
+
+/*
+ * Images and masks can also be viewed at lower resolutions, where each pixel
+ * is the average of a square block of IMG_PYR_BLOCK(l) x IMG_PYR_BLOCK(l)
+ * pixels for level l.  A mask's coarse views are themselves compiled masks
+ * that include only those blocks that contain no black pixels.
+ */
+#define	IMG_PYR_NLEVELS		2
+#define	IMG_PYR_BLOCK(l)	(1U << ((l) + 1))
+
+typedef struct img_pyramid {
+	size_t		ipy_size;		/* allocated pixels */
+	uint16_t	*ipy_sums;		/* block sums (RGB) */
+	img_t		ipy_levels[IMG_PYR_NLEVELS];	/* 2x, 4x, ... */
+	unsigned int	ipy_needw;		/* see img_pyramid_need */
+	unsigned int	ipy_needh;
+	uint8_t		*ipy_need;
+} img_pyramid_t;
+
+typedef struct img_mask {
+	unsigned int	imm_width;	/* dimensions of the original image */
+	unsigned int	imm_height;
+	unsigned int	imm_minx;	/* bounding box of non-black pixels */
+	unsigned int	imm_maxx;
+	unsigned int	imm_miny;
+	unsigned int	imm_maxy;
+	unsigned int	imm_npixels;	/* number of non-black pixels */
+	unsigned int	imm_nruns;	/* number of runs */
+	img_run_t	*imm_runs;	/* runs (see above) */
+	img_pixel_t	*imm_pixels;	/* packed non-black pixels */
+	struct img_mask	*imm_levels[IMG_PYR_NLEVELS];	/* coarse views */
+} img_mask_t;
+
 img_t *img_read(const char *);
 img_t *img_translatexy(img_t *, long, long);
 int img_write(img_t *, const char *);
@@ -41,7 +152,24 @@ int img_write_png(img_t *, FILE *);
 void img_free(img_t *);
 #define	img_coord(image, x, y)	((x) + (image)->img_width * (y))
 double img_compare(img_t *, img_t *, img_t **);
+double img_compare_float(img_t *, img_t *);
+img_mask_t *img_mask_compile(img_t *);
+img_score_t img_mask_compare(img_t *, img_mask_t *);
+img_score_t img_mask_compare_thresh(img_t *, const img_pyramid_t *,
+    img_mask_t *, img_score_t, unsigned int *);
+int img_mask_order(img_mask_t **, unsigned int);
+img_mask_t *img_mask_yuv(const img_mask_t *);
+img_score_t img_mask_compare_yuv(const img_yuv_t *, const img_mask_t *,
+    img_score_t, unsigned int *);
+void img_mask_free(img_mask_t *);
+boolean_t img_region_same(img_region_t *, const img_t *, const img_box_t *);
+boolean_t img_region_same_yuv(img_region_t *, const img_yuv_t *,
+    const img_box_t *);
+void img_region_fini(img_region_t *);
 void img_and(img_t *, img_t *);
+int img_pyramid_need(img_pyramid_t *, img_mask_t *);
+int img_pyramid_build(img_pyramid_t *, img_t *);
+void img_pyramid_fini(img_pyramid_t *);
 
 void img_pix_rgb2hsv(img_pixelhsv_t *, img_pixel_t *);
 
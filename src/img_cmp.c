@@ -0,0 +1,506 @@
+/*
+ * img_cmp.c: vectorized kernels for img_compare()
+ *
+ * img_compare() spends nearly all of its time comparing runs of an image's
+ * pixels against the corresponding non-black pixels of a compiled mask.  The
+ * kernels here implement that comparison for a single run.  We build a scalar
+ * version everywhere and SSE4.2 and AVX2 versions on x86 compilers that support
+ * per-function target attributes, and we pick the best one the CPU supports the
+ * first time a kernel is needed.  The KARTVID_COMPARE environment variable can
+ * be set to "scalar", "sse4.2", or "avx2" to override that choice.
+ *
+ * Distances are summed as integers.  The squared distance between two pixels
+ * can never exceed 3 * 255^2, so rather than computing a square root for each
+ * pixel, the scalar kernel looks it up in img_sqrt_tab, which stores each root
+ * in fixed point with IMG_SQRT_SHIFT fractional bits.  The table is too big for
+ * vector gathers to be cheap, so the vector kernels instead compute the same
+ * entries with a single-precision square root that's rounded back to an
+ * integer.  Since img_cmp_init_tables() fills in the table the same way, all
+ * kernels produce identical sums.
+ */
+
+#include <err.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "img_cmp.h"
+
+extern int kv_debug;
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || \
+    (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define	IMG_CMP_X86
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define	IMG_TARGET_SSE42	__attribute__((target("sse4.2")))
+#define	IMG_TARGET_AVX2		__attribute__((target("avx2")))
+
+#ifndef bit_AVX2
+#define	bit_AVX2	(1 << 5)
+#endif
+#endif
+
+static uint16_t img_sqrt_tab[IMG_CMP_DZ2_MAX + 1];
+static uint64_t img_cmp_recip;
+
+static uint64_t
+img_cmp_span_scalar(const img_pixel_t *imgpx, const img_pixel_t *maskpx,
+    unsigned int npixels)
+{
+	unsigned int i;
+	int dr, dg, db;
+	uint64_t sum = 0;
+
+	for (i = 0; i < npixels; i++, imgpx++, maskpx++) {
+		dr = maskpx->r - imgpx->r;
+		dg = maskpx->g - imgpx->g;
+		db = maskpx->b - imgpx->b;
+		sum += img_sqrt_tab[dr * dr + dg * dg + db * db];
+	}
+
+	return (sum);
+}
+
+#ifdef IMG_CMP_X86
+
+/*
+ * Both vector kernels process 16 pixels (48 bytes) per iteration.  The pixels
+ * are stored as interleaved RGB triples, so we first use byte shuffles to split
+ * the three 16-byte vectors into one vector each of red, green, and blue
+ * subpixels.  After that, each operation works on 16 subpixels at once until
+ * we widen the per-channel differences to compute the sums of squares.
+ */
+#define	IMG_CMP_Z	-1
+
+IMG_TARGET_SSE42 static inline void
+img_cmp_deinterleave(const uint8_t *p, __m128i *rp, __m128i *gp, __m128i *bp)
+{
+	__m128i a, b, c;
+
+	a = _mm_loadu_si128((const __m128i *)p);
+	b = _mm_loadu_si128((const __m128i *)(p + 16));
+	c = _mm_loadu_si128((const __m128i *)(p + 32));
+
+	*rp = _mm_or_si128(_mm_or_si128(
+	    _mm_shuffle_epi8(a, _mm_setr_epi8(0, 3, 6, 9, 12, 15,
+	    IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z,
+	    IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z)),
+	    _mm_shuffle_epi8(b, _mm_setr_epi8(IMG_CMP_Z, IMG_CMP_Z,
+	    IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, 2, 5, 8, 11, 14,
+	    IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z))),
+	    _mm_shuffle_epi8(c, _mm_setr_epi8(IMG_CMP_Z, IMG_CMP_Z,
+	    IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z,
+	    IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, 1, 4, 7, 10, 13)));
+
+	*gp = _mm_or_si128(_mm_or_si128(
+	    _mm_shuffle_epi8(a, _mm_setr_epi8(1, 4, 7, 10, 13,
+	    IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z,
+	    IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z,
+	    IMG_CMP_Z)),
+	    _mm_shuffle_epi8(b, _mm_setr_epi8(IMG_CMP_Z, IMG_CMP_Z,
+	    IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, 0, 3, 6, 9, 12, 15,
+	    IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z))),
+	    _mm_shuffle_epi8(c, _mm_setr_epi8(IMG_CMP_Z, IMG_CMP_Z,
+	    IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z,
+	    IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, 2, 5, 8, 11, 14)));
+
+	*bp = _mm_or_si128(_mm_or_si128(
+	    _mm_shuffle_epi8(a, _mm_setr_epi8(2, 5, 8, 11, 14,
+	    IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z,
+	    IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z,
+	    IMG_CMP_Z)),
+	    _mm_shuffle_epi8(b, _mm_setr_epi8(IMG_CMP_Z, IMG_CMP_Z,
+	    IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, 1, 4, 7, 10, 13,
+	    IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z,
+	    IMG_CMP_Z))),
+	    _mm_shuffle_epi8(c, _mm_setr_epi8(IMG_CMP_Z, IMG_CMP_Z,
+	    IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z,
+	    IMG_CMP_Z, IMG_CMP_Z, IMG_CMP_Z, 0, 3, 6, 9, 12, 15)));
+}
+
+/*
+ * Computes the absolute per-channel differences for 16 pixels.
+ */
+IMG_TARGET_SSE42 static inline void
+img_cmp_diff16(const uint8_t *ip, const uint8_t *mp, __m128i *drp,
+    __m128i *dgp, __m128i *dbp)
+{
+	__m128i ir, ig, ib, mr, mg, mb;
+
+	img_cmp_deinterleave(ip, &ir, &ig, &ib);
+	img_cmp_deinterleave(mp, &mr, &mg, &mb);
+
+	*drp = _mm_or_si128(_mm_subs_epu8(mr, ir), _mm_subs_epu8(ir, mr));
+	*dgp = _mm_or_si128(_mm_subs_epu8(mg, ig), _mm_subs_epu8(ig, mg));
+	*dbp = _mm_or_si128(_mm_subs_epu8(mb, ib), _mm_subs_epu8(ib, mb));
+}
+
+/*
+ * Given the red and green differences for four pixels interleaved in "rg" and
+ * the blue differences interleaved with zeros in "bz" (all 16 bits wide),
+ * returns the fixed-point distances for those pixels, computed exactly as
+ * img_cmp_init_tables() computes the entries of img_sqrt_tab.
+ */
+IMG_TARGET_SSE42 static inline __m128i
+img_cmp_dist4_sse42(__m128i rg, __m128i bz)
+{
+	__m128i dz2;
+	__m128 scale;
+
+	scale = _mm_set1_ps((float)(1 << IMG_SQRT_SHIFT));
+	dz2 = _mm_add_epi32(_mm_madd_epi16(rg, rg), _mm_madd_epi16(bz, bz));
+	return (_mm_cvtps_epi32(_mm_mul_ps(_mm_sqrt_ps(_mm_cvtepi32_ps(dz2)),
+	    scale)));
+}
+
+/*
+ * Given 8 per-channel differences widened to 16 bits, returns the distances
+ * for the first four pixels added to those of the last four.
+ */
+IMG_TARGET_SSE42 static inline __m128i
+img_cmp_dist8_sse42(__m128i dr, __m128i dg, __m128i db)
+{
+	__m128i zero = _mm_setzero_si128();
+
+	return (_mm_add_epi32(
+	    img_cmp_dist4_sse42(_mm_unpacklo_epi16(dr, dg),
+	    _mm_unpacklo_epi16(db, zero)),
+	    img_cmp_dist4_sse42(_mm_unpackhi_epi16(dr, dg),
+	    _mm_unpackhi_epi16(db, zero))));
+}
+
+/*
+ * Within a run, the 32-bit lane sums in the vector kernels can't overflow
+ * because runs are never longer than an image row.
+ */
+IMG_TARGET_SSE42 static uint64_t
+img_cmp_span_sse42(const img_pixel_t *imgpx, const img_pixel_t *maskpx,
+    unsigned int npixels)
+{
+	const uint8_t *ip = (const uint8_t *)imgpx;
+	const uint8_t *mp = (const uint8_t *)maskpx;
+	__m128i dr, dg, db, zero, acc;
+	uint32_t partial[4];
+	unsigned int i;
+	uint64_t sum;
+
+	zero = _mm_setzero_si128();
+	acc = _mm_setzero_si128();
+
+	for (i = 0; i + 16 <= npixels; i += 16) {
+		img_cmp_diff16(ip + 3 * i, mp + 3 * i, &dr, &dg, &db);
+		acc = _mm_add_epi32(acc, img_cmp_dist8_sse42(
+		    _mm_cvtepu8_epi16(dr), _mm_cvtepu8_epi16(dg),
+		    _mm_cvtepu8_epi16(db)));
+		acc = _mm_add_epi32(acc, img_cmp_dist8_sse42(
+		    _mm_unpackhi_epi8(dr, zero), _mm_unpackhi_epi8(dg, zero),
+		    _mm_unpackhi_epi8(db, zero)));
+	}
+
+	_mm_storeu_si128((__m128i *)partial, acc);
+	sum = (uint64_t)partial[0] + partial[1] + partial[2] + partial[3];
+	return (sum + img_cmp_span_scalar(imgpx + i, maskpx + i,
+	    npixels - i));
+}
+
+/*
+ * Like img_cmp_dist4_sse42(), but for eight pixels.
+ */
+IMG_TARGET_AVX2 static inline __m256i
+img_cmp_dist8_avx2(__m256i rg, __m256i bz)
+{
+	__m256i dz2;
+	__m256 scale;
+
+	scale = _mm256_set1_ps((float)(1 << IMG_SQRT_SHIFT));
+	dz2 = _mm256_add_epi32(_mm256_madd_epi16(rg, rg),
+	    _mm256_madd_epi16(bz, bz));
+	return (_mm256_cvtps_epi32(_mm256_mul_ps(
+	    _mm256_sqrt_ps(_mm256_cvtepi32_ps(dz2)), scale)));
+}
+
+IMG_TARGET_AVX2 static uint64_t
+img_cmp_span_avx2(const img_pixel_t *imgpx, const img_pixel_t *maskpx,
+    unsigned int npixels)
+{
+	const uint8_t *ip = (const uint8_t *)imgpx;
+	const uint8_t *mp = (const uint8_t *)maskpx;
+	__m128i dr, dg, db;
+	__m256i dr16, dg16, db16, zero, acc;
+	uint32_t partial[8];
+	unsigned int i;
+	uint64_t sum;
+
+	zero = _mm256_setzero_si256();
+	acc = _mm256_setzero_si256();
+
+	for (i = 0; i + 16 <= npixels; i += 16) {
+		img_cmp_diff16(ip + 3 * i, mp + 3 * i, &dr, &dg, &db);
+
+		/*
+		 * The 256-bit unpack instructions operate within each 128-bit
+		 * lane, so the two halves below each hold a scrambled subset
+		 * of the 16 pixels.  That's fine since we only need the sum.
+		 */
+		dr16 = _mm256_cvtepu8_epi16(dr);
+		dg16 = _mm256_cvtepu8_epi16(dg);
+		db16 = _mm256_cvtepu8_epi16(db);
+
+		acc = _mm256_add_epi32(acc, img_cmp_dist8_avx2(
+		    _mm256_unpacklo_epi16(dr16, dg16),
+		    _mm256_unpacklo_epi16(db16, zero)));
+		acc = _mm256_add_epi32(acc, img_cmp_dist8_avx2(
+		    _mm256_unpackhi_epi16(dr16, dg16),
+		    _mm256_unpackhi_epi16(db16, zero)));
+	}
+
+	_mm256_storeu_si256((__m256i *)partial, acc);
+	sum = (uint64_t)partial[0] + partial[1] + partial[2] + partial[3] +
+	    partial[4] + partial[5] + partial[6] + partial[7];
+	return (sum + img_cmp_span_scalar(imgpx + i, maskpx + i,
+	    npixels - i));
+}
+
+static boolean_t
+img_cmp_have_sse42(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+		return (B_FALSE);
+
+	return ((ecx & bit_SSE4_2) != 0);
+}
+
+static boolean_t
+img_cmp_have_avx2(void)
+{
+	unsigned int eax, ebx, ecx, edx, xcr0lo, xcr0hi;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0 ||
+	    (ecx & bit_OSXSAVE) == 0 || (ecx & bit_AVX) == 0)
+		return (B_FALSE);
+
+	/*
+	 * The CPU may support AVX while the OS doesn't save the YMM registers
+	 * across context switches.  Check XCR0 for SSE and AVX state.
+	 */
+	__asm__ __volatile__("xgetbv" : "=a" (xcr0lo), "=d" (xcr0hi) : "c" (0));
+	if ((xcr0lo & 0x6) != 0x6)
+		return (B_FALSE);
+
+	if (__get_cpuid_max(0, NULL) < 7)
+		return (B_FALSE);
+
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return ((ebx & bit_AVX2) != 0);
+}
+
+#endif	/* IMG_CMP_X86 */
+
+static const img_cmp_impl_t img_cmp_impls[] = {
+#ifdef IMG_CMP_X86
+    { "avx2",	img_cmp_span_avx2	},
+    { "sse4.2",	img_cmp_span_sse42	},
+#endif
+    { "scalar",	img_cmp_span_scalar	},
+};
+
+static const int img_cmp_nimpls =
+    sizeof (img_cmp_impls) / sizeof (img_cmp_impls[0]);
+
+static boolean_t
+img_cmp_supported(const img_cmp_impl_t *icp)
+{
+#ifdef IMG_CMP_X86
+	if (icp->icm_span == img_cmp_span_avx2)
+		return (img_cmp_have_avx2());
+	if (icp->icm_span == img_cmp_span_sse42)
+		return (img_cmp_have_sse42());
+#endif
+	return (B_TRUE);
+}
+
+static const img_cmp_impl_t *
+img_cmp_select(void)
+{
+	const char *forced;
+	int i;
+
+	if ((forced = getenv("KARTVID_COMPARE")) != NULL) {
+		for (i = 0; i < img_cmp_nimpls; i++) {
+			if (strcmp(forced, img_cmp_impls[i].icm_name) == 0)
+				break;
+		}
+
+		if (i == img_cmp_nimpls)
+			warnx("KARTVID_COMPARE: unknown kernel \"%s\"", forced);
+		else if (!img_cmp_supported(&img_cmp_impls[i]))
+			warnx("KARTVID_COMPARE: kernel \"%s\" is not "
+			    "supported on this CPU", forced);
+		else
+			return (&img_cmp_impls[i]);
+	}
+
+	/* The table is sorted from most to least preferred. */
+	for (i = 0; i < img_cmp_nimpls - 1; i++) {
+		if (img_cmp_supported(&img_cmp_impls[i]))
+			break;
+	}
+
+	return (&img_cmp_impls[i]);
+}
+
+/*
+ * Fill in the square root table and the reciprocal used by img_cmp_score().
+ * Each entry is the correctly-rounded single-precision root, scaled and rounded
+ * to the nearest integer (as the vector kernels compute it), so it's off by
+ * just over 2^-(IMG_SQRT_SHIFT + 1) at most.
+ */
+static void
+img_cmp_init_tables(void)
+{
+	unsigned int i;
+
+	for (i = 0; i <= IMG_CMP_DZ2_MAX; i++)
+		img_sqrt_tab[i] = (uint16_t)lrintf(sqrtf((float)i) *
+		    (float)(1 << IMG_SQRT_SHIFT));
+
+	img_cmp_recip = (uint64_t)((double)(1ULL << (IMG_SCORE_SHIFT + 16)) /
+	    (sqrt(IMG_CMP_DZ2_MAX) * (1 << IMG_SQRT_SHIFT)) + 0.5);
+}
+
+static const img_cmp_impl_t *img_cmp_chosen;
+static pthread_once_t img_cmp_once = PTHREAD_ONCE_INIT;
+
+static void
+img_cmp_init(void)
+{
+	img_cmp_init_tables();
+	img_cmp_chosen = img_cmp_select();
+
+	if (kv_debug > 0)
+		(void) fprintf(stderr, "img_compare: using %s kernel\n",
+		    img_cmp_chosen->icm_name);
+}
+
+/*
+ * Returns the comparison kernel to use.  The choice is made once (by whichever
+ * thread gets here first) and cached.
+ */
+const img_cmp_impl_t *
+img_cmp_impl(void)
+{
+	(void) pthread_once(&img_cmp_once, img_cmp_init);
+	return (img_cmp_chosen);
+}
+
+/*
+ * Returns the "i"th of the kernels this CPU supports, in order of preference,
+ * or NULL if it supports fewer than "i + 1" of them.  This is only for checking
+ * the kernels against each other; everything else uses img_cmp_impl().
+ */
+const img_cmp_impl_t *
+img_cmp_impl_supported(int i)
+{
+	int j;
+
+	/* Make sure the tables have been initialized. */
+	(void) img_cmp_impl();
+
+	for (j = 0; j < img_cmp_nimpls; j++) {
+		if (img_cmp_supported(&img_cmp_impls[j]) && i-- == 0)
+			return (&img_cmp_impls[j]);
+	}
+
+	return (NULL);
+}
+
+/*
+ * BT.601 limited-range YUV to RGB, in fixed point with IMG_YUV_SHIFT fractional
+ * bits.  Since the transform is linear, we apply it directly to differences.
+ */
+#define	IMG_YUV_SHIFT	12
+#define	IMG_YUV_CY	4769	/* 1.164383 (luma) */
+#define	IMG_YUV_CRV	6537	/* 1.596027 (Cr to red) */
+#define	IMG_YUV_CGU	1605	/* 0.391762 (Cb to green) */
+#define	IMG_YUV_CGV	3330	/* 0.812968 (Cr to green) */
+#define	IMG_YUV_CBU	8263	/* 2.017232 (Cb to blue) */
+
+/*
+ * Round a fixed-point difference to the nearest integer, clamped to the range
+ * of differences between two 8-bit values.
+ */
+static inline int
+img_yuv_round(int v)
+{
+	v = v >= 0 ? (v + (1 << (IMG_YUV_SHIFT - 1))) >> IMG_YUV_SHIFT :
+	    -((-v + (1 << (IMG_YUV_SHIFT - 1))) >> IMG_YUV_SHIFT);
+	return (v > 255 ? 255 : v < -255 ? -255 : v);
+}
+
+uint64_t
+img_cmp_span_yuv(const uint8_t *yrow, const uint8_t *urow,
+    const uint8_t *vrow, unsigned int x, unsigned int xshift,
+    const img_pixel_t *maskpx, unsigned int npixels)
+{
+	unsigned int i;
+	int dy, du, dv, dr, dg, db;
+	uint64_t sum = 0;
+
+	/* Make sure the tables have been initialized. */
+	(void) img_cmp_impl();
+
+	for (i = 0; i < npixels; i++, x++, maskpx++) {
+		dy = IMG_YUV_CY * (maskpx->r - yrow[x]);
+		du = maskpx->g - urow[x >> xshift];
+		dv = maskpx->b - vrow[x >> xshift];
+		dr = img_yuv_round(dy + IMG_YUV_CRV * dv);
+		dg = img_yuv_round(dy - IMG_YUV_CGU * du - IMG_YUV_CGV * dv);
+		db = img_yuv_round(dy + IMG_YUV_CBU * du);
+		sum += img_sqrt_tab[dr * dr + dg * dg + db * db];
+	}
+
+	return (sum);
+}
+
+/*
+ * Given the sum of the fixed-point distances for "npixels" pixels, returns the
+ * average distance as a fraction of the maximum possible distance.  We multiply
+ * by a precomputed reciprocal of the maximum distance (with 16 extra bits of
+ * precision) rather than dividing by it.  The product can't overflow because
+ * the sum is less than 2^16 times the number of pixels in the image.  A mask
+ * with no pixels has no meaningful score, so it gets the worst possible one,
+ * which can't pass any threshold.
+ */
+img_score_t
+img_cmp_score(uint64_t sum, unsigned int npixels)
+{
+	if (npixels == 0)
+		return (IMG_SCORE_MAX);
+
+	return ((img_score_t)(((sum * img_cmp_recip) >> 16) / npixels));
+}
+
+/*
+ * Returns the largest sum of fixed-point distances over "npixels" pixels for
+ * which img_cmp_score() would return a score no greater than "thresh".  Callers
+ * can stop comparing as soon as a partial sum exceeds this, since the sum only
+ * grows.
+ */
+uint64_t
+img_cmp_limit(img_score_t thresh, unsigned int npixels)
+{
+	if (npixels == 0)
+		return (UINT64_MAX);
+
+	/* Make sure the tables have been initialized. */
+	(void) img_cmp_impl();
+
+	return (((((uint64_t)thresh + 1) * npixels << 16) - 1) / img_cmp_recip);
+}
@@ -0,0 +1,52 @@
+/*
+ * img_cmp.h: vectorized kernels for img_compare()
+ */
+
+#ifndef IMG_CMP_H
+#define	IMG_CMP_H
+
+#include "img.h"
+
+/*
+ * A span kernel compares "npixels" consecutive pixels of an image against the
+ * same number of packed (non-black) mask pixels and returns the sum of the
+ * Euclidean distances between them, each in fixed point with IMG_SQRT_SHIFT
+ * fractional bits.
+ *
+ * Each per-pixel distance is within about 2^-(IMG_SQRT_SHIFT + 1) of the exact
+ * root, which is less than 1e-5 of the maximum distance (sqrt(3 * 255^2)), so a
+ * score computed this way differs from the floating-point score computed by
+ * img_compare_debug() by at most IMG_CMP_EPSILON.  That's several orders of
+ * magnitude below the granularity of the KV_THRESHOLD_* values.  "kvbench -e"
+ * ("make check-compare") checks this for every kernel, mask, and sample frame.
+ */
+typedef uint64_t (*img_cmp_span_f)(const img_pixel_t *, const img_pixel_t *,
+    unsigned int);
+
+#define	IMG_SQRT_SHIFT	7
+#define	IMG_CMP_DZ2_MAX	(3 * 255 * 255)
+#define	IMG_CMP_EPSILON	1e-5
+
+typedef struct {
+	const char	*icm_name;	/* kernel name (for debugging) */
+	img_cmp_span_f	icm_span;	/* run comparison function */
+} img_cmp_impl_t;
+
+/*
+ * img_cmp_span_yuv() is like a span kernel, but compares pixels "x" through
+ * "x + npixels - 1" of one row of a planar YUV frame (given by pointers to the
+ * corresponding rows of the Y, Cb, and Cr planes, with chroma subsampled
+ * horizontally by 2^xshift) against mask pixels that hold (Y, Cb, Cr) triples
+ * (see img_mask_yuv()).  The difference between the two in YUV is mapped back
+ * to an RGB difference, so the distances are comparable to those computed by
+ * the other kernels.
+ */
+uint64_t img_cmp_span_yuv(const uint8_t *, const uint8_t *, const uint8_t *,
+    unsigned int, unsigned int, const img_pixel_t *, unsigned int);
+
+const img_cmp_impl_t *img_cmp_impl(void);
+const img_cmp_impl_t *img_cmp_impl_supported(int);
+img_score_t img_cmp_score(uint64_t, unsigned int);
+uint64_t img_cmp_limit(img_score_t, unsigned int);
+
+#endif
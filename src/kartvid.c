@@ -5,6 +5,7 @@
 #include <dirent.h>
 #include <err.h>
 #include <libgen.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -13,9 +14,11 @@
 
 #include <png.h>
 
+#include "bench.h"
 #include "compat.h"
 #include "img.h"
 #include "kv.h"
+#include "pipeline.h"
 #include "video.h"
 
 static void usage(const char *);
@@ -23,19 +26,45 @@ static int cmd_and(int, char *[]);
 static int cmd_compare(int, char *[]);
 static int cmd_translatexy(int, char *[]);
 static int cmd_ident(int, char *[]);
+static int cmd_maskpack(int, char *[]);
 static int cmd_frames(int, char *[]);
 static int cmd_decode(int, char *[]);
 static int write_frame(video_frame_t *, void *);
 static int cmd_video(int, char *[]);
+static int video_batch(int, char *[], const char *, const char *, kv_emit_f,
+    kv_flags_t, unsigned int, boolean_t, boolean_t, const char *);
+static int run_video(const char *, video_t *, kv_vidctx_t *, unsigned int, int,
+    boolean_t, const char *);
 static int ident_frame(video_frame_t *, void *);
+static void ident_frame_result(video_frame_t *, kv_vidframe_t *, void *);
+static int batch_setup(unsigned int, video_t *, void *);
+static int batch_start(unsigned int, void *);
+static void batch_frame(video_frame_t *, kv_vidframe_t *, void *);
+static void batch_done(unsigned int, int, void *);
+static int cmd_bench(int, char *[]);
+static void bench_emit(const char *, int, int, kv_screen_t *, kv_screen_t *,
+    FILE *);
+static int bench_video(const char *, kv_vidctx_t *, unsigned int, int,
+    boolean_t, boolean_t);
+static int bench_image(const char *, kv_vidctx_t *, unsigned int, int);
 static int cmd_starts(int, char *[]);
 static int check_start_frame(video_frame_t *, void *);
+static int check_start_coarse(video_frame_t *, void *);
+static int check_start_refine(video_frame_t *, void *);
+static int cmd_yuvcal(int, char *[]);
+static int yuvcal_frame(video_frame_t *, void *);
 static int cmd_rgb2hsv(int, char *[]);
 static int cmd_exportitems(int, char *[]);
 static int check_items(video_frame_t *, void *);
 
 #define	MAX_FRAMES	16384
 
+/*
+ * When scanning coarsely for race starts, frames scoring within this factor of
+ * the race start threshold are examined more closely.
+ */
+#define	STARTS_NEAR	1.5
+
 typedef struct {
 	const char 	 *kvc_name;
 	int		(*kvc_func)(int, char *[]);
@@ -52,17 +81,27 @@ static kv_cmd_t kv_commands[] = {
       "decode a video into its constituent PPM images" },
     { "translatexy", cmd_translatexy, "input output x-offset y-offset",
       "shift the given image using the given x and y offsets" },
-    { "ident", cmd_ident, "image",
+    { "ident", cmd_ident, "[-t nthreads] image",
       "report the current game state for the given image" },
-    { "frames", cmd_frames, "[-ij] dir_of_image_files", 
+    { "maskpack", cmd_maskpack, "output",
+      "compile all masks into a mask pack for faster startup" },
+    { "frames", cmd_frames,
+      "[-ij] [-S statsfile] [-t nthreads] dir_of_image_files",
       "emit race events for a sequence of video frames" },
     { "rgb2hsv", cmd_rgb2hsv, "r g b", "convert rgb value to hsv" },
-    { "video", cmd_video, "[-ij] [-d debugdir] video_file",
-      "emit race events for an entire video" },
-    { "starts", cmd_starts, "video_file",
+    { "video", cmd_video,
+      "[-cijvy] [-d debugdir] [-m manifest] [-o outdir] [-S statsfile] "
+      "[-s stride] [-t nthreads] video_file ...",
+      "emit race events for an entire video (with -o, for each of many)" },
+    { "starts", cmd_starts, "[-k | -s stride] video_file",
       "only scan for \"race start\" events and emit them on stdout" },
     { "exportitems", cmd_exportitems, "[-d dir] video_file",
       "export all frames in a video with an item box" },
+    { "yuvcal", cmd_yuvcal, "[-s stride] video_file",
+      "report how mask scores in YUV (video -y) compare to RGB" },
+    { "bench", cmd_bench,
+      "[-cjy] [-s stride] [-t nthreads] video_file | -n nframes image",
+      "report where the time goes when processing a video" },
 };
 
 static int kv_ncommands = sizeof (kv_commands) / sizeof (kv_commands[0]);
@@ -140,7 +179,7 @@ usage(const char *message)
 }
 
 static int
-check_debugdir(const char *dbgdir)
+check_dir(const char *dir)
 {
 	struct stat st;
 
@@ -149,19 +188,102 @@ check_debugdir(const char *dbgdir)
 	 * don't get partway through the conversion and fail because the user
 	 * forgot to create the directory.
 	 */
-	if (stat(dbgdir, &st) != 0) {
-		warn("stat %s", dbgdir);
+	if (stat(dir, &st) != 0) {
+		warn("stat %s", dir);
 		return (-1);
 	}
 
 	if ((st.st_mode & S_IFDIR) == 0) {
-		warnx("not a directory: %s", dbgdir);
+		warnx("not a directory: %s", dir);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Parse the argument to a -t option.
+ */
+static int
+parse_nthreads(const char *arg, unsigned int *nthreadsp)
+{
+	unsigned long nthreads;
+	char *q;
+
+	nthreads = strtoul(arg, &q, 0);
+	if (*arg == '\0' || *q != '\0' || nthreads == 0 || nthreads > 256) {
+		warnx("invalid thread count: %s", arg);
+		return (-1);
+	}
+
+	*nthreadsp = nthreads;
+	return (0);
+}
+
+/*
+ * Configure kv_ident() to use "nthreads" threads, if more than one.
+ */
+static int
+init_threads(unsigned int nthreads)
+{
+	if (nthreads > 1 && kv_ident_threads(nthreads) != 0) {
+		warn("failed to create %u threads", nthreads);
 		return (-1);
 	}
 
 	return (0);
 }
 
+/*
+ * Only convert the parts of each frame that kv_ident() will look at when
+ * identifying "which".
+ */
+static int
+init_regions(video_t *vp, kv_ident_t which)
+{
+	img_box_t boxes[VIDEO_MAX_REGIONS];
+
+	return (video_set_regions(vp, boxes,
+	    kv_regions(which, boxes, VIDEO_MAX_REGIONS)));
+}
+
+/*
+ * With -S, statistics for each mask are written to a file when the run is
+ * done.  The file is opened first so that a bad path is reported right away
+ * rather than after processing a whole video.
+ */
+static FILE *
+init_mask_stats(const char *filename)
+{
+	FILE *fp;
+
+	if ((fp = fopen(filename, "w")) == NULL) {
+		warn("fopen %s", filename);
+		return (NULL);
+	}
+
+	if (kv_mask_stats_enable() != 0) {
+		(void) fclose(fp);
+		return (NULL);
+	}
+
+	return (fp);
+}
+
+static int
+fini_mask_stats(FILE *fp)
+{
+	int rv;
+
+	rv = kv_mask_stats_write(fp);
+	if (fclose(fp) != 0 && rv == 0) {
+		warn("fclose");
+		rv = -1;
+	}
+
+	return (rv);
+}
+
 /*
  * compare image mask: compute a difference score for the given image and mask.
  */
@@ -298,6 +420,24 @@ cmd_ident(int argc, char *argv[])
 {
 	img_t *image;
 	kv_screen_t info;
+	unsigned int nthreads = 1;
+	char c;
+
+	while ((c = getopt(argc, argv, "t:")) != -1) {
+		switch (c) {
+		case 't':
+			if (parse_nthreads(optarg, &nthreads) != 0)
+				return (EXIT_USAGE);
+			break;
+
+		case '?':
+		default:
+			return (EXIT_USAGE);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
 
 	if (argc < 1)
 		return (EXIT_USAGE);
@@ -307,6 +447,9 @@ cmd_ident(int argc, char *argv[])
 		return (EXIT_FAILURE);
 	}
 
+	if (init_threads(nthreads) != 0)
+		return (EXIT_FAILURE);
+
 	image = img_read(argv[0]);
 	if (image == NULL) {
 		warnx("failed to read %s", argv[0]);
@@ -319,6 +462,23 @@ cmd_ident(int argc, char *argv[])
 	return (EXIT_SUCCESS);
 }
 
+/*
+ * maskpack output: compile the masks and save them for kv_init()
+ */
+static int
+cmd_maskpack(int argc, char *argv[])
+{
+	if (argc < 1)
+		return (EXIT_USAGE);
+
+	if (kv_maskpack(dirname((char *)kv_arg0), argv[0]) != 0) {
+		warnx("failed to write mask pack");
+		return (EXIT_FAILURE);
+	}
+
+	return (EXIT_SUCCESS);
+}
+
 static int
 qsort_strcmp(const void *vs1, const void *vs2)
 {
@@ -340,11 +500,14 @@ cmd_frames(int argc, char *argv[])
 	img_t *image;
 	kv_vidctx_t *kvp;
 	kv_flags_t flags = KVF_NONE;
+	unsigned int nthreads = 1;
 	char *framenames[MAX_FRAMES];
+	const char *statsfile = NULL;
+	FILE *statsfp = NULL;
 
 	emit = kv_screen_print;
 
-	while ((c = getopt(argc, argv, "ij")) != -1) {
+	while ((c = getopt(argc, argv, "ijS:t:")) != -1) {
 		switch (c) {
 		case 'i':
 			flags |= KVF_COMPARE_ITEMSTATE;
@@ -354,6 +517,15 @@ cmd_frames(int argc, char *argv[])
 			emit = kv_screen_json;
 			break;
 
+		case 'S':
+			statsfile = optarg;
+			break;
+
+		case 't':
+			if (parse_nthreads(optarg, &nthreads) != 0)
+				return (EXIT_USAGE);
+			break;
+
 		case '?':
 		default:
 			return (EXIT_USAGE);
@@ -372,6 +544,11 @@ cmd_frames(int argc, char *argv[])
 	    flags)) == NULL)
 		return (EXIT_FAILURE);
 
+	if (init_threads(nthreads) != 0) {
+		kv_vidctx_free(kvp);
+		return (EXIT_FAILURE);
+	}
+
 	if ((dirp = opendir(argv[0])) == NULL) {
 		kv_vidctx_free(kvp);
 		warn("failed to opendir %s", argv[0]);
@@ -409,6 +586,9 @@ cmd_frames(int argc, char *argv[])
 	if (entp != NULL)
 		goto out;
 
+	if (statsfile != NULL && (statsfp = init_mask_stats(statsfile)) == NULL)
+		goto out;
+
 	rv = EXIT_SUCCESS;
 	qsort(framenames, nframes, sizeof (framenames[0]), qsort_strcmp);
 
@@ -421,10 +601,13 @@ cmd_frames(int argc, char *argv[])
 		}
 
 		kv_vidctx_frame(framenames[i], i,
-		    i / KV_FRAMERATE * MILLISEC, image, kvp);
+		    i / KV_FRAMERATE * MILLISEC, image, NULL, NULL, kvp);
 		img_free(image);
 	}
 
+	if (statsfp != NULL && fini_mask_stats(statsfp) != 0)
+		rv = EXIT_FAILURE;
+
 out:
 	kv_vidctx_free(kvp);
 
@@ -479,11 +662,24 @@ cmd_video(int argc, char *argv[])
 	const char *dbgdir = NULL;
 	kv_emit_f emit;
 	kv_flags_t flags = KVF_NONE;
+	unsigned int nthreads = 1;
+	int stride = 1;
+	boolean_t chunked = B_FALSE;
+	boolean_t yuv = B_FALSE;
+	boolean_t stats = B_FALSE;
+	const char *statsfile = NULL;
+	FILE *statsfp = NULL;
+	const char *manifest = NULL;
+	const char *outdir = NULL;
 
 	emit = kv_screen_print;
 
-	while ((c = getopt(argc, argv, "d:ij")) != -1) {
+	while ((c = getopt(argc, argv, "cd:ijm:o:S:s:t:vy")) != -1) {
 		switch (c) {
+		case 'c':
+			chunked = B_TRUE;
+			break;
+
 		case 'd':
 			dbgdir = optarg;
 			break;
@@ -496,6 +692,39 @@ cmd_video(int argc, char *argv[])
 			emit = kv_screen_json;
 			break;
 
+		case 'm':
+			manifest = optarg;
+			break;
+
+		case 'o':
+			outdir = optarg;
+			break;
+
+		case 'S':
+			statsfile = optarg;
+			break;
+
+		case 's':
+			if ((stride = atoi(optarg)) < 1 ||
+			    stride > PIPELINE_MAX_STRIDE) {
+				warnx("invalid stride: %s", optarg);
+				return (EXIT_USAGE);
+			}
+			break;
+
+		case 't':
+			if (parse_nthreads(optarg, &nthreads) != 0)
+				return (EXIT_USAGE);
+			break;
+
+		case 'v':
+			stats = B_TRUE;
+			break;
+
+		case 'y':
+			yuv = B_TRUE;
+			break;
+
 		case '?':
 		default:
 			return (EXIT_USAGE);
@@ -505,12 +734,37 @@ cmd_video(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (argc < 1) {
+	if (argc < 1 && manifest == NULL) {
 		warnx("missing input file");
 		return (EXIT_USAGE);
 	}
 
-	if (dbgdir != NULL && check_debugdir(dbgdir) != 0)
+	if (outdir == NULL && (argc > 1 || manifest != NULL)) {
+		warnx("-o is required to process more than one video");
+		return (EXIT_USAGE);
+	}
+
+	if (outdir != NULL) {
+		if (dbgdir != NULL || stride > 1) {
+			warnx("-d and -s cannot be used with -o");
+			return (EXIT_USAGE);
+		}
+
+		return (video_batch(argc, argv, manifest, outdir, emit, flags,
+		    nthreads, yuv, stats, statsfile));
+	}
+
+	if (yuv && dbgdir != NULL) {
+		warnx("-d and -y cannot be used together");
+		return (EXIT_USAGE);
+	}
+
+	if (stride > 1 && chunked) {
+		warnx("-c and -s cannot be used together");
+		return (EXIT_USAGE);
+	}
+
+	if (dbgdir != NULL && check_dir(dbgdir) != 0)
 		return (EXIT_USAGE);
 
 	if ((vp = video_open(argv[0])) == NULL)
@@ -526,26 +780,651 @@ cmd_video(int argc, char *argv[])
 		return (EXIT_FAILURE);
 	}
 
+	/*
+	 * The debug directory gets whole frames, so we can't skip converting
+	 * any part of them.
+	 */
+	if (dbgdir == NULL && init_regions(vp, KV_IDENT_ALL) != 0) {
+		kv_vidctx_free(kvp);
+		video_free(vp);
+		return (EXIT_FAILURE);
+	}
+
+	/*
+	 * With -y, frames are matched in the YUV form the decoder produces,
+	 * so they're never converted to RGB at all.
+	 */
+	if (yuv && (kv_init_yuv() != 0 ||
+	    video_set_formats(vp, VIDEO_FMT_YUV) != 0)) {
+		kv_vidctx_free(kvp);
+		video_free(vp);
+		return (EXIT_FAILURE);
+	}
+
+	if (statsfile != NULL &&
+	    (statsfp = init_mask_stats(statsfile)) == NULL) {
+		kv_vidctx_free(kvp);
+		video_free(vp);
+		return (EXIT_FAILURE);
+	}
+
 	if (emit == kv_screen_json)
 		(void) printf("{ \"nframes\": %d, \"crtime\": \"%s\" }\n",
 		    video_nframes(vp), video_crtime(vp));
 
-	rv = video_iter_frames(vp, ident_frame, kvp);
+	rv = run_video(argv[0], vp, kvp, nthreads, stride, chunked, dbgdir);
+
+	if (stats)
+		kv_ident_stats(stderr);
+
+	if (statsfp != NULL && fini_mask_stats(statsfp) != 0)
+		rv = EXIT_FAILURE;
+
 	kv_vidctx_free(kvp);
 	video_free(vp);
 	return (rv);
 }
 
+/*
+ * Process all of a video's frames with kv_vidctx_frame().  With multiple
+ * threads, identify whole frames in parallel, overlapped with decoding.  The
+ * debug output from identifying each frame would be interleaved, though, so we
+ * don't do that when debugging.  With "chunked", decoding is split up among
+ * the threads as well, but then the frames' pixels aren't available for the
+ * debug directory.  With a stride, most frames during races aren't identified
+ * at all, and the threads are used to identify each of the rest.
+ */
 static int
-ident_frame(video_frame_t *vp, void *rawarg)
+run_video(const char *filename, video_t *vp, kv_vidctx_t *kvp,
+    unsigned int nthreads, int stride, boolean_t chunked, const char *dbgdir)
+{
+	if (stride > 1)
+		return (init_threads(nthreads) != 0 ? EXIT_FAILURE :
+		    pipeline_video_sampled(vp, kvp, stride,
+		    ident_frame_result, kvp));
+
+	if (chunked && nthreads > 1 && kv_debug < 2 && dbgdir == NULL)
+		return (pipeline_video_chunks(filename, vp, kvp, nthreads,
+		    ident_frame_result, kvp));
+
+	if (nthreads > 1 && kv_debug < 2)
+		return (pipeline_video(vp, kvp, nthreads, ident_frame_result,
+		    kvp));
+
+	if (init_threads(nthreads) != 0)
+		return (EXIT_FAILURE);
+
+	return (video_iter_frames(vp, ident_frame, kvp));
+}
+
+static void
+ident_frame_result(video_frame_t *vp, kv_vidframe_t *kfp, void *rawarg)
 {
 	kv_vidctx_t *kvp = rawarg;
 	char framename[16];
+	uint64_t start;
 
 	(void) snprintf(framename, sizeof (framename),
 	    "frame %d", vp->vf_framenum);
+	start = bench_start();
 	kv_vidctx_frame(framename, vp->vf_framenum, (int)vp->vf_frametime,
-	    &vp->vf_image, kvp);
+	    &vp->vf_image, vp->vf_yuv.iy_planes[0] != NULL ? &vp->vf_yuv : NULL,
+	    kfp, kvp);
+	bench_done(BENCH_FRAME, start);
+}
+
+static int
+ident_frame(video_frame_t *vp, void *rawarg)
+{
+	ident_frame_result(vp, NULL, rawarg);
+	return (0);
+}
+
+/*
+ * With -o, "video" processes any number of videos, named on the command line
+ * or listed one per line in a manifest, and writes the events for each one to
+ * its own file in the output directory, named for the video.  Everything is
+ * done in one process, so the masks are loaded just once, and all of the videos
+ * share one set of worker threads (see pipeline_videos()).  A video that
+ * fails is reported (and its partial output removed), but the rest of the
+ * batch carries on.
+ */
+typedef struct {
+	const char	*kb_outdir;
+	const char	*kb_rootdir;
+	kv_emit_f	kb_emit;
+	kv_flags_t	kb_flags;
+	boolean_t	kb_yuv;
+	char		**kb_files;
+	unsigned int	kb_nfiles;
+	unsigned int	kb_maxfiles;
+	int		*kb_nframes;	/* for each video (see batch_setup()) */
+	char		(*kb_crtimes)[64];
+	unsigned int	kb_nfailed;
+	kv_vidctx_t	*kb_kvp;	/* current video */
+	FILE		*kb_out;	/* current video's output */
+	char		kb_outname[PATH_MAX];
+} kv_batch_t;
+
+static int
+batch_add(kv_batch_t *kbp, const char *filename)
+{
+	char **files;
+	unsigned int maxfiles;
+
+	if (kbp->kb_nfiles == kbp->kb_maxfiles) {
+		maxfiles = kbp->kb_maxfiles == 0 ? 16 : kbp->kb_maxfiles * 2;
+		if ((files = realloc(kbp->kb_files,
+		    maxfiles * sizeof (files[0]))) == NULL) {
+			warn("realloc");
+			return (-1);
+		}
+
+		kbp->kb_files = files;
+		kbp->kb_maxfiles = maxfiles;
+	}
+
+	if ((kbp->kb_files[kbp->kb_nfiles] = strdup(filename)) == NULL) {
+		warn("strdup");
+		return (-1);
+	}
+
+	kbp->kb_nfiles++;
+	return (0);
+}
+
+/*
+ * Add the videos listed in a manifest, skipping blank lines and comments.
+ */
+static int
+batch_manifest(kv_batch_t *kbp, const char *manifest)
+{
+	FILE *fp;
+	char line[PATH_MAX];
+	size_t len;
+	int rv = 0;
+
+	if ((fp = fopen(manifest, "r")) == NULL) {
+		warn("fopen %s", manifest);
+		return (-1);
+	}
+
+	while (rv == 0 && fgets(line, sizeof (line), fp) != NULL) {
+		len = strlen(line);
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+
+		if (len == 0 || line[0] == '#')
+			continue;
+
+		rv = batch_add(kbp, line);
+	}
+
+	if (rv == 0 && ferror(fp)) {
+		warn("read %s", manifest);
+		rv = -1;
+	}
+
+	(void) fclose(fp);
+	return (rv);
+}
+
+/*
+ * The output for each video is named for the video's file (without its
+ * directory), plus ".json" or ".txt".
+ */
+static void
+batch_outname(kv_batch_t *kbp, unsigned int i, char *buf, size_t bufsz)
+{
+	const char *name;
+
+	if ((name = strrchr(kbp->kb_files[i], '/')) != NULL)
+		name++;
+	else
+		name = kbp->kb_files[i];
+
+	(void) snprintf(buf, bufsz, "%s/%s.%s", kbp->kb_outdir, name,
+	    kbp->kb_emit == kv_screen_json ? "json" : "txt");
+}
+
+static int
+batch_setup(unsigned int i, video_t *vp, void *arg)
+{
+	kv_batch_t *kbp = arg;
+
+	if (init_regions(vp, KV_IDENT_ALL) != 0 ||
+	    (kbp->kb_yuv && video_set_formats(vp, VIDEO_FMT_YUV) != 0))
+		return (-1);
+
+	kbp->kb_nframes[i] = video_nframes(vp);
+	(void) strlcpy(kbp->kb_crtimes[i], video_crtime(vp),
+	    sizeof (kbp->kb_crtimes[i]));
+	return (0);
+}
+
+static int
+batch_start(unsigned int i, void *arg)
+{
+	kv_batch_t *kbp = arg;
+
+	batch_outname(kbp, i, kbp->kb_outname, sizeof (kbp->kb_outname));
+	if ((kbp->kb_out = fopen(kbp->kb_outname, "w")) == NULL) {
+		warn("fopen %s", kbp->kb_outname);
+		return (-1);
+	}
+
+	if ((kbp->kb_kvp = kv_vidctx_init(kbp->kb_rootdir, kbp->kb_emit, NULL,
+	    kbp->kb_flags)) == NULL)
+		return (-1);
+
+	kv_vidctx_output(kbp->kb_kvp, kbp->kb_out);
+	if (kbp->kb_emit == kv_screen_json)
+		(void) fprintf(kbp->kb_out,
+		    "{ \"nframes\": %d, \"crtime\": \"%s\" }\n",
+		    kbp->kb_nframes[i], kbp->kb_crtimes[i]);
+
+	return (0);
+}
+
+static void
+batch_frame(video_frame_t *vp, kv_vidframe_t *kfp, void *arg)
+{
+	kv_batch_t *kbp = arg;
+
+	ident_frame_result(vp, kfp, kbp->kb_kvp);
+}
+
+static void
+batch_done(unsigned int i, int rv, void *arg)
+{
+	kv_batch_t *kbp = arg;
+
+	if (kbp->kb_kvp != NULL) {
+		kv_vidctx_free(kbp->kb_kvp);
+		kbp->kb_kvp = NULL;
+	}
+
+	if (kbp->kb_out != NULL) {
+		if ((ferror(kbp->kb_out) || fclose(kbp->kb_out) != 0) &&
+		    rv == 0) {
+			warn("write %s", kbp->kb_outname);
+			rv = -1;
+		}
+
+		kbp->kb_out = NULL;
+		if (rv != 0)
+			(void) unlink(kbp->kb_outname);
+	}
+
+	if (rv != 0) {
+		warnx("%s: failed", kbp->kb_files[i]);
+		kbp->kb_nfailed++;
+	}
+}
+
+static int
+video_batch(int argc, char *argv[], const char *manifest, const char *outdir,
+    kv_emit_f emit, kv_flags_t flags, unsigned int nthreads, boolean_t yuv,
+    boolean_t stats, const char *statsfile)
+{
+	static const pipeline_batch_ops_t ops = {
+		batch_setup, batch_start, batch_frame, batch_done
+	};
+	kv_batch_t kb;
+	FILE *statsfp = NULL;
+	char name1[PATH_MAX], name2[PATH_MAX];
+	unsigned int i, j;
+	int rv;
+
+	bzero(&kb, sizeof (kb));
+	kb.kb_outdir = outdir;
+	kb.kb_rootdir = dirname((char *)kv_arg0);
+	kb.kb_emit = emit;
+	kb.kb_flags = flags;
+	kb.kb_yuv = yuv;
+
+	rv = EXIT_USAGE;
+	for (i = 0; i < argc; i++) {
+		if (batch_add(&kb, argv[i]) != 0)
+			goto out;
+	}
+
+	if (manifest != NULL && batch_manifest(&kb, manifest) != 0)
+		goto out;
+
+	if (kb.kb_nfiles == 0) {
+		warnx("no videos in %s", manifest);
+		goto out;
+	}
+
+	if (check_dir(outdir) != 0)
+		goto out;
+
+	/*
+	 * Outputs are named for the videos, so two videos with the same name
+	 * in different directories would clobber each other.
+	 */
+	for (i = 1; i < kb.kb_nfiles; i++) {
+		batch_outname(&kb, i, name1, sizeof (name1));
+		for (j = 0; j < i; j++) {
+			batch_outname(&kb, j, name2, sizeof (name2));
+			if (strcmp(name1, name2) == 0) {
+				warnx("%s and %s would both be written to %s",
+				    kb.kb_files[j], kb.kb_files[i], name1);
+				goto out;
+			}
+		}
+	}
+
+	rv = EXIT_FAILURE;
+	kb.kb_nframes = calloc(kb.kb_nfiles, sizeof (kb.kb_nframes[0]));
+	kb.kb_crtimes = calloc(kb.kb_nfiles, sizeof (kb.kb_crtimes[0]));
+	if (kb.kb_nframes == NULL || kb.kb_crtimes == NULL) {
+		warn("calloc");
+		goto out;
+	}
+
+	if (kv_init(kb.kb_rootdir) != 0) {
+		warnx("failed to initialize masks");
+		goto out;
+	}
+
+	if (yuv && kv_init_yuv() != 0)
+		goto out;
+
+	if (statsfile != NULL && (statsfp = init_mask_stats(statsfile)) == NULL)
+		goto out;
+
+	if (pipeline_videos((const char **)kb.kb_files, kb.kb_nfiles, nthreads,
+	    &ops, &kb) < 0) {
+		if (statsfp != NULL)
+			(void) fclose(statsfp);
+		goto out;
+	}
+
+	if (kb.kb_nfailed > 0)
+		warnx("%u of %u videos failed", kb.kb_nfailed, kb.kb_nfiles);
+	rv = kb.kb_nfailed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+	if (stats)
+		kv_ident_stats(stderr);
+
+	if (statsfp != NULL && fini_mask_stats(statsfp) != 0)
+		rv = EXIT_FAILURE;
+
+out:
+	for (i = 0; i < kb.kb_nfiles; i++)
+		free(kb.kb_files[i]);
+	free(kb.kb_files);
+	free(kb.kb_nframes);
+	free(kb.kb_crtimes);
+	return (rv);
+}
+
+static FILE *bench_out;		/* where "bench" discards events */
+
+/*
+ * "kartvid bench" times emitting events in the usual (JSON) form, but throws
+ * them away.
+ */
+static void
+bench_emit(const char *source, int frame, int msec, kv_screen_t *ksp,
+    kv_screen_t *raceksp, FILE *out)
+{
+	uint64_t start = bench_start();
+
+	kv_screen_json(source, frame, msec, ksp, raceksp, bench_out);
+	bench_done(BENCH_EMIT, start);
+}
+
+/*
+ * Process a video the way "kartvid video" does with the same options, timing
+ * each stage.
+ */
+static int
+bench_video(const char *filename, kv_vidctx_t *kvp, unsigned int nthreads,
+    int stride, boolean_t chunked, boolean_t yuv)
+{
+	video_t *vp;
+	int rv;
+
+	if ((vp = video_open(filename)) == NULL)
+		return (EXIT_FAILURE);
+
+	if (init_regions(vp, KV_IDENT_ALL) != 0 ||
+	    (yuv && (kv_init_yuv() != 0 ||
+	    video_set_formats(vp, VIDEO_FMT_YUV) != 0))) {
+		video_free(vp);
+		return (EXIT_FAILURE);
+	}
+
+	bench_enable();
+	rv = run_video(filename, vp, kvp, nthreads, stride, chunked, NULL);
+	video_free(vp);
+	return (rv);
+}
+
+/*
+ * Process "nframes" synthetic video frames made from a single image, timing
+ * each stage.  There's no decoding, so this measures identification and the
+ * rest of kv_vidctx_frame() by themselves.  kv_ident() would recognize the
+ * repeated frames and reuse its results, so the low bit of every pixel is
+ * flipped between frames.  That changes every region of the frame without
+ * changing how it's identified.
+ */
+static int
+bench_image(const char *filename, kv_vidctx_t *kvp, unsigned int nthreads,
+    int nframes)
+{
+	img_t *image;
+	img_pixel_t *px, *end;
+	char framename[16];
+	uint64_t start;
+	int i;
+
+	if ((image = img_read(filename)) == NULL) {
+		warnx("failed to read %s", filename);
+		return (EXIT_FAILURE);
+	}
+
+	bench_enable();
+	if (init_threads(nthreads) != 0) {
+		img_free(image);
+		return (EXIT_FAILURE);
+	}
+
+	end = image->img_pixels + image->img_width * image->img_height;
+	for (i = 1; i <= nframes; i++) {
+		for (px = image->img_pixels; px < end; px++)
+			px->b ^= 1;
+
+		(void) snprintf(framename, sizeof (framename), "frame %d", i);
+		start = bench_start();
+		kv_vidctx_frame(framename, i, i / KV_FRAMERATE * MILLISEC,
+		    image, NULL, NULL, kvp);
+		bench_done(BENCH_FRAME, start);
+	}
+
+	img_free(image);
+	return (EXIT_SUCCESS);
+}
+
+/*
+ * bench [-cjy] [-s stride] [-t nthreads] video_file: process a video the way
+ * "video" does with the same options, but instead of the events, report the
+ * frame rate, how long each stage of processing took, and resource usage.
+ * With -n, the input is an image to identify as that many video frames.  With
+ * -j, the report is JSON.
+ */
+static int
+cmd_bench(int argc, char *argv[])
+{
+	kv_vidctx_t *kvp;
+	char c;
+	int rv;
+	unsigned int nthreads = 1;
+	int stride = 1;
+	long nframes = 0;
+	char *q;
+	boolean_t chunked = B_FALSE;
+	boolean_t json = B_FALSE;
+	boolean_t yuv = B_FALSE;
+
+	while ((c = getopt(argc, argv, "cjn:s:t:y")) != -1) {
+		switch (c) {
+		case 'c':
+			chunked = B_TRUE;
+			break;
+
+		case 'j':
+			json = B_TRUE;
+			break;
+
+		case 'n':
+			nframes = strtol(optarg, &q, 0);
+			if (*optarg == '\0' || *q != '\0' || nframes < 1 ||
+			    nframes > INT_MAX) {
+				warnx("invalid frame count: %s", optarg);
+				return (EXIT_USAGE);
+			}
+			break;
+
+		case 's':
+			if ((stride = atoi(optarg)) < 1 ||
+			    stride > PIPELINE_MAX_STRIDE) {
+				warnx("invalid stride: %s", optarg);
+				return (EXIT_USAGE);
+			}
+			break;
+
+		case 't':
+			if (parse_nthreads(optarg, &nthreads) != 0)
+				return (EXIT_USAGE);
+			break;
+
+		case 'y':
+			yuv = B_TRUE;
+			break;
+
+		case '?':
+		default:
+			return (EXIT_USAGE);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1) {
+		warnx("missing input file");
+		return (EXIT_USAGE);
+	}
+
+	if (nframes > 0 && (chunked || stride > 1 || yuv)) {
+		warnx("-n cannot be used with -c, -s, or -y");
+		return (EXIT_USAGE);
+	}
+
+	if (stride > 1 && chunked) {
+		warnx("-c and -s cannot be used together");
+		return (EXIT_USAGE);
+	}
+
+	if ((bench_out = fopen("/dev/null", "w")) == NULL) {
+		warn("fopen /dev/null");
+		return (EXIT_FAILURE);
+	}
+
+	if ((kvp = kv_vidctx_init(dirname((char *)kv_arg0), bench_emit,
+	    NULL, KVF_NONE)) == NULL) {
+		(void) fclose(bench_out);
+		return (EXIT_FAILURE);
+	}
+
+	if (nframes > 0)
+		rv = bench_image(argv[0], kvp, nthreads, nframes);
+	else
+		rv = bench_video(argv[0], kvp, nthreads, stride, chunked, yuv);
+
+	if (rv == 0)
+		bench_report(stdout, json);
+
+	kv_vidctx_free(kvp);
+	(void) fclose(bench_out);
+	return (rv == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/*
+ * Matching in YUV (video -y) should give nearly the same scores as matching in
+ * RGB, but not exactly, because the masks are converted to YUV with rounding
+ * and the differences are converted back to RGB without clamping.  This scores
+ * every mask in both ways against frames of a video and reports how the scores
+ * differ, including how many frames would match in one but not the other.
+ */
+static int
+cmd_yuvcal(int argc, char *argv[])
+{
+	video_t *vp;
+	kv_yuvcal_t *kcp;
+	int rv, stride;
+	char c;
+
+	stride = 1;
+	while ((c = getopt(argc, argv, "s:")) != -1) {
+		switch (c) {
+		case 's':
+			if ((stride = atoi(optarg)) < 1) {
+				warnx("invalid stride: %s", optarg);
+				return (EXIT_USAGE);
+			}
+			break;
+
+		case '?':
+		default:
+			return (EXIT_USAGE);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1) {
+		warnx("missing input file");
+		return (EXIT_USAGE);
+	}
+
+	if (kv_init(dirname((char *)kv_arg0)) != 0) {
+		warnx("failed to initialize masks");
+		return (EXIT_FAILURE);
+	}
+
+	if ((kcp = kv_yuvcal_init()) == NULL)
+		return (EXIT_FAILURE);
+
+	if ((vp = video_open(argv[0])) == NULL) {
+		kv_yuvcal_free(kcp);
+		return (EXIT_FAILURE);
+	}
+
+	if (init_regions(vp, KV_IDENT_ALL) != 0 ||
+	    video_set_formats(vp, VIDEO_FMT_RGB | VIDEO_FMT_YUV) != 0) {
+		video_free(vp);
+		kv_yuvcal_free(kcp);
+		return (EXIT_FAILURE);
+	}
+
+	video_set_stride(vp, stride);
+	rv = video_iter_frames(vp, yuvcal_frame, kcp);
+	kv_yuvcal_report(kcp, stdout);
+	video_free(vp);
+	kv_yuvcal_free(kcp);
+	return (rv);
+}
+
+static int
+yuvcal_frame(video_frame_t *vp, void *rawarg)
+{
+	kv_yuvcal_frame(rawarg, &vp->vf_image, &vp->vf_yuv);
 	return (0);
 }
 
@@ -570,27 +1449,105 @@ cmd_rgb2hsv(int argc, char *argv[])
 	return (EXIT_SUCCESS);
 }
 
+/*
+ * "starts" only needs to find the first frame of each race start, and the start
+ * screen is shown for a few seconds, so it can scan coarsely: with -s, it only
+ * examines every "stride" packets, and with -k, only keyframes.  By default, it
+ * examines every frame.  When a coarse frame looks anything like a race start
+ * (see STARTS_NEAR), we decode the packets since the previous coarse frame (and
+ * up to the next one) one by one using a second decoder to find the exact frame
+ * where the start begins.  This gives the same results as examining every frame
+ * as long as each start screen is visible for longer than the coarse frames are
+ * apart.
+ */
+typedef struct {
+	video_t		*ss_refine;	/* decoder for examining every frame */
+	int		*ss_keys;	/* keyframe packets, for seeking */
+	int		ss_nkeys;
+	int		ss_stride;	/* stride (see video_set_stride()) */
+	int		ss_prev;	/* previous coarse frame's packet */
+	int		ss_after;	/* refine frames after this packet */
+	int		ss_last;	/* time of last start found (ms) */
+} starts_t;
+
 static int
 cmd_starts(int argc, char *argv[])
 {
 	video_t *vp;
-	int rv, last;
+	starts_t ss;
+	int rv;
+	char c;
 
-	if (kv_init(dirname((char *)kv_arg0)) != 0) {
-		warnx("failed to initialize masks");
-		return (EXIT_FAILURE);
+	bzero(&ss, sizeof (ss));
+	ss.ss_stride = 1;
+
+	while ((c = getopt(argc, argv, "ks:")) != -1) {
+		switch (c) {
+		case 'k':
+			ss.ss_stride = VIDEO_STRIDE_KEYFRAMES;
+			break;
+
+		case 's':
+			if ((ss.ss_stride = atoi(optarg)) < 1) {
+				warnx("invalid stride: %s", optarg);
+				return (EXIT_USAGE);
+			}
+			break;
+
+		case '?':
+		default:
+			return (EXIT_USAGE);
+		}
 	}
 
+	argc -= optind;
+	argv += optind;
+
 	if (argc < 1) {
 		warnx("missing input file");
 		return (EXIT_USAGE);
 	}
 
+	if (kv_init(dirname((char *)kv_arg0)) != 0) {
+		warnx("failed to initialize masks");
+		return (EXIT_FAILURE);
+	}
+
 	if ((vp = video_open(argv[0])) == NULL)
 		return (EXIT_FAILURE);
 
-	last = 0;
-	rv = video_iter_frames(vp, check_start_frame, &last);
+	if (init_regions(vp, KV_IDENT_START) != 0) {
+		video_free(vp);
+		return (EXIT_FAILURE);
+	}
+
+	if (ss.ss_stride != 1 &&
+	    video_keyframes(vp, &ss.ss_keys, &ss.ss_nkeys) != 0) {
+		warnx("%s: no usable keyframe index; examining every frame",
+		    argv[0]);
+		ss.ss_stride = 1;
+	}
+
+	if (ss.ss_stride != 1 &&
+	    ((ss.ss_refine = video_open(argv[0])) == NULL ||
+	    init_regions(ss.ss_refine, KV_IDENT_START) != 0)) {
+		if (ss.ss_refine != NULL)
+			video_free(ss.ss_refine);
+		free(ss.ss_keys);
+		video_free(vp);
+		return (EXIT_FAILURE);
+	}
+
+	if (ss.ss_stride == 1) {
+		rv = video_iter_frames(vp, check_start_frame, &ss.ss_last);
+	} else {
+		ss.ss_prev = -1;
+		video_set_stride(vp, ss.ss_stride);
+		rv = video_iter_frames(vp, check_start_coarse, &ss);
+		video_free(ss.ss_refine);
+	}
+
+	free(ss.ss_keys);
 	video_free(vp);
 	return (rv);
 }
@@ -614,6 +1571,78 @@ check_start_frame(video_frame_t *vp, void *rawarg)
 	return (0);
 }
 
+/*
+ * Returns the index in ss_keys of the last keyframe at or before "packet".
+ */
+static int
+starts_keyframe(starts_t *ssp, int packet)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = ssp->ss_nkeys - 1;
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (ssp->ss_keys[mid] <= packet)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return (lo);
+}
+
+static int
+check_start_coarse(video_frame_t *vp, void *rawarg)
+{
+	starts_t *ssp = rawarg;
+	int k, first, last, prev, rv;
+
+	prev = ssp->ss_prev;
+	ssp->ss_prev = vp->vf_packet;
+
+	if (ssp->ss_last > 0 && vp->vf_frametime - ssp->ss_last < 3000)
+		return (0);
+
+	if (kv_start_score(&vp->vf_image, KV_THRESHOLD_LAKITU * STARTS_NEAR) >
+	    KV_THRESHOLD_LAKITU * STARTS_NEAR)
+		return (0);
+
+	/*
+	 * The start may have begun anywhere since the previous coarse frame,
+	 * or for a near miss, anywhere before the next one.  Decode from the
+	 * keyframe before the previous coarse frame, but only examine frames
+	 * after it.
+	 */
+	k = starts_keyframe(ssp, prev < 0 ? 0 : prev);
+	first = prev < 0 ? 0 : ssp->ss_keys[k];
+	if (ssp->ss_stride != VIDEO_STRIDE_KEYFRAMES)
+		last = vp->vf_packet + ssp->ss_stride;
+	else if ((k = starts_keyframe(ssp, vp->vf_packet) + 1) < ssp->ss_nkeys)
+		last = ssp->ss_keys[k];
+	else
+		last = INT_MAX;
+
+	ssp->ss_after = prev;
+	rv = video_iter_range(ssp->ss_refine, first, last, check_start_refine,
+	    ssp);
+	return (rv < 0 ? rv : 0);
+}
+
+static int
+check_start_refine(video_frame_t *vp, void *rawarg)
+{
+	starts_t *ssp = rawarg;
+	int last = ssp->ss_last;
+
+	if (vp->vf_packet <= ssp->ss_after)
+		return (0);
+
+	/* Stop at the first start we find. */
+	(void) check_start_frame(vp, &ssp->ss_last);
+	return (ssp->ss_last != last);
+}
+
 typedef struct {
 	boolean_t ew_state;
 	const char *ew_dbgdir;
@@ -624,6 +1653,7 @@ static int
 cmd_exportitems(int argc, char *argv[])
 {
 	video_t *vp;
+	video_frame_t *vfp;
 	char c;
 	int rv;
 	expitem_t state;
@@ -651,7 +1681,7 @@ cmd_exportitems(int argc, char *argv[])
 		return (EXIT_USAGE);
 	}
 
-	if (state.ew_dbgdir != NULL && check_debugdir(state.ew_dbgdir) != 0)
+	if (state.ew_dbgdir != NULL && check_dir(state.ew_dbgdir) != 0)
 		return (EXIT_USAGE);
 
 	if (kv_init(dirname((char *)kv_arg0)) != 0) {
@@ -670,7 +1700,16 @@ cmd_exportitems(int argc, char *argv[])
 	if ((vp = video_open(argv[0])) == NULL)
 		return (EXIT_FAILURE);
 
-	rv = video_iter_frames(vp, check_items, &state);
+	/*
+	 * Each frame has its own buffer, so check_items() can draw on it.
+	 */
+	while ((rv = video_next_frame(vp, &vfp)) == 0 && vfp != NULL) {
+		rv = check_items(vfp, &state);
+		video_frame_release(vfp);
+		if (rv != 0)
+			break;
+	}
+
 	video_free(vp);
 	return (rv);
 }
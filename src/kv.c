@@ -5,62 +5,265 @@
 #include <assert.h>
 #include <dirent.h>
 #include <err.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <time.h>
 
+#include "bench.h"
 #include "kv.h"
+#include "maskpack.h"
+#include "pool.h"
+#include "probes.h"
 extern int kv_debug;
 
 /*
- * All masks are loaded by kv_init() and cached in kv_masks.
+ * All masks are loaded by kv_init() and cached in kv_masks.  Only the compiled
+ * form of each mask is kept around, along with what kv_ident() needs to know
+ * about it.  kv_mask_classify() works all of that out from the mask's name
+ * when it's loaded, so that identifying a frame never has to look at names.
+ * A mask whose name doesn't make sense for its class is loaded, but matching
+ * it has no effect.
  */
 typedef struct {
 	char		km_name[64];
-	img_t		*km_image;
+	img_mask_t	*km_mask;
+	img_mask_t	*km_yuv;	/* YUV version (see kv_init_yuv()) */
+	img_score_t	km_thresh;	/* maximum score for a match */
+	kv_ident_t	km_which;	/* class of mask (0 for position) */
+	unsigned int	km_square;	/* player square, if any */
+	unsigned int	km_pos;		/* position masks: place, or 0 */
+	boolean_t	km_final;	/* position masks: final lap */
+	kv_item_t	km_item;	/* item masks: item shown */
+	kv_label_t	km_label;	/* char/track masks: name, if any */
+	int		km_rank;	/* class's evaluation order (bench.h) */
+	int		km_group;	/* index in kv_groups, or -1 */
 } kv_mask_t;
 
+/*
+ * When kv_init() runs, masks are sorted into groups by class and screen region
+ * (player square), and kv_ident() evaluates them one group at a time.  This
+ * lets it skip whole groups of masks that can't affect the result:
+ *
+ *     o Position masks always come first because they determine ks_nplayers.
+ *       Character masks come next because they can also increase it.
+ *
+ *     o Item masks for a square are ignored by kv_ident_matches() unless the
+ *       square belongs to a player, so there's no point in evaluating them
+ *       unless that's true.
+ *
+ *     o The item masks for a square only mean something if the item box frame
+ *       is visible there, so the item_box_frame mask for that square gates the
+ *       rest of the group: it's checked first, and if it doesn't match, the
+ *       other masks in the group are skipped.
+ *
+ *     o Unless the caller wants the actual item in a square (see
+ *       KV_IDENT_ITEMS_SQUARE()), the item_blank mask gates the rest of the
+ *       group as well.  If the box is visible and it isn't blank, the item is
+ *       reported as KVI_UNKNOWN whatever it is, so there's no need to find
+ *       out.  If it is blank, though, we have to check the rest anyway,
+ *       because one of the real items might match better.
+ *
+ * Within each group, masks are evaluated in name order, as they would be
+ * without grouping.
+ */
+typedef struct {
+	kv_ident_t	kg_which;	/* class of masks (0 for position) */
+	unsigned int	kg_square;	/* player square, or 0 */
+	boolean_t	kg_gated;	/* first mask gates the rest */
+	int		kg_blank;	/* item_blank mask in kv_masks, or -1 */
+	int		kg_first;	/* first mask in kv_masks */
+	int		kg_last;	/* last mask in kv_masks (exclusive) */
+	img_box_t	kg_box;		/* union of the masks' bounding boxes */
+} kv_group_t;
+
 kv_item_t kv_mask_item(const char *mask);
 int kv_mask_compare(const kv_mask_t *, const kv_mask_t *);
+static int kv_mask_classify(kv_mask_t *);
+static void kv_ident_matches(kv_screen_t *, const kv_mask_t *, img_score_t);
+static void kv_pyramid_free(void *);
+static void kv_cache_free(void *);
+static void kv_eval_free(void *);
 
 
-#define	KV_MAX_MASKS	256
-static kv_mask_t kv_masks[KV_MAX_MASKS];
+static kv_mask_t *kv_masks;		/* see kv_mask_alloc() */
 static int kv_nmasks = 0;
+static int kv_maxmasks = 0;
+static kv_group_t *kv_groups;		/* at most one per mask */
+static int kv_ngroups = 0;
+
+/*
+ * The character and track names that masks identify, each stored once.  Masks
+ * and screens refer to them by kv_label_t, which is the index in kv_labels
+ * plus one, so that KV_LABEL_NONE (zero) is never a name.
+ */
+#define	KV_LABELLEN	32
+static char (*kv_labels)[KV_LABELLEN];
+static int kv_nlabels = 0;
+static int kv_maxlabels = 0;
+static pthread_key_t kv_pyramid_key;	/* see kv_pyramid() */
+static pthread_key_t kv_cache_key;		/* see kv_cache() */
+static pthread_key_t kv_eval_key;		/* see kv_eval() */
+static maskpack_t *kv_pack;			/* see kv_init_pack() */
 
 #define KV_MASK_CHAR(s)		(s[0] == 'c')
 #define KV_MASK_TRACK(s)	(s[0] == 't')
 #define	KV_MASK_LAKITU(s)	(s[0] == 'l')
 #define	KV_MASK_ITEM(s)		(s[0] == 'i')
 #define	KV_MASK_POS(s)		(s[0] == 'p')
+#define	KV_MASK_GATE(s)		(strstr(s, "box_frame") != NULL)
+#define	KV_MASK_BLANK(s)	(strstr(s, "item_blank") != NULL)
 
 #define	KV_STARTFRAMES	90
 
+#define	MIN(x, y)	((x) < (y) ? (x) : (y))
+#define	MAX(x, y)	((x) > (y) ? (x) : (y))
+
 struct kv_vidctx {
 	kv_screen_t 	kv_frame;	/* current frame state */
 	kv_screen_t 	kv_pframe;      /* first frame matching current state */
 	kv_screen_t 	kv_raceframe;   /* first frame state for this race */
 	kv_screen_t	kv_startbuffer[KV_STARTFRAMES];
 	int		kv_last_start;
+	atomic_int	kv_sched_start;	/* see kv_vidctx_ident() */
+	atomic_int	kv_sched_items;	/* see kv_vidctx_ident() */
 	kv_flags_t	kv_flags;
 	kv_emit_f	kv_emit;
+	FILE		*kv_out;	/* see kv_vidctx_output() */
 	double		kv_framerate;
 	char		kv_dbgdir[PATH_MAX];
 };
 
-int
-kv_init(const char *dirname)
+/*
+ * Returns a new, zeroed entry at the end of kv_masks, which grows as needed.
+ */
+static kv_mask_t *
+kv_mask_alloc(void)
+{
+	kv_mask_t *masks;
+	int max;
+
+	if (kv_nmasks == kv_maxmasks) {
+		max = kv_maxmasks == 0 ? 256 : kv_maxmasks * 2;
+		if ((masks = realloc(kv_masks, max * sizeof (masks[0]))) ==
+		    NULL) {
+			warn("realloc");
+			return (NULL);
+		}
+
+		kv_masks = masks;
+		kv_maxmasks = max;
+	}
+
+	bzero(&kv_masks[kv_nmasks], sizeof (kv_masks[0]));
+	return (&kv_masks[kv_nmasks++]);
+}
+
+/*
+ * Returns the label for the first "len" characters of "name" (truncated to
+ * fit), adding it if it's not already there, or -1 on failure.
+ */
+static int
+kv_label(const char *name, size_t len)
+{
+	char label[KV_LABELLEN];
+	char (*labels)[KV_LABELLEN];
+	int i, max;
+
+	(void) strlcpy(label, name, MIN(len + 1, sizeof (label)));
+	for (i = 0; i < kv_nlabels; i++) {
+		if (strcmp(kv_labels[i], label) == 0)
+			return (i + 1);
+	}
+
+	if (kv_nlabels == UINT16_MAX) {
+		warnx("too many track and character names");
+		return (-1);
+	}
+
+	if (kv_nlabels == kv_maxlabels) {
+		max = kv_maxlabels == 0 ? 64 : kv_maxlabels * 2;
+		if ((labels = realloc(kv_labels, max * sizeof (labels[0]))) ==
+		    NULL) {
+			warn("realloc");
+			return (-1);
+		}
+
+		kv_labels = labels;
+		kv_maxlabels = max;
+	}
+
+	(void) strlcpy(kv_labels[kv_nlabels], label, sizeof (kv_labels[0]));
+	return (++kv_nlabels);
+}
+
+const char *
+kv_label_name(kv_label_t label)
+{
+	assert(label <= kv_nlabels);
+	return (label == KV_LABEL_NONE ? "" : kv_labels[label - 1]);
+}
+
+/*
+ * Load the masks from the pack built by "kartvid maskpack", if there is one.
+ * These are already compiled and ordered, so this is much faster than
+ * kv_init_png().
+ */
+static int
+kv_init_pack(const char *filename)
+{
+	maskpack_t *mp;
+	kv_mask_t *kmp;
+	unsigned int i;
+
+	if ((mp = maskpack_open(filename)) == NULL)
+		return (-1);
+
+	for (i = 0; i < maskpack_nmasks(mp); i++) {
+		if ((kmp = kv_mask_alloc()) == NULL) {
+			maskpack_close(mp);
+			errno = ENOMEM;
+			return (-1);
+		}
+
+		kmp->km_mask = maskpack_mask(mp, i);
+		(void) strlcpy(kmp->km_name, maskpack_name(mp, i),
+		    sizeof (kmp->km_name));
+		if (kv_mask_classify(kmp) != 0) {
+			maskpack_close(mp);
+			errno = ENOMEM;
+			return (-1);
+		}
+	}
+
+	if (kv_debug > 2)
+		(void) printf("loaded %d masks from %s\n", kv_nmasks, filename);
+
+	/* The masks refer to the mapping, so it stays around for good. */
+	kv_pack = mp;
+	return (0);
+}
+
+/*
+ * Read and compile each of the mask images in the assets directory.
+ */
+static int
+kv_init_png(const char *dirname)
 {
-	img_t *mask;
+	img_t *image;
+	img_mask_t *mask;
+	img_mask_t **masks;
 	kv_mask_t *kmp;
 	DIR *maskdir;
 	struct dirent *entp;
 	char *p;
 	char maskname[PATH_MAX];
 	char maskdirname[PATH_MAX];
-
-	if (kv_nmasks > 0)
-		/* already initialized */
-		return (0);
+	int i;
 
 	/*
 	 * For now, rather than explicitly enumerate the masks and check each
@@ -75,170 +278,1404 @@ kv_init(const char *dirname)
 		return (-1);
 	}
 
-	while ((entp = readdir(maskdir)) != NULL) {
-		if (kv_nmasks == KV_MAX_MASKS) {
-			warnx("too many masks (over %d)", KV_MAX_MASKS);
-			(void) closedir(maskdir);
-			return (-1);
+	while ((entp = readdir(maskdir)) != NULL) {
+		p = entp->d_name + strlen(entp->d_name) - sizeof (".png") + 1;
+		if (strcmp(p, ".png") != 0)
+			continue;
+
+		if (strncmp(entp->d_name, "char_", sizeof ("char_") - 1) != 0 &&
+		    strncmp(entp->d_name, "pos", sizeof ("pos") - 1) != 0 &&
+		    strncmp(entp->d_name, "item_", sizeof ("item_") - 1) != 0 &&
+		    strncmp(entp->d_name, "lakitu_start",
+		    sizeof ("lakitu_start") - 1) != 0 &&
+		    strncmp(entp->d_name, "track_", sizeof ("track_") - 1) != 0)
+			continue;
+
+		if (kv_debug > 2)
+			(void) printf("reading mask %-20s: ", entp->d_name);
+
+		(void) snprintf(maskname, sizeof (maskname), "%s/%s",
+		    maskdirname, entp->d_name);
+
+		if ((image = img_read(maskname)) == NULL) {
+			warnx("failed to read %s", maskname);
+			(void) closedir(maskdir);
+			return (-1);
+		}
+
+		mask = img_mask_compile(image);
+		img_free(image);
+		if (mask == NULL) {
+			warn("failed to compile %s", maskname);
+			(void) closedir(maskdir);
+			return (-1);
+		}
+
+		if ((kmp = kv_mask_alloc()) == NULL) {
+			img_mask_free(mask);
+			(void) closedir(maskdir);
+			return (-1);
+		}
+
+		kmp->km_mask = mask;
+		(void) strlcpy(kmp->km_name, entp->d_name,
+		    sizeof (kmp->km_name));
+		if (kv_mask_classify(kmp) != 0) {
+			(void) closedir(maskdir);
+			return (-1);
+		}
+
+		if (kv_debug > 2)
+			(void) printf("bounded [%d, %d] to [%d, %d], "
+			    "%d pixels in %d runs\n", mask->imm_minx,
+			    mask->imm_miny, mask->imm_maxx, mask->imm_maxy,
+			    mask->imm_npixels, mask->imm_nruns);
+	}
+
+	(void) closedir(maskdir);
+
+	if ((masks = calloc(kv_nmasks, sizeof (masks[0]))) == NULL) {
+		warn("calloc");
+		return (-1);
+	}
+
+	for (i = 0; i < kv_nmasks; i++)
+		masks[i] = kv_masks[i].km_mask;
+
+	if (img_mask_order(masks, kv_nmasks) != 0) {
+		warn("failed to order masks");
+		free(masks);
+		return (-1);
+	}
+
+	free(masks);
+	return (0);
+}
+
+/*
+ * Write the masks from the assets directory to a mask pack that subsequent
+ * calls to kv_init() will use instead.  This always starts from the mask
+ * images, even if there's already a mask pack.
+ */
+int
+kv_maskpack(const char *dirname, const char *filename)
+{
+	const char **names;
+	img_mask_t **masks;
+	int i, rv;
+
+	if (kv_nmasks > 0) {
+		warnx("masks already initialized");
+		return (-1);
+	}
+
+	if (kv_init_png(dirname) != 0)
+		return (-1);
+
+	names = calloc(kv_nmasks, sizeof (names[0]));
+	masks = calloc(kv_nmasks, sizeof (masks[0]));
+	if (names == NULL || masks == NULL) {
+		warn("calloc");
+		free(names);
+		free(masks);
+		return (-1);
+	}
+
+	for (i = 0; i < kv_nmasks; i++) {
+		names[i] = kv_masks[i].km_name;
+		masks[i] = kv_masks[i].km_mask;
+	}
+
+	rv = maskpack_write(filename, names, masks, kv_nmasks);
+	free(names);
+	free(masks);
+	return (rv);
+}
+
+int
+kv_init(const char *dirname)
+{
+	kv_mask_t *kmp;
+	kv_group_t *kgp;
+	char packname[PATH_MAX];
+	int i;
+
+	if (kv_nmasks > 0)
+		/* already initialized */
+		return (0);
+
+	/*
+	 * Use the mask pack if it's been built and is usable.  Otherwise, fall
+	 * back to compiling the mask images.
+	 */
+	(void) snprintf(packname, sizeof (packname),
+	    "%s/../assets/masks.pack", dirname);
+
+	if (kv_init_pack(packname) != 0) {
+		if (errno != ENOENT)
+			warnx("ignoring %s", packname);
+		kv_nmasks = 0;
+		kv_nlabels = 0;
+		if (kv_init_png(dirname) != 0)
+			return (-1);
+	}
+
+	if ((i = pthread_key_create(&kv_pyramid_key, kv_pyramid_free)) != 0) {
+		warnx("failed to create pyramid key: %s", strerror(i));
+		return (-1);
+	}
+
+	if ((i = pthread_key_create(&kv_cache_key, kv_cache_free)) != 0) {
+		warnx("failed to create cache key: %s", strerror(i));
+		return (-1);
+	}
+
+	if ((i = pthread_key_create(&kv_eval_key, kv_eval_free)) != 0) {
+		warnx("failed to create evaluation key: %s", strerror(i));
+		return (-1);
+	}
+
+	/*
+	 * Sort the masks into groups (see kv_group_t above).
+	 */
+	qsort(kv_masks, kv_nmasks, sizeof (kv_masks[0]),
+	    (int (*)(const void *, const void *))kv_mask_compare);
+
+	if ((kv_groups = calloc(MAX(kv_nmasks, 1),
+	    sizeof (kv_groups[0]))) == NULL) {
+		warn("calloc");
+		return (-1);
+	}
+
+	for (i = 0; i < kv_nmasks; i++) {
+		kmp = &kv_masks[i];
+		kmp->km_group = -1;
+
+		/*
+		 * Item masks that aren't for a particular square (like
+		 * item_box_area) are never used by kv_ident_matches().
+		 */
+		if (kmp->km_which == KV_IDENT_ITEM && kmp->km_square == 0)
+			continue;
+
+		if (kv_ngroups == 0 ||
+		    kv_groups[kv_ngroups - 1].kg_which != kmp->km_which ||
+		    kv_groups[kv_ngroups - 1].kg_square != kmp->km_square ||
+		    kv_groups[kv_ngroups - 1].kg_last != i) {
+			kgp = &kv_groups[kv_ngroups++];
+			kgp->kg_which = kmp->km_which;
+			kgp->kg_square = kmp->km_square;
+			kgp->kg_gated = kmp->km_which == KV_IDENT_ITEM &&
+			    KV_MASK_GATE(kmp->km_name);
+			kgp->kg_first = i;
+			kgp->kg_blank = -1;
+			kgp->kg_box.ib_minx = kmp->km_mask->imm_minx;
+			kgp->kg_box.ib_maxx = kmp->km_mask->imm_maxx;
+			kgp->kg_box.ib_miny = kmp->km_mask->imm_miny;
+			kgp->kg_box.ib_maxy = kmp->km_mask->imm_maxy;
+		}
+
+		kgp = &kv_groups[kv_ngroups - 1];
+		kgp->kg_last = i + 1;
+		if (kgp->kg_gated && KV_MASK_BLANK(kmp->km_name))
+			kgp->kg_blank = i;
+		kgp->kg_box.ib_minx = MIN(kgp->kg_box.ib_minx,
+		    kmp->km_mask->imm_minx);
+		kgp->kg_box.ib_maxx = MAX(kgp->kg_box.ib_maxx,
+		    kmp->km_mask->imm_maxx);
+		kgp->kg_box.ib_miny = MIN(kgp->kg_box.ib_miny,
+		    kmp->km_mask->imm_miny);
+		kgp->kg_box.ib_maxy = MAX(kgp->kg_box.ib_maxy,
+		    kmp->km_mask->imm_maxy);
+		kmp->km_group = kgp - kv_groups;
+	}
+
+	if (kv_debug > 2) {
+		for (i = 0; i < kv_ngroups; i++) {
+			kgp = &kv_groups[i];
+			(void) printf("group %2d: square %d, %2d masks "
+			    "starting with %s%s, box %u-%u x %u-%u\n", i,
+			    kgp->kg_square, kgp->kg_last - kgp->kg_first,
+			    kv_masks[kgp->kg_first].km_name,
+			    kgp->kg_gated ? " (gate)" : "",
+			    kgp->kg_box.ib_minx, kgp->kg_box.ib_maxx,
+			    kgp->kg_box.ib_miny, kgp->kg_box.ib_maxy);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Fill in what kv_ident() needs to know about a mask based on its name.
+ * Returns -1 only if we run out of memory.
+ */
+static int
+kv_mask_classify(kv_mask_t *kmp)
+{
+	const char *name = kmp->km_name;
+	const char *p;
+	char item[sizeof (kmp->km_name)];
+	unsigned int pos, square;
+	int label;
+
+	square = 0;
+	kmp->km_label = KV_LABEL_NONE;
+
+	if (KV_MASK_POS(name)) {
+		kmp->km_which = 0;
+		kmp->km_rank = 0;
+		kmp->km_thresh = IMG_SCORE(KV_THRESHOLD_TRACK);
+		if (sscanf(name, "pos%u_square%u", &pos, &square) != 2) {
+			square = 0;
+		} else if (pos > 0 && pos <= KV_MAXPLAYERS && square > 0) {
+			kmp->km_pos = pos;
+			kmp->km_final =
+			    strlen(name) >= sizeof ("pos1_square1") &&
+			    strcmp(name + sizeof ("pos1_square1") - 1,
+			    "_final.png") == 0;
+		}
+	} else if (KV_MASK_CHAR(name)) {
+		kmp->km_which = KV_IDENT_CHARS;
+		kmp->km_rank = 1;
+		kmp->km_thresh = IMG_SCORE(KV_THRESHOLD_CHAR);
+		p = strchr(name + sizeof ("char_") - 1, '_');
+		if (p == NULL || sscanf(p + 1, "%u", &square) != 1)
+			square = 0;
+		else if (square > 0 && square <= KV_MAXPLAYERS) {
+			if ((label = kv_label(name + sizeof ("char_") - 1,
+			    p - name - (sizeof ("char_") - 1))) == -1)
+				return (-1);
+			kmp->km_label = label;
+		}
+	} else if (KV_MASK_ITEM(name)) {
+		kmp->km_which = KV_IDENT_ITEM;
+		kmp->km_rank = 2;
+		kmp->km_thresh = KV_MASK_GATE(name) ?
+		    IMG_SCORE(KV_THRESHOLD_ITEMFRAME) :
+		    IMG_SCORE(KV_THRESHOLD_ITEM);
+		p = strrchr(name, '_');
+		if (p == name + sizeof ("item_") - 1 ||
+		    sscanf(p + 1, "%u", &square) != 1) {
+			square = 0;
+		} else {
+			(void) strlcpy(item, name + sizeof ("item_") - 1,
+			    p - name - (sizeof ("item_") - 1) + 1);
+			kmp->km_item = kv_mask_item(item);
+		}
+	} else if (KV_MASK_LAKITU(name)) {
+		kmp->km_which = KV_IDENT_START;
+		kmp->km_rank = 3;
+		kmp->km_thresh = IMG_SCORE(KV_THRESHOLD_LAKITU);
+	} else {
+		kmp->km_which = KV_IDENT_TRACK;
+		kmp->km_rank = 4;
+		kmp->km_thresh = IMG_SCORE(KV_THRESHOLD_TRACK);
+
+		/*
+		 * The track name is the first word after "track_", where words
+		 * are separated by "_" or ".", but it's always at least one
+		 * character long.
+		 */
+		p = name + sizeof ("track_") - 1;
+		if (strncmp(name, "track_", sizeof ("track_") - 1) == 0) {
+			if (*p != '\0') {
+				p++;
+				p += strspn(p, "_.");
+				p += strcspn(p, "_.");
+			}
+
+			if ((label = kv_label(name + sizeof ("track_") - 1,
+			    p - name - (sizeof ("track_") - 1))) == -1)
+				return (-1);
+			kmp->km_label = label;
+		}
+	}
+
+	kmp->km_square = square <= KV_MAXPLAYERS ? square : 0;
+	return (0);
+}
+
+int
+kv_mask_compare(const kv_mask_t *m1, const kv_mask_t *m2)
+{
+	if (m1->km_rank != m2->km_rank)
+		return (m1->km_rank < m2->km_rank ? -1 : 1);
+
+	if (m1->km_square != m2->km_square)
+		return (m1->km_square < m2->km_square ? -1 : 1);
+
+	/* Gating masks go first in their group. */
+	if (m1->km_which == KV_IDENT_ITEM &&
+	    KV_MASK_GATE(m1->km_name) != KV_MASK_GATE(m2->km_name))
+		return (KV_MASK_GATE(m1->km_name) ? -1 : 1);
+
+	return (strcmp(m1->km_name, m2->km_name));
+}
+
+/*
+ * kv_ident() may evaluate masks on several threads (see kv_ident_threads()),
+ * but it always applies the results to the screen state in the same order that
+ * a serial walk of kv_groups would, and it evaluates exactly the same set of
+ * masks, so the outcome doesn't depend on the number of threads.  It does this
+ * in rounds: each round evaluates (in parallel) every mask whose evaluation no
+ * longer depends on the results of masks that haven't been applied yet, and
+ * then applies results, in group order, for as many groups as are complete.
+ * In practice, the first round evaluates the position, character, lakitu, and
+ * track masks, the second evaluates the item box frame for each player's
+ * square, and the third evaluates the item masks for squares whose box frame
+ * was visible (or just the blank mask, if we don't want the actual item, with
+ * a fourth round for the rest if it matched).
+ */
+typedef struct {
+	img_t		*ke_image;
+	const img_yuv_t	*ke_yuv;	/* if non-NULL, used instead of image */
+	img_pyramid_t	*ke_pyr;
+	int		ke_ntodo;	/* masks to evaluate */
+	int		*ke_todo;
+	boolean_t	*ke_done;	/* mask was evaluated */
+	img_score_t	*ke_scores;	/* score, if done */
+} kv_eval_t;
+
+/*
+ * Consecutive frames of a video are often partly or entirely the same: paused
+ * or static screens, unchanging parts of the display, and frames that capture
+ * hardware duplicates.  So each thread that identifies frames keeps a cache of
+ * the score it last computed for each mask, along with a copy (see
+ * img_region_same()) of the region of the frame that each group looks at.  A
+ * mask whose group's region is byte-for-byte the same in the next frame gets
+ * the cached score instead of being evaluated.  If every region the
+ * identification looks at is unchanged, the frame is a duplicate, and the whole
+ * result is reused.  Since scores depend only on the pixels in the region, the
+ * results are exactly the same either way; it doesn't even matter which frame
+ * the thread identified before.
+ */
+typedef struct {
+	boolean_t	kc_yuv;		/* scores are for YUV frames */
+	boolean_t	*kc_valid;	/* kc_scores[m] is valid */
+	img_score_t	*kc_scores;
+	img_region_t	*kc_regions;	/* each group's region, as scored */
+	boolean_t	*kc_changed;	/* group's region changed */
+	boolean_t	kc_havescreen;	/* kc_screen is valid */
+	kv_ident_t	kc_which;	/* what kc_screen identified */
+	kv_screen_t	kc_screen;
+} kv_cache_t;
+
+/*
+ * Counters for kv_ident_stats().
+ */
+static atomic_ulong kv_stat_frames;	/* frames identified */
+static atomic_ulong kv_stat_dups;	/* ... that were duplicates */
+static atomic_ulong kv_stat_masks;	/* mask scores needed */
+static atomic_ulong kv_stat_reused;	/* ... that came from the cache */
+
+/*
+ * Per-mask counters for kv_mask_stats_write(), allocated (one per mask) by
+ * kv_mask_stats_enable().  Masks are usually compared with an early exit once
+ * they can't match, in which case the score isn't known, so the histogram only
+ * covers scores within the mask's threshold, in buckets of equal width, and
+ * kms_over counts the rest.
+ */
+#define	KV_MSTAT_NBUCKETS	20
+
+typedef struct {
+	atomic_ulong	kms_compared;	/* times evaluated */
+	atomic_ulong	kms_matched;	/* ... that were within km_thresh */
+	atomic_ulong	kms_pixels;	/* pixels compared */
+	atomic_ulong	kms_ns;		/* total time evaluating */
+	atomic_ulong	kms_over;	/* scores over km_thresh */
+	atomic_ulong	kms_scores[KV_MSTAT_NBUCKETS];
+} kv_mask_stat_t;
+
+static kv_mask_stat_t *kv_mstats;	/* NULL unless enabled */
+
+#ifdef KV_USDT
+/*
+ * Names of the mask classes for probes, indexed by km_rank.
+ */
+static const char *kv_class_names[] = {
+	"position",
+	"character",
+	"item",
+	"start",
+	"track",
+};
+#endif
+
+static uint64_t
+kv_now(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+kv_mask_stat_record(kv_mask_stat_t *kmsp, const kv_mask_t *kmp,
+    img_score_t score, unsigned int npixels, uint64_t ns)
+{
+	unsigned int b;
+
+	(void) atomic_fetch_add(&kmsp->kms_compared, 1);
+	(void) atomic_fetch_add(&kmsp->kms_pixels, npixels);
+	(void) atomic_fetch_add(&kmsp->kms_ns, ns);
+
+	if (score > kmp->km_thresh) {
+		(void) atomic_fetch_add(&kmsp->kms_over, 1);
+		return;
+	}
+
+	b = (uint64_t)score * KV_MSTAT_NBUCKETS / IMG_SCORE_ONE;
+	if (b >= KV_MSTAT_NBUCKETS)
+		b = KV_MSTAT_NBUCKETS - 1;
+
+	(void) atomic_fetch_add(&kmsp->kms_matched, 1);
+	(void) atomic_fetch_add(&kmsp->kms_scores[b], 1);
+}
+
+static void
+kv_eval_mask(void *arg, unsigned int i, unsigned int worker)
+{
+	kv_eval_t *kep = arg;
+	int m = kep->ke_todo[i];
+	kv_mask_t *kmp = &kv_masks[m];
+	kv_mask_stat_t *kmsp = kv_mstats == NULL ? NULL : &kv_mstats[m];
+	uint64_t start = bench_start();
+	uint64_t mstart = kmsp == NULL ? 0 : kv_now();
+	unsigned int npixels = 0;
+	unsigned int *npixelsp = kmsp == NULL ? NULL : &npixels;
+
+	KV_PROBE2(mask__start, kv_class_names[kmp->km_rank], kmp->km_name);
+
+	/*
+	 * When debugging, we want to see the real score for every mask we
+	 * evaluate, not just the ones that match.
+	 */
+	if (kep->ke_yuv != NULL) {
+		kep->ke_scores[m] = img_mask_compare_yuv(kep->ke_yuv,
+		    kmp->km_yuv, kv_debug > 1 ? IMG_SCORE_ONE : kmp->km_thresh,
+		    npixelsp);
+	} else if (kv_debug > 1) {
+		kep->ke_scores[m] = img_mask_compare(kep->ke_image,
+		    kmp->km_mask);
+		npixels = kmp->km_mask->imm_npixels;
+	} else {
+		kep->ke_scores[m] = img_mask_compare_thresh(kep->ke_image,
+		    kep->ke_pyr, kmp->km_mask, kmp->km_thresh, npixelsp);
+	}
+
+	bench_done(BENCH_MASK_POS + kmp->km_rank, start);
+	KV_PROBE4(mask__done, kv_class_names[kmp->km_rank], kmp->km_name,
+	    kep->ke_scores[m], kmp->km_thresh);
+
+	if (kmsp != NULL)
+		kv_mask_stat_record(kmsp, kmp, kep->ke_scores[m], npixels,
+		    kv_now() - mstart);
+}
+
+/*
+ * Returns whether a group's masks are evaluated at all, given the screen state
+ * resulting from all of the groups before it.
+ */
+static boolean_t
+kv_group_wanted(kv_group_t *kgp, kv_screen_t *ksp, kv_ident_t which)
+{
+	if (kgp->kg_which != 0 && !(which & kgp->kg_which))
+		return (B_FALSE);
+
+	if (kgp->kg_which == KV_IDENT_ITEM &&
+	    kgp->kg_square > ksp->ks_nplayers)
+		return (B_FALSE);
+
+	return (B_TRUE);
+}
+
+/*
+ * Returns whether applying a group's results can change ks_nplayers, which
+ * determines whether later item groups are wanted.
+ */
+#define	KV_GROUP_PLAYERS(kgp)	\
+	((kgp)->kg_which == 0 || (kgp)->kg_which == KV_IDENT_CHARS)
+
+/*
+ * Returns whether the mask matched.  If "apply" is true, update the screen
+ * state accordingly.
+ */
+static boolean_t
+kv_ident_mask(kv_eval_t *kep, kv_screen_t *ksp, int m, boolean_t apply)
+{
+	kv_mask_t *kmp = &kv_masks[m];
+	img_score_t score = kep->ke_scores[m];
+
+	assert(kep->ke_done[m]);
+
+	if (!apply)
+		return (score <= kmp->km_thresh);
+
+	if (kv_debug > 1)
+		(void) printf("mask %s: %f\n", kmp->km_name,
+		    IMG_SCORE_DOUBLE(score));
+
+	if (score > kmp->km_thresh)
+		return (B_FALSE);
+
+	kv_ident_matches(ksp, kmp, score);
+	return (B_TRUE);
+}
+
+/*
+ * Walk the masks of a wanted group that would be evaluated given the results
+ * so far.  If "apply" is true, all of the masks the group needs must have been
+ * evaluated, and their results are applied to the screen state.  Otherwise,
+ * the masks that still need to be evaluated are added to kep->ke_todo.
+ * Returns whether the group's results are complete.
+ */
+static boolean_t
+kv_ident_group(kv_eval_t *kep, kv_screen_t *ksp, kv_group_t *kgp,
+    kv_ident_t which, boolean_t apply)
+{
+	int i;
+	boolean_t complete = B_TRUE;
+
+	/*
+	 * If we don't want the actual item, the box frame and the blank mask
+	 * come first (see above).  If either doesn't match, the group is done,
+	 * and otherwise we walk the whole group as usual, so that the results
+	 * are applied in the same order either way.
+	 */
+	if (kgp->kg_blank != -1 &&
+	    !(which & KV_IDENT_ITEMS_SQUARE(kgp->kg_square))) {
+		if (!kep->ke_done[kgp->kg_first]) {
+			assert(!apply);
+			kep->ke_todo[kep->ke_ntodo++] = kgp->kg_first;
+			return (B_FALSE);
+		}
+
+		if (kv_ident_mask(kep, ksp, kgp->kg_first, B_FALSE)) {
+			if (!kep->ke_done[kgp->kg_blank]) {
+				assert(!apply);
+				kep->ke_todo[kep->ke_ntodo++] = kgp->kg_blank;
+				return (B_FALSE);
+			}
+
+			if (!kv_ident_mask(kep, ksp, kgp->kg_blank, B_FALSE)) {
+				if (apply) {
+					(void) kv_ident_mask(kep, ksp,
+					    kgp->kg_first, B_TRUE);
+					(void) kv_ident_mask(kep, ksp,
+					    kgp->kg_blank, B_TRUE);
+				}
+				return (B_TRUE);
+			}
+		}
+	}
+
+	for (i = kgp->kg_first; i < kgp->kg_last; i++) {
+		if (!kep->ke_done[i]) {
+			assert(!apply);
+			kep->ke_todo[kep->ke_ntodo++] = i;
+			complete = B_FALSE;
+			if (i == kgp->kg_first && kgp->kg_gated)
+				break;
+			continue;
+		}
+
+		if (!kv_ident_mask(kep, ksp, i, apply) &&
+		    i == kgp->kg_first && kgp->kg_gated)
+			break;
+	}
+
+	return (complete);
+}
+
+/*
+ * Report any real item in a square whose item we weren't asked for as
+ * KVI_UNKNOWN (see KV_IDENT_ITEMS_SQUARE()), so the result is the same whether
+ * or not all of the items were checked.
+ */
+static void
+kv_ident_items(kv_screen_t *ksp, kv_ident_t which)
+{
+	kv_player_t *kpp;
+	int i;
+
+	for (i = 0; i < KV_MAXPLAYERS; i++) {
+		kpp = &ksp->ks_players[i];
+		if (!(which & KV_IDENT_ITEMS_SQUARE(i + 1)) &&
+		    kpp->kp_item >= KVI_REALITEM_MIN)
+			kpp->kp_item = KVI_UNKNOWN;
+	}
+}
+
+/*
+ * kv_ident() can be called from several threads at once (see
+ * kv_vidctx_ident()), so each thread gets its own pyramid, which is reused for
+ * every frame that thread identifies.  Returns NULL if the pyramid can't be
+ * allocated, in which case kv_ident() just does without.
+ */
+static img_pyramid_t *
+kv_pyramid(void)
+{
+	img_pyramid_t *pyr;
+	int i;
+
+	if ((pyr = pthread_getspecific(kv_pyramid_key)) != NULL)
+		return (pyr);
+
+	if ((pyr = calloc(1, sizeof (*pyr))) == NULL)
+		return (NULL);
+
+	for (i = 0; i < kv_nmasks; i++) {
+		if (img_pyramid_need(pyr, kv_masks[i].km_mask) != 0) {
+			kv_pyramid_free(pyr);
+			return (NULL);
+		}
+	}
+
+	if (pthread_setspecific(kv_pyramid_key, pyr) != 0) {
+		kv_pyramid_free(pyr);
+		return (NULL);
+	}
+
+	return (pyr);
+}
+
+static void
+kv_pyramid_free(void *arg)
+{
+	img_pyramid_t *pyr = arg;
+
+	img_pyramid_fini(pyr);
+	free(pyr);
+}
+
+/*
+ * Returns this thread's cache (see kv_cache_t), or NULL if it can't be
+ * allocated, in which case kv_ident() does without.
+ */
+static kv_cache_t *
+kv_cache(void)
+{
+	kv_cache_t *kcp;
+
+	if ((kcp = pthread_getspecific(kv_cache_key)) != NULL)
+		return (kcp);
+
+	if ((kcp = calloc(1, sizeof (*kcp))) == NULL)
+		return (NULL);
+
+	kcp->kc_valid = calloc(kv_nmasks, sizeof (kcp->kc_valid[0]));
+	kcp->kc_scores = calloc(kv_nmasks, sizeof (kcp->kc_scores[0]));
+	kcp->kc_regions = calloc(kv_ngroups, sizeof (kcp->kc_regions[0]));
+	kcp->kc_changed = calloc(kv_ngroups, sizeof (kcp->kc_changed[0]));
+	if (kcp->kc_valid == NULL || kcp->kc_scores == NULL ||
+	    kcp->kc_regions == NULL || kcp->kc_changed == NULL ||
+	    pthread_setspecific(kv_cache_key, kcp) != 0) {
+		kv_cache_free(kcp);
+		return (NULL);
+	}
+
+	return (kcp);
+}
+
+static void
+kv_cache_free(void *arg)
+{
+	kv_cache_t *kcp = arg;
+	int g;
+
+	if (kcp->kc_regions != NULL) {
+		for (g = 0; g < kv_ngroups; g++)
+			img_region_fini(&kcp->kc_regions[g]);
+	}
+
+	free(kcp->kc_valid);
+	free(kcp->kc_scores);
+	free(kcp->kc_regions);
+	free(kcp->kc_changed);
+	free(kcp);
+}
+
+/*
+ * Returns this thread's working state for kv_ident(), sized for the masks that
+ * were loaded, or NULL if it can't be allocated.
+ */
+static kv_eval_t *
+kv_eval(void)
+{
+	kv_eval_t *kep;
+
+	if ((kep = pthread_getspecific(kv_eval_key)) != NULL)
+		return (kep);
+
+	if ((kep = calloc(1, sizeof (*kep))) == NULL)
+		return (NULL);
+
+	kep->ke_todo = calloc(kv_nmasks, sizeof (kep->ke_todo[0]));
+	kep->ke_done = calloc(kv_nmasks, sizeof (kep->ke_done[0]));
+	kep->ke_scores = calloc(kv_nmasks, sizeof (kep->ke_scores[0]));
+	if (kep->ke_todo == NULL || kep->ke_done == NULL ||
+	    kep->ke_scores == NULL ||
+	    pthread_setspecific(kv_eval_key, kep) != 0) {
+		kv_eval_free(kep);
+		return (NULL);
+	}
+
+	return (kep);
+}
+
+static void
+kv_eval_free(void *arg)
+{
+	kv_eval_t *kep = arg;
+
+	free(kep->ke_todo);
+	free(kep->ke_done);
+	free(kep->ke_scores);
+	free(kep);
+}
+
+/*
+ * Compare the region of each group that could be evaluated for "which" to the
+ * cache's copy, forget the cached scores of masks whose group's region changed,
+ * and return whether none did.
+ */
+static boolean_t
+kv_cache_check(kv_eval_t *kep, kv_cache_t *kcp, kv_ident_t which)
+{
+	kv_group_t *kgp;
+	boolean_t same, changed;
+	int g, m;
+
+	same = B_TRUE;
+	for (g = 0; g < kv_ngroups; g++) {
+		kgp = &kv_groups[g];
+		if (kgp->kg_which != 0 && !(which & kgp->kg_which))
+			continue;
+
+		changed = kep->ke_yuv != NULL ?
+		    !img_region_same_yuv(&kcp->kc_regions[g], kep->ke_yuv,
+		    &kgp->kg_box) :
+		    !img_region_same(&kcp->kc_regions[g], kep->ke_image,
+		    &kgp->kg_box);
+		kcp->kc_changed[g] = changed;
+		if (changed)
+			same = B_FALSE;
+	}
+
+	if (same)
+		return (B_TRUE);
+
+	for (m = 0; m < kv_nmasks; m++) {
+		if (kcp->kc_changed[kv_masks[m].km_group])
+			kcp->kc_valid[m] = B_FALSE;
+	}
+
+	bzero(kcp->kc_changed, kv_ngroups * sizeof (kcp->kc_changed[0]));
+	return (B_FALSE);
+}
+
+/*
+ * Fill in the scores of masks to be evaluated whose group's region hasn't
+ * changed since they were scored, and take them off the list.
+ */
+static void
+kv_cache_lookup(kv_eval_t *kep, kv_cache_t *kcp)
+{
+	int i, m, n;
+
+	for (i = 0, n = 0; i < kep->ke_ntodo; i++) {
+		m = kep->ke_todo[i];
+		if (kcp->kc_valid[m]) {
+			kep->ke_scores[m] = kcp->kc_scores[m];
+			kep->ke_done[m] = B_TRUE;
+			continue;
+		}
+
+		kep->ke_todo[n++] = m;
+	}
+
+	(void) atomic_fetch_add(&kv_stat_reused, kep->ke_ntodo - n);
+	kep->ke_ntodo = n;
+}
+
+static void
+kv_cache_store(kv_eval_t *kep, kv_cache_t *kcp)
+{
+	int i, m;
+
+	for (i = 0; i < kep->ke_ntodo; i++) {
+		m = kep->ke_todo[i];
+		kcp->kc_valid[m] = B_TRUE;
+		kcp->kc_scores[m] = kep->ke_scores[m];
+	}
+}
+
+static uint64_t
+kv_box_area(const img_box_t *bp)
+{
+	return ((uint64_t)(bp->ib_maxx - bp->ib_minx) *
+	    (bp->ib_maxy - bp->ib_miny));
+}
+
+static void
+kv_box_union(img_box_t *dst, const img_box_t *b1, const img_box_t *b2)
+{
+	dst->ib_minx = MIN(b1->ib_minx, b2->ib_minx);
+	dst->ib_maxx = MAX(b1->ib_maxx, b2->ib_maxx);
+	dst->ib_miny = MIN(b1->ib_miny, b2->ib_miny);
+	dst->ib_maxy = MAX(b1->ib_maxy, b2->ib_maxy);
+}
+
+/*
+ * kv_ident() only ever looks at pixels inside the bounding boxes of the masks,
+ * so callers can save work by only producing those parts of each image (see
+ * video_set_regions()).  This fills in up to "nboxes" regions that together
+ * cover every mask that kv_ident() would evaluate for "which" and returns how
+ * many it filled in.  Starting with each
+ * mask's bounding box, we repeatedly merge the pair of boxes whose union adds
+ * the least area not already covered, for as long as that doesn't add any
+ * area at all or there are more than "nboxes" boxes.
+ */
+unsigned int
+kv_regions(kv_ident_t which, img_box_t *boxes, unsigned int nboxes)
+{
+	img_box_t *all, u;
+	img_mask_t *mp;
+	unsigned int i, j, n, besti, bestj;
+	int64_t cost, best;
+
+	/*
+	 * Returning no regions means the whole frame will be used, so that's
+	 * what we do if we can't work them out.
+	 */
+	if (nboxes == 0)
+		return (0);
+
+	if ((all = calloc(kv_nmasks, sizeof (all[0]))) == NULL) {
+		warn("calloc");
+		return (0);
+	}
+
+	for (i = 0, n = 0; i < kv_nmasks; i++) {
+		if (kv_masks[i].km_which != 0 &&
+		    !(which & kv_masks[i].km_which))
+			continue;
+
+		mp = kv_masks[i].km_mask;
+		all[n].ib_minx = mp->imm_minx;
+		all[n].ib_maxx = mp->imm_maxx;
+		all[n].ib_miny = mp->imm_miny;
+		all[n].ib_maxy = mp->imm_maxy;
+		n++;
+	}
+
+	while (n > 1) {
+		best = INT64_MAX;
+		besti = bestj = 0;
+		for (i = 0; i < n; i++) {
+			for (j = i + 1; j < n; j++) {
+				kv_box_union(&u, &all[i], &all[j]);
+				cost = (int64_t)kv_box_area(&u) -
+				    kv_box_area(&all[i]) - kv_box_area(&all[j]);
+				if (cost < best) {
+					best = cost;
+					besti = i;
+					bestj = j;
+				}
+			}
+		}
+
+		if (best > 0 && n <= nboxes)
+			break;
+
+		kv_box_union(&all[besti], &all[besti], &all[bestj]);
+		all[bestj] = all[--n];
+	}
+
+	bcopy(all, boxes, n * sizeof (boxes[0]));
+	free(all);
+	return (n);
+}
+
+/*
+ * Returns the best (lowest) score of any race start mask for "image".  Scores
+ * above "limit" aren't computed exactly, so anything above "limit" just means
+ * that no mask scored within it.  This is much cheaper than identifying the
+ * frame with KV_IDENT_START, and it lets callers tell frames that almost look
+ * like a race start from those that don't at all.
+ */
+double
+kv_start_score(img_t *image, double limit)
+{
+	img_score_t score, best;
+	int i;
+
+	best = IMG_SCORE_ONE;
+	for (i = 0; i < kv_nmasks; i++) {
+		if (kv_masks[i].km_which != KV_IDENT_START)
+			continue;
+
+		score = img_mask_compare_thresh(image, NULL,
+		    kv_masks[i].km_mask, IMG_SCORE(limit), NULL);
+		if (score < best)
+			best = score;
+	}
+
+	return (IMG_SCORE_DOUBLE(best));
+}
+
+static pool_t *kv_pool;
+
+/*
+ * Evaluate masks using "nthreads" threads in subsequent calls to kv_ident().
+ */
+int
+kv_ident_threads(unsigned int nthreads)
+{
+	pool_t *pool;
+
+	if ((pool = pool_init(nthreads)) == NULL)
+		return (-1);
+
+	pool_fini(kv_pool);
+	kv_pool = pool;
+	return (0);
+}
+
+/*
+ * The race is over once all but one of the players have finished.
+ */
+static void
+kv_ident_done(kv_screen_t *ksp)
+{
+	int i, ndone;
+
+	ndone = 0;
+	for (i = 0; i < ksp->ks_nplayers; i++) {
+		if (ksp->ks_players[i].kp_lapnum == 4)
+			ndone++;
+	}
+
+	if (ndone >= ksp->ks_nplayers - 1)
+		ksp->ks_events |= KVE_RACE_DONE;
+}
+
+static void
+kv_ident_frame(img_t *image, const img_yuv_t *yuv, kv_screen_t *ksp,
+    kv_ident_t which)
+{
+	int i, g, napplied;
+	boolean_t settled, needpyr;
+	kv_group_t *kgp;
+	kv_cache_t *kcp;
+	uint64_t start;
+	kv_eval_t *kep;
+
+	KV_PROBE1(ident__start, which);
+	start = bench_start();
+	bzero(ksp, sizeof (*ksp));
+	if ((kep = kv_eval()) == NULL) {
+		warn("failed to identify frame");
+		return;
+	}
+
+	bzero(kep->ke_done, kv_nmasks * sizeof (kep->ke_done[0]));
+	kep->ke_image = image;
+	kep->ke_yuv = yuv;
+	kep->ke_pyr = NULL;
+	(void) atomic_fetch_add(&kv_stat_frames, 1);
+
+	/*
+	 * When debugging, we want to see every mask's real score, so we don't
+	 * use the cache then.  YUV and RGB scores differ slightly, so the
+	 * cache is only good for one or the other.
+	 */
+	kcp = kv_debug > 1 ? NULL : kv_cache();
+	if (kcp != NULL) {
+		if (kcp->kc_yuv != (yuv != NULL)) {
+			bzero(kcp->kc_valid,
+			    kv_nmasks * sizeof (kcp->kc_valid[0]));
+			for (g = 0; g < kv_ngroups; g++)
+				img_region_fini(&kcp->kc_regions[g]);
+			kcp->kc_havescreen = B_FALSE;
+			kcp->kc_yuv = yuv != NULL;
+		}
+
+		if (kv_cache_check(kep, kcp, which) && kcp->kc_havescreen &&
+		    kcp->kc_which == which) {
+			(void) atomic_fetch_add(&kv_stat_dups, 1);
+			*ksp = kcp->kc_screen;
+			bench_done(BENCH_IDENT, start);
+			KV_PROBE2(ident__done, which, 1);
+			return;
+		}
+	}
+
+	/*
+	 * Coarse views let us rule out most masks without looking at every
+	 * pixel, but they're just an optimization.  We only have them for RGB,
+	 * and we don't build them unless some mask actually needs evaluating.
+	 */
+	needpyr = yuv == NULL;
+
+	napplied = 0;
+	while (napplied < kv_ngroups) {
+		/*
+		 * Collect the masks we know we'll need.  Whether an item group
+		 * is wanted isn't known until all of the groups before it that
+		 * could change ks_nplayers have been applied.
+		 */
+		kep->ke_ntodo = 0;
+		settled = B_TRUE;
+		for (g = napplied; g < kv_ngroups; g++) {
+			kgp = &kv_groups[g];
+
+			if (kgp->kg_which == KV_IDENT_ITEM && !settled)
+				continue;
+
+			if (!kv_group_wanted(kgp, ksp, which))
+				continue;
+
+			(void) kv_ident_group(kep, ksp, kgp, which, B_FALSE);
+
+			if (KV_GROUP_PLAYERS(kgp))
+				settled = B_FALSE;
+		}
+
+		(void) atomic_fetch_add(&kv_stat_masks, kep->ke_ntodo);
+		if (kcp != NULL)
+			kv_cache_lookup(kep, kcp);
+
+		if (needpyr && kep->ke_ntodo > 0) {
+			needpyr = B_FALSE;
+			kep->ke_pyr = kv_pyramid();
+			if (kep->ke_pyr != NULL &&
+			    img_pyramid_build(kep->ke_pyr, image) != 0)
+				kep->ke_pyr = NULL;
 		}
 
-		p = entp->d_name + strlen(entp->d_name) - sizeof (".png") + 1;
-		if (strcmp(p, ".png") != 0)
-			continue;
+		if (kv_pool != NULL)
+			pool_run(kv_pool, kv_eval_mask, kep, kep->ke_ntodo);
+		else
+			for (i = 0; i < kep->ke_ntodo; i++)
+				kv_eval_mask(kep, i, 0);
 
-		if (strncmp(entp->d_name, "char_", sizeof ("char_") - 1) != 0 &&
-		    strncmp(entp->d_name, "pos", sizeof ("pos") - 1) != 0 &&
-		    strncmp(entp->d_name, "item_", sizeof ("item_") - 1) != 0 &&
-		    strncmp(entp->d_name, "lakitu_start",
-		    sizeof ("lakitu_start") - 1) != 0 &&
-		    strncmp(entp->d_name, "track_", sizeof ("track_") - 1) != 0)
-			continue;
+		for (i = 0; i < kep->ke_ntodo; i++)
+			kep->ke_done[kep->ke_todo[i]] = B_TRUE;
 
-		if (kv_debug > 2)
-			(void) printf("reading mask %-20s: ", entp->d_name);
+		if (kcp != NULL)
+			kv_cache_store(kep, kcp);
 
-		(void) snprintf(maskname, sizeof (maskname), "%s/%s",
-		    maskdirname, entp->d_name);
+		/*
+		 * Apply the results of as many groups as we can, in order.
+		 */
+		for (; napplied < kv_ngroups; napplied++) {
+			kgp = &kv_groups[napplied];
+			if (!kv_group_wanted(kgp, ksp, which))
+				continue;
 
-		if ((mask = img_read(maskname)) == NULL) {
-			warnx("failed to read %s", maskname);
-			(void) closedir(maskdir);
-			return (-1);
+			kep->ke_ntodo = 0;
+			if (!kv_ident_group(kep, ksp, kgp, which, B_FALSE))
+				break;
+
+			(void) kv_ident_group(kep, ksp, kgp, which, B_TRUE);
 		}
+	}
 
-		kmp = &kv_masks[kv_nmasks++];
-		kmp->km_image = mask;
-		(void) strlcpy(kmp->km_name, entp->d_name,
-		    sizeof (kmp->km_name));
+	kv_ident_items(ksp, which);
+	kv_ident_done(ksp);
 
-		if (kv_debug > 2)
-			(void) printf("bounded [%d, %d] to [%d, %d]\n",
-			    mask->img_minx, mask->img_miny, mask->img_maxx,
-			    mask->img_maxy);
+	if (kcp != NULL) {
+		kcp->kc_havescreen = B_TRUE;
+		kcp->kc_which = which;
+		kcp->kc_screen = *ksp;
 	}
 
-	(void) closedir(maskdir);
+	bench_done(BENCH_IDENT, start);
+	KV_PROBE2(ident__done, which, 0);
+}
 
-	/*
-	 * It's important that we check position masks before others so that
-	 * ks_nplayers is set correctly.
-	 */
-	qsort(kv_masks, kv_nmasks, sizeof (kv_masks[0]),
-	    (int (*)(const void *, const void *))kv_mask_compare);
-	return (0);
+/*
+ * Print how often kv_ident() was able to reuse results (see kv_cache_t).
+ */
+void
+kv_ident_stats(FILE *fp)
+{
+	unsigned long nframes, ndups, nmasks, nreused;
+
+	nframes = atomic_load(&kv_stat_frames);
+	ndups = atomic_load(&kv_stat_dups);
+	nmasks = atomic_load(&kv_stat_masks);
+	nreused = atomic_load(&kv_stat_reused);
+
+	(void) fprintf(fp, "frames identified: %lu, duplicates: %lu (%.1f%%)\n",
+	    nframes, ndups, nframes == 0 ? 0 : 100.0 * ndups / nframes);
+	(void) fprintf(fp, "mask scores needed: %lu, reused: %lu (%.1f%%)\n",
+	    nmasks, nreused, nmasks == 0 ? 0 : 100.0 * nreused / nmasks);
 }
 
+/*
+ * Start keeping the counters for kv_mask_stats_write().  This must be called
+ * after kv_init() and before any frames are identified.
+ */
 int
-kv_mask_compare(const kv_mask_t *m1, const kv_mask_t *m2)
+kv_mask_stats_enable(void)
 {
-	if (KV_MASK_POS(m1->km_name) && !KV_MASK_POS(m2->km_name))
+	assert(kv_mstats == NULL);
+
+	if ((kv_mstats = calloc(kv_nmasks, sizeof (kv_mstats[0]))) == NULL) {
+		warn("calloc");
 		return (-1);
+	}
 
-	if (!KV_MASK_POS(m1->km_name) && KV_MASK_POS(m2->km_name))
-		return (1);
+	return (0);
+}
 
-	return (strcmp(m1->km_name, m2->km_name));
+/*
+ * Write what each mask has cost and how it has scored since
+ * kv_mask_stats_enable(), as a JSON object.  The histogram's buckets are
+ * "score_bucket" wide, starting from 0.
+ */
+int
+kv_mask_stats_write(FILE *fp)
+{
+	kv_mask_stat_t *kmsp;
+	kv_mask_t *kmp;
+	unsigned long compared, ns;
+	int i, b;
+
+	assert(kv_mstats != NULL);
+
+	(void) fprintf(fp, "{ \"score_bucket\": %g, \"masks\": [",
+	    1.0 / KV_MSTAT_NBUCKETS);
+
+	for (i = 0; i < kv_nmasks; i++) {
+		kmp = &kv_masks[i];
+		kmsp = &kv_mstats[i];
+		compared = atomic_load(&kmsp->kms_compared);
+		ns = atomic_load(&kmsp->kms_ns);
+
+		(void) fprintf(fp, "%s\n  { \"mask\": \"%s\", "
+		    "\"threshold\": %f, \"compared\": %lu, \"matched\": %lu, "
+		    "\"pixels\": %lu, \"total_ms\": %.3f, \"mean_us\": %.2f, "
+		    "\"over_threshold\": %lu, \"scores\": [", i == 0 ? "" : ",",
+		    kmp->km_name, IMG_SCORE_DOUBLE(kmp->km_thresh), compared,
+		    atomic_load(&kmsp->kms_matched),
+		    atomic_load(&kmsp->kms_pixels), ns / 1e6,
+		    compared == 0 ? 0 : ns / 1e3 / compared,
+		    atomic_load(&kmsp->kms_over));
+
+		for (b = 0; b < KV_MSTAT_NBUCKETS; b++)
+			(void) fprintf(fp, "%s%lu", b == 0 ? "" : ", ",
+			    atomic_load(&kmsp->kms_scores[b]));
+
+		(void) fprintf(fp, "] }");
+	}
+
+	(void) fprintf(fp, "\n] }\n");
+
+	if (fflush(fp) != 0 || ferror(fp)) {
+		warn("write");
+		return (-1);
+	}
+
+	return (0);
 }
 
 void
 kv_ident(img_t *image, kv_screen_t *ksp, kv_ident_t which)
 {
-	int i, ndone;
-	double score, checkthresh;
-	kv_mask_t *kmp;
+	kv_ident_frame(image, NULL, ksp, which);
+}
 
-	bzero(ksp, sizeof (*ksp));
+/*
+ * Like kv_ident(), but for a frame in YUV, which requires kv_init_yuv().  This
+ * skips converting the frame to RGB, but it can't use the coarse views that
+ * kv_ident() does, and its scores differ slightly from kv_ident()'s (see
+ * "kartvid yuvcal").
+ */
+void
+kv_ident_yuv(const img_yuv_t *image, kv_screen_t *ksp, kv_ident_t which)
+{
+	kv_ident_frame(NULL, image, ksp, which);
+}
+
+/*
+ * Build the YUV versions of the masks needed by kv_ident_yuv().
+ */
+int
+kv_init_yuv(void)
+{
+	kv_mask_t *kmp;
+	int i;
 
 	for (i = 0; i < kv_nmasks; i++) {
 		kmp = &kv_masks[i];
-
-		if (!(which & KV_IDENT_CHARS) && KV_MASK_CHAR(kmp->km_name))
+		if (kmp->km_yuv != NULL)
 			continue;
 
-		if (!(which & KV_IDENT_START) && KV_MASK_LAKITU(kmp->km_name))
-			continue;
+		if ((kmp->km_yuv = img_mask_yuv(kmp->km_mask)) == NULL) {
+			warn("failed to convert mask %s", kmp->km_name);
+			return (-1);
+		}
+	}
 
-		if (!(which & KV_IDENT_TRACK) && KV_MASK_TRACK(kmp->km_name))
-			continue;
+	return (0);
+}
 
-		if (!(which & KV_IDENT_ITEM) && KV_MASK_ITEM(kmp->km_name))
-			continue;
+/*
+ * A kv_yuvcal_t accumulates statistics about how each mask's YUV scores
+ * compare to its RGB scores for the same frames.
+ */
+typedef struct {
+	double		kcm_sumdiff;	/* sum of (YUV - RGB) */
+	double		kcm_sumabs;	/* sum of |YUV - RGB| */
+	double		kcm_maxabs;	/* max of |YUV - RGB| */
+	unsigned int	kcm_nrgb;	/* frames matched in RGB */
+	unsigned int	kcm_nyuv;	/* frames matched in YUV */
+	unsigned int	kcm_ndisagree;	/* frames matched in only one */
+} kv_yuvcal_mask_t;
+
+struct kv_yuvcal {
+	unsigned int		kc_nframes;
+	kv_yuvcal_mask_t	*kc_masks;	/* one for each of kv_masks */
+};
 
-		score = img_compare(image, kmp->km_image, NULL);
+kv_yuvcal_t *
+kv_yuvcal_init(void)
+{
+	kv_yuvcal_t *kcp;
 
-		if (kv_debug > 1)
-			(void) printf("mask %s: %f\n", kmp->km_name, score);
+	if (kv_init_yuv() != 0)
+		return (NULL);
 
-		if (KV_MASK_CHAR(kmp->km_name))
-			checkthresh = KV_THRESHOLD_CHAR;
-		else if (KV_MASK_LAKITU(kmp->km_name))
-			checkthresh = KV_THRESHOLD_LAKITU;
-		else if (KV_MASK_ITEM(kmp->km_name) &&
-		    strstr(kmp->km_name, "box_frame") != NULL)
-			checkthresh = KV_THRESHOLD_ITEMFRAME;
-		else if (KV_MASK_ITEM(kmp->km_name))
-			checkthresh = KV_THRESHOLD_ITEM;
-		else
-			checkthresh = KV_THRESHOLD_TRACK;
+	if ((kcp = calloc(1, sizeof (*kcp))) == NULL ||
+	    (kcp->kc_masks = calloc(kv_nmasks,
+	    sizeof (kcp->kc_masks[0]))) == NULL) {
+		warn("calloc");
+		free(kcp);
+		return (NULL);
+	}
 
-		if (score > checkthresh)
-			continue;
+	return (kcp);
+}
+
+/*
+ * Score every mask against the same frame in both RGB and YUV.
+ */
+void
+kv_yuvcal_frame(kv_yuvcal_t *kcp, img_t *image, const img_yuv_t *yuv)
+{
+	kv_yuvcal_mask_t *kcmp;
+	kv_mask_t *kmp;
+	img_score_t rgb, yuvscore;
+	double diff;
+	int i;
 
-		kv_ident_matches(ksp, kmp->km_name, score);
+	kcp->kc_nframes++;
+	for (i = 0; i < kv_nmasks; i++) {
+		kmp = &kv_masks[i];
+		kcmp = &kcp->kc_masks[i];
+		rgb = img_mask_compare(image, kmp->km_mask);
+		yuvscore = img_mask_compare_yuv(yuv, kmp->km_yuv,
+		    IMG_SCORE_ONE, NULL);
+
+		diff = IMG_SCORE_DOUBLE(yuvscore) - IMG_SCORE_DOUBLE(rgb);
+		kcmp->kcm_sumdiff += diff;
+		kcmp->kcm_sumabs += fabs(diff);
+		if (fabs(diff) > kcmp->kcm_maxabs)
+			kcmp->kcm_maxabs = fabs(diff);
+
+		if (rgb <= kmp->km_thresh)
+			kcmp->kcm_nrgb++;
+		if (yuvscore <= kmp->km_thresh)
+			kcmp->kcm_nyuv++;
+		if ((rgb <= kmp->km_thresh) != (yuvscore <= kmp->km_thresh))
+			kcmp->kcm_ndisagree++;
 	}
+}
 
-	ndone = 0;
-	for (i = 0; i < ksp->ks_nplayers; i++) {
-		if (ksp->ks_players[i].kp_lapnum == 4)
-			ndone++;
+/*
+ * Print a line for each mask and a summary.  Scores are fractions of the
+ * maximum difference, like the KV_THRESHOLD_* values, so the differences can
+ * be compared directly to how far typical scores are from the thresholds.
+ */
+void
+kv_yuvcal_report(kv_yuvcal_t *kcp, FILE *fp)
+{
+	kv_yuvcal_mask_t *kcmp, all;
+	unsigned int n;
+	int i;
+
+	n = kcp->kc_nframes;
+	(void) fprintf(fp, "%-32s %9s %9s %9s %7s %7s %7s\n", "MASK",
+	    "MEANDIFF", "MEANABS", "MAXABS", "NRGB", "NYUV", "NDIFF");
+
+	bzero(&all, sizeof (all));
+	for (i = 0; i < kv_nmasks; i++) {
+		kcmp = &kcp->kc_masks[i];
+		(void) fprintf(fp, "%-32s %9.6f %9.6f %9.6f %7u %7u %7u\n",
+		    kv_masks[i].km_name, n == 0 ? 0 : kcmp->kcm_sumdiff / n,
+		    n == 0 ? 0 : kcmp->kcm_sumabs / n, kcmp->kcm_maxabs,
+		    kcmp->kcm_nrgb, kcmp->kcm_nyuv, kcmp->kcm_ndisagree);
+
+		all.kcm_sumdiff += kcmp->kcm_sumdiff;
+		all.kcm_sumabs += kcmp->kcm_sumabs;
+		all.kcm_maxabs = MAX(all.kcm_maxabs, kcmp->kcm_maxabs);
+		all.kcm_nrgb += kcmp->kcm_nrgb;
+		all.kcm_nyuv += kcmp->kcm_nyuv;
+		all.kcm_ndisagree += kcmp->kcm_ndisagree;
 	}
 
-	if (ndone >= ksp->ks_nplayers - 1)
-		ksp->ks_events |= KVE_RACE_DONE;
+	n *= kv_nmasks;
+	(void) fprintf(fp, "%-32s %9.6f %9.6f %9.6f %7u %7u %7u\n", "(all)",
+	    n == 0 ? 0 : all.kcm_sumdiff / n, n == 0 ? 0 : all.kcm_sumabs / n,
+	    all.kcm_maxabs, all.kcm_nrgb, all.kcm_nyuv, all.kcm_ndisagree);
+	(void) fprintf(fp, "%u frames, %d masks\n", kcp->kc_nframes,
+	    kv_nmasks);
+}
+
+void
+kv_yuvcal_free(kv_yuvcal_t *kcp)
+{
+	if (kcp == NULL)
+		return;
+
+	free(kcp->kc_masks);
+	free(kcp);
 }
 
 /*
  * Update the screen state (ksp) to reflect that a mask matched this frame.
  */
-void
-kv_ident_matches(kv_screen_t *ksp, const char *mask, double score)
+static void
+kv_ident_matches(kv_screen_t *ksp, const kv_mask_t *kmp, img_score_t score)
 {
-	unsigned int pos, square;
-	char *p;
 	kv_player_t *kpp;
-	kv_item_t item;
-	char buf[64];
 
 	if (kv_debug > 1)
-		(void) printf("%s matches\n", mask);
+		(void) printf("%s matches\n", kmp->km_name);
 
-	(void) strlcpy(buf, mask, sizeof (buf));
-
-	if (strncmp(buf, "track_", sizeof ("track_") - 1) == 0) {
-		if (ksp->ks_track[0] != '\0' && ksp->ks_trackscore < score)
+	/*
+	 * Position masks are always evaluated, so they have no kv_ident_t bit.
+	 */
+	if (kmp->km_which == 0) {
+		if (kmp->km_pos == 0)
 			return;
 
-		(void) strtok(buf + sizeof ("track_"), "_.");
-		(void) strlcpy(ksp->ks_track, buf + sizeof ("track_") - 1,
-		    sizeof (ksp->ks_track));
-		ksp->ks_trackscore = score;
-		return;
-	}
-
-	if (sscanf(buf, "pos%u_square%u", &pos, &square) == 2 &&
-	    pos <= KV_MAXPLAYERS && square <= KV_MAXPLAYERS) {
-		kpp = &ksp->ks_players[square - 1];
+		kpp = &ksp->ks_players[kmp->km_square - 1];
 
-		if (square > ksp->ks_nplayers)
-			ksp->ks_nplayers = square;
+		if (kmp->km_square > ksp->ks_nplayers)
+			ksp->ks_nplayers = kmp->km_square;
 		else if (kpp->kp_place != 0 && kpp->kp_placescore < score)
 			return;
 
-		ksp->ks_players[square - 1].kp_place = pos;
+		kpp->kp_place = kmp->km_pos;
 		kpp->kp_placescore = score;
 
-		if (strcmp(buf + sizeof ("pos1_square1") - 1,
-		    "_final.png") == 0)
+		if (kmp->km_final)
 			kpp->kp_lapnum = 4;
 		else if (kpp->kp_lapnum == 4)
 			kpp->kp_lapnum = 0;
@@ -246,54 +1683,50 @@ kv_ident_matches(kv_screen_t *ksp, const char *mask, double score)
 		return;
 	}
 
-	if (strncmp(buf, "char_", sizeof ("char_") - 1) == 0) {
-		p = strchr(buf + sizeof ("char_") - 1, '_');
-		if (p == NULL)
+	switch (kmp->km_which) {
+	case KV_IDENT_TRACK:
+		if (kmp->km_label == KV_LABEL_NONE)
+			return;
+
+		if (ksp->ks_track != KV_LABEL_NONE &&
+		    ksp->ks_trackscore < score)
 			return;
 
-		*p = '\0';
-		if (sscanf(p + 1, "%u", &square) != 1 ||
-		    square > KV_MAXPLAYERS)
+		ksp->ks_track = kmp->km_label;
+		ksp->ks_trackscore = score;
+		return;
+
+	case KV_IDENT_CHARS:
+		if (kmp->km_label == KV_LABEL_NONE)
 			return;
 
-		kpp = &ksp->ks_players[square - 1];
+		kpp = &ksp->ks_players[kmp->km_square - 1];
 
-		if (kpp->kp_character[0] != '\0' && kpp->kp_charscore < score)
+		if (kpp->kp_character != KV_LABEL_NONE &&
+		    kpp->kp_charscore < score)
 			return;
 
-		if (square > ksp->ks_nplayers)
-			ksp->ks_nplayers = square;
+		if (kmp->km_square > ksp->ks_nplayers)
+			ksp->ks_nplayers = kmp->km_square;
 
-		(void) strlcpy(kpp->kp_character, buf + sizeof ("char_") - 1,
-		    sizeof (kpp->kp_character));
+		kpp->kp_character = kmp->km_label;
 		kpp->kp_charscore = score;
 		return;
-	}
 
-	if (strncmp(buf, "lakitu_start", sizeof ("lakitu_start") - 1) == 0) {
+	case KV_IDENT_START:
 		ksp->ks_events |= KVE_RACE_START;
 		return;
-	}
-
-	if (strncmp(buf, "item_", sizeof ("item_") - 1) == 0) {
-		p = strrchr(buf, '_');
-		if (p == buf + sizeof ("item_") - 1)
-			return;
 
-		*p = '\0';
-		if (sscanf(p + 1, "%u", &square) != 1 || square > KV_MAXPLAYERS)
-			return;
-
-		if (square > ksp->ks_nplayers)
+	case KV_IDENT_ITEM:
+		if (kmp->km_square == 0 || kmp->km_square > ksp->ks_nplayers)
 			return;
 
 		/*
 		 * We only want to take the KVI_UNKNOWN match if there's no
 		 * more specific item match (regardless of the score).
 		 */
-		kpp = &ksp->ks_players[square - 1];
-		item = kv_mask_item(buf + sizeof ("item_") - 1);
-		if (item == KVI_UNKNOWN && kpp->kp_item != KVI_NONE)
+		kpp = &ksp->ks_players[kmp->km_square - 1];
+		if (kmp->km_item == KVI_UNKNOWN && kpp->kp_item != KVI_NONE)
 			return;
 
 		/*
@@ -306,12 +1739,15 @@ kv_ident_matches(kv_screen_t *ksp, const char *mask, double score)
 		    (kpp->kp_item != KVI_NONE && kpp->kp_item != KVI_UNKNOWN))
 			return;
 
-		kpp->kp_item = kv_mask_item(buf + sizeof ("item_") - 1);
+		kpp->kp_item = kmp->km_item;
 		kpp->kp_itemscore = score;
 
 		if (kv_debug > 2)
 			(void) printf("player %d: taking item %s\n",
-			    square, kv_item_label(kpp->kp_item));
+			    kmp->km_square, kv_item_label(kpp->kp_item));
+		return;
+
+	default:
 		return;
 	}
 }
@@ -339,7 +1775,7 @@ kv_screen_invalid(kv_screen_t *ksp, kv_screen_t *pksp, kv_screen_t *raceksp)
 	 * Valley until all players are done.  On the other hand, on Yoshi
 	 * Valley, we ignore all frames until someone's finished.
 	 */
-	if (raceksp->ks_track[0] != 'y') {
+	if (kv_label_name(raceksp->ks_track)[0] != 'y') {
 		for (i = 0; i < ksp->ks_nplayers; i++) {
 			if (ksp->ks_players[i].kp_place == 0)
 				return (1);
@@ -361,7 +1797,7 @@ kv_screen_invalid(kv_screen_t *ksp, kv_screen_t *pksp, kv_screen_t *raceksp)
 	}
 
 	for (i = 0; i < ksp->ks_nplayers; i++) {
-		if (raceksp->ks_track[0] == 'y' &&
+		if (kv_label_name(raceksp->ks_track)[0] == 'y' &&
 		    ksp->ks_players[i].kp_place == 0)
 			continue;
 
@@ -421,7 +1857,7 @@ kv_screen_compare(kv_screen_t *ksp, kv_screen_t *pksp, kv_screen_t *raceksp,
 		 * Ignore position changes in Yoshi Valley.
 		 */
 		if (kpp->kp_lapnum != pkpp->kp_lapnum ||
-		    (raceksp->ks_track[0] != 'y' &&
+		    (kv_label_name(raceksp->ks_track)[0] != 'y' &&
 		    kpp->kp_place != pkpp->kp_place))
 			return (1);
 
@@ -481,7 +1917,7 @@ kv_screen_print(const char *source, int frame, int msec, kv_screen_t *ksp,
 {
 	int i;
 	kv_player_t *kpp;
-	char *trackname, *charname;
+	const char *trackname, *charname;
 
 	assert(ksp->ks_nplayers <= KV_MAXPLAYERS);
 
@@ -493,9 +1929,9 @@ kv_screen_print(const char *source, int frame, int msec, kv_screen_t *ksp,
 	if (ksp->ks_events & KVE_RACE_DONE)
 		(void) fprintf(out, "Race has finished.\n");
 
-	trackname = ksp->ks_track;
+	trackname = kv_label_name(ksp->ks_track);
 	if (trackname[0] == '\0' && raceksp != NULL)
-		trackname = raceksp->ks_track;
+		trackname = kv_label_name(raceksp->ks_track);
 	if (trackname[0] == '\0')
 		trackname = "Unknown Track";
 
@@ -511,9 +1947,10 @@ kv_screen_print(const char *source, int frame, int msec, kv_screen_t *ksp,
 		(void) fprintf(out, "Player %d    ", i + 1);
 
 		kpp = &ksp->ks_players[i];
-		charname = kpp->kp_character;
+		charname = kv_label_name(kpp->kp_character);
 		if (charname[0] == '\0' && raceksp != NULL)
-			charname = raceksp->ks_players[i].kp_character;
+			charname = kv_label_name(
+			    raceksp->ks_players[i].kp_character);
 		if (charname[0] == '\0')
 			charname = "?";
 
@@ -590,7 +2027,7 @@ kv_screen_json(const char *source, int frame, int msec, kv_screen_t *ksp,
 {
 	int i;
 	kv_player_t *kpp;
-	char *trackname, *charname;
+	const char *trackname, *charname;
 
 	assert(ksp->ks_nplayers <= KV_MAXPLAYERS);
 
@@ -602,9 +2039,9 @@ kv_screen_json(const char *source, int frame, int msec, kv_screen_t *ksp,
 	if (ksp->ks_events & KVE_RACE_DONE)
 		(void) fprintf(out, "\"done\": true, ");
 
-	trackname = ksp->ks_track;
+	trackname = kv_label_name(ksp->ks_track);
 	if (trackname[0] == '\0' && raceksp != NULL)
-		trackname = raceksp->ks_track;
+		trackname = kv_label_name(raceksp->ks_track);
 	if (trackname[0] == '\0')
 		trackname = "Unknown Track";
 
@@ -614,11 +2051,10 @@ kv_screen_json(const char *source, int frame, int msec, kv_screen_t *ksp,
 	for (i = 0; i < ksp->ks_nplayers; i++) {
 		kpp = &ksp->ks_players[i];
 		if (raceksp != NULL)
-			charname = raceksp->ks_players[i].kp_character;
-		else if (kpp->kp_character)
-			charname = kpp->kp_character;
+			charname = kv_label_name(
+			    raceksp->ks_players[i].kp_character);
 		else
-			charname = "?";
+			charname = kv_label_name(kpp->kp_character);
 
 		(void) fprintf(out, "{ ");
 
@@ -666,13 +2102,25 @@ kv_vidctx_init(const char *rootdir, kv_emit_f emit, const char *dbgdir,
 	}
 
 	kvp->kv_last_start = -1;
+	atomic_init(&kvp->kv_sched_start, -1);
+	atomic_init(&kvp->kv_sched_items, 0);
 	kvp->kv_emit = emit;
+	kvp->kv_out = stdout;
 	kvp->kv_flags = flags;
 	if (dbgdir != NULL)
 		(void) strlcpy(kvp->kv_dbgdir, dbgdir, sizeof (kvp->kv_dbgdir));
 	return (kvp);
 }
 
+/*
+ * Events are emitted to stdout unless another stream is given here.
+ */
+void
+kv_vidctx_output(kv_vidctx_t *kvp, FILE *fp)
+{
+	kvp->kv_out = fp;
+}
+
 /*
  * While processing frames outside a race, we store a ringbuffer of the last
  * KV_STARTFRAMES worth of frame details in kv_startbuffer.  When we do finally
@@ -692,7 +2140,7 @@ kv_vidctx_chars(kv_vidctx_t *kvp, kv_screen_t *ksp, int i)
 		pksp = &kvp->kv_startbuffer[j];
 
 		for (k = 0; k < KV_MAXPLAYERS; k++) {
-			if (pksp->ks_players[k].kp_character[0] == '\0' ||
+			if (pksp->ks_players[k].kp_character == KV_LABEL_NONE ||
 			    (ksp->ks_players[k].kp_charscore > 0 &&
 			    pksp->ks_players[k].kp_charscore >
 			    ksp->ks_players[k].kp_charscore))
@@ -768,6 +2216,26 @@ kv_vidctx_items(kv_screen_t *ksp, kv_screen_t *pksp, int i)
 	kpp->kp_itemstate = state;
 }
 
+/*
+ * Publish which players' items kv_vidctx_ident() should identify in full (see
+ * there).
+ */
+static void
+kv_vidctx_sched_items(kv_vidctx_t *kvp, kv_screen_t *ksp)
+{
+	kv_itemstate_t state;
+	int j, items;
+
+	items = 0;
+	for (j = 0; j < ksp->ks_nplayers; j++) {
+		state = ksp->ks_players[j].kp_itemstate;
+		if (state == KVS_SLOTMACHINE || state == KVS_WAIT_ITEM)
+			items |= KV_IDENT_ITEMS_SQUARE(j + 1);
+	}
+
+	atomic_store(&kvp->kv_sched_items, items);
+}
+
 void
 kv_vidctx_frame_emit(kv_vidctx_t *kvp, const char *framename, int i, int timems,
     img_t *img, kv_screen_t *ksp, kv_screen_t *raceksp, FILE *fp)
@@ -779,17 +2247,152 @@ kv_vidctx_frame_emit(kv_vidctx_t *kvp, const char *framename, int i, int timems,
 		(void) img_write(img, buf);
 	}
 
+	KV_PROBE4(emit, framename, i, timems, ksp->ks_events);
 	kvp->kv_emit(framename, i, timems, ksp, raceksp, fp);
 }
 
+/*
+ * Returns which masks kv_vidctx_frame() needs for frame "i", given the frame
+ * where the current race started (or -1 if we're not in a race).  Position
+ * masks (including the ones for the final lap) are always evaluated, since
+ * they determine the number of players.  While waiting for a race to start,
+ * we need the lakitu to find the start and the characters to fill in
+ * kv_startbuffer, but items don't matter.  Right after a start, we ignore
+ * frames entirely, so we don't need anything.  During the race, characters are
+ * only ever taken from the start, so we just need the items and the lakitu (in
+ * case the race is aborted and a new one started).  The actual items are only
+ * needed for players waiting for one to appear (see kv_vidctx_items()), which
+ * kv_vidctx_frame() adds.
+ */
+static kv_ident_t
+kv_vidctx_which(int start, int i)
+{
+	if (start == -1)
+		return (KV_IDENT_START | KV_IDENT_CHARS);
+
+	if (i - start < KV_MIN_RACE_FRAMES)
+		return (0);
+
+	return (KV_IDENT_START | KV_IDENT_ITEM);
+}
+
+/*
+ * Make a screen that was identified with more masks than "which" look exactly
+ * the way kv_ident() would have identified it with just "which".  Characters
+ * can increase the number of players, which in turn determines which squares
+ * get items, so removing characters also removes the items for squares that
+ * didn't have a position.
+ */
+static void
+kv_screen_narrow(kv_screen_t *ksp, kv_ident_t which)
+{
+	kv_player_t *kpp;
+	int i;
+
+	if (!(which & KV_IDENT_START))
+		ksp->ks_events &= ~KVE_RACE_START;
+
+	if (!(which & KV_IDENT_TRACK)) {
+		ksp->ks_track = KV_LABEL_NONE;
+		ksp->ks_trackscore = 0;
+	}
+
+	if (!(which & KV_IDENT_CHARS)) {
+		ksp->ks_nplayers = 0;
+		for (i = 0; i < KV_MAXPLAYERS; i++) {
+			kpp = &ksp->ks_players[i];
+			kpp->kp_character = KV_LABEL_NONE;
+			kpp->kp_charscore = 0;
+			if (kpp->kp_place != 0)
+				ksp->ks_nplayers = i + 1;
+		}
+	}
+
+	for (i = 0; i < KV_MAXPLAYERS; i++) {
+		if (!(which & KV_IDENT_ITEM) || i >= ksp->ks_nplayers) {
+			ksp->ks_players[i].kp_item = KVI_NONE;
+			ksp->ks_players[i].kp_itemscore = 0;
+		}
+	}
+
+	kv_ident_items(ksp, which);
+	ksp->ks_events &= ~KVE_RACE_DONE;
+	kv_ident_done(ksp);
+}
+
+/*
+ * Identify frame "i" of a video the way kv_vidctx_frame() would, saving the
+ * results in "kfp" for a subsequent call to kv_vidctx_frame().  This only
+ * depends on the image, so unlike kv_vidctx_frame(), it can be called for
+ * several frames at once from different threads, in any order.
+ *
+ * Which masks kv_vidctx_frame() needs depends on where the frame falls relative
+ * to the races in the video (see kv_vidctx_which()), which isn't known until
+ * kv_vidctx_frame() has seen all of the frames before it.  So this guesses
+ * based on the last race start that kv_vidctx_frame() published in
+ * kv_sched_start (or -1 if it's since seen the race finish), and records what
+ * it identified in kvf_which.  Likewise, it identifies the actual items of
+ * players that kv_vidctx_frame() last saw waiting for an item or spinning the
+ * slot machine (which comes right before), as published in kv_sched_items.
+ * These guesses are only wrong for frames identified ahead of kv_vidctx_frame()
+ * near the start or end of a race or a player getting an item.  If it
+ * identified more than necessary, kv_vidctx_frame() discards the extra
+ * results, and if it identified too little, kv_vidctx_frame() identifies the
+ * frame again.  Callers that don't know the final frame number (like
+ * pipeline_video_chunks()) pass a NULL "kvp" to identify everything
+ * kv_vidctx_frame() might need.
+ *
+ * As an optimization, this returns false without doing anything if it's known
+ * that kv_vidctx_frame() will ignore the frame anyway.  That's the case for
+ * frames shortly after a race start.  This is safe even if kv_sched_start is
+ * stale, since kv_vidctx_frame() ignores every frame in that window regardless
+ * of what happens after it.
+ *
+ * If "yuv" is non-NULL, the frame is identified in YUV (see kv_ident_yuv()) and
+ * "image" is ignored.
+ */
+boolean_t
+kv_vidctx_ident(kv_vidctx_t *kvp, int i, img_t *image, const img_yuv_t *yuv,
+    kv_vidframe_t *kfp)
+{
+	int start;
+
+	kfp->kvf_which = KV_IDENT_NOTRACK;
+	if (kvp != NULL) {
+		start = atomic_load(&kvp->kv_sched_start);
+		if (start == -1 || i > start) {
+			kfp->kvf_which = kv_vidctx_which(start, i);
+			if (kfp->kvf_which == 0)
+				return (B_FALSE);
+
+			if (kfp->kvf_which & KV_IDENT_ITEM)
+				kfp->kvf_which |=
+				    atomic_load(&kvp->kv_sched_items);
+		}
+	}
+
+	kv_ident_frame(image, yuv, &kfp->kvf_screen, kfp->kvf_which);
+	if (kfp->kvf_screen.ks_events & KVE_RACE_START)
+		kv_ident_frame(image, yuv, &kfp->kvf_start, KV_IDENT_ALL);
+
+	return (B_TRUE);
+}
+
+/*
+ * Process frame "i" of a video, which must be called for each frame in order.
+ * If "kfp" is non-NULL, it contains the results of kv_vidctx_ident() for this
+ * frame.  Otherwise, the frame is identified here, in YUV if "yuv" is non-NULL
+ * (as for kv_vidctx_ident()).
+ */
 void
 kv_vidctx_frame(const char *framename, int i, int timems,
-    img_t *image, kv_vidctx_t *kvp)
+    img_t *image, const img_yuv_t *yuv, kv_vidframe_t *kfp, kv_vidctx_t *kvp)
 {
 	int j;
 	kv_screen_t *ksp, *pksp, *raceksp;
 	kv_screen_t ipks;
 	boolean_t itemsdiff, invalid;
+	kv_ident_t which;
 
 	ksp = &kvp->kv_frame;
 	pksp = &kvp->kv_pframe;
@@ -814,34 +2417,59 @@ kv_vidctx_frame(const char *framename, int i, int timems,
 	 *     we go back to the first state, waiting for another RACE_START
 	 *     frame.
 	 */
-	if (kvp->kv_last_start != -1 &&
-	    i - kvp->kv_last_start < KV_MIN_RACE_FRAMES)
+	if ((which = kv_vidctx_which(kvp->kv_last_start, i)) == 0)
 		/* Skip the first frames after a start. See above. */
 		return;
 
+	if (which & KV_IDENT_ITEM) {
+		for (j = 0; j < KV_MAXPLAYERS; j++) {
+			if (ksp->ks_players[j].kp_itemstate == KVS_WAIT_ITEM)
+				which |= KV_IDENT_ITEMS_SQUARE(j + 1);
+		}
+	}
+
+	/*
+	 * If kv_vidctx_ident() guessed wrong about where this frame falls and
+	 * left out some masks we need, identify the frame again.
+	 */
+	if (kfp != NULL && (which & ~kfp->kvf_which) != 0)
+		kfp = NULL;
+
 	bcopy(ksp, &ipks, sizeof (ipks));
 	if (kv_debug > 0)
 		(void) printf("%s\n", framename);
-	/* XXX why would this include characters? */
-	kv_ident(image, ksp, KV_IDENT_NOTRACK);
+	if (kfp == NULL) {
+		kv_ident_frame(image, yuv, ksp, which);
+	} else {
+		*ksp = kfp->kvf_screen;
+		kv_screen_narrow(ksp, which);
+	}
 
 	if (ksp->ks_events & KVE_RACE_START) {
 		if (kvp->kv_last_start != -1) {
+			KV_PROBE2(race__abort, framename, i);
 			(void) fprintf(stderr, "%s (time %dm:%02ds): "
 			    "new race begun (previous one aborted)",
 			    framename, (int)((double)timems / MILLISEC) / 60,
 			    timems % 60);
 		}
 
-		kv_ident(image, ksp, KV_IDENT_ALL);
+		KV_PROBE2(race__start, framename, i);
+
+		if (kfp == NULL)
+			kv_ident_frame(image, yuv, ksp, KV_IDENT_ALL);
+		else
+			*ksp = kfp->kvf_start;
 		bcopy(ksp, &kvp->kv_startbuffer[i % KV_STARTFRAMES],
 		    sizeof (ksp));
 		kv_vidctx_chars(kvp, ksp, i);
 		kvp->kv_last_start = i;
+		atomic_store(&kvp->kv_sched_start, i);
+		kv_vidctx_sched_items(kvp, ksp);
 		*pksp = *ksp;
 		*raceksp = *ksp;
 		kv_vidctx_frame_emit(kvp, framename, i, timems, image,
-		    ksp, NULL, stdout);
+		    ksp, NULL, kvp->kv_out);
 		bzero(&kvp->kv_startbuffer[0], sizeof (kvp->kv_startbuffer));
 		return;
 	}
@@ -872,7 +2500,7 @@ kv_vidctx_frame(const char *framename, int i, int timems,
 	 */
 	if (ksp->ks_nplayers > 1 &&
 	    ksp->ks_nplayers < raceksp->ks_nplayers &&
-	    raceksp->ks_track[0] == 'y')
+	    kv_label_name(raceksp->ks_track)[0] == 'y')
 		ksp->ks_nplayers = raceksp->ks_nplayers;
 
 	/*
@@ -886,6 +2514,8 @@ kv_vidctx_frame(const char *framename, int i, int timems,
 	for (j = 0; j < ksp->ks_nplayers; j++)
 		kv_vidctx_items(ksp, &ipks, j);
 
+	kv_vidctx_sched_items(kvp, ksp);
+
 	itemsdiff = kv_screen_compare_items(ksp, pksp, kvp->kv_flags) != 0;
 	invalid = kv_screen_invalid(ksp, pksp, raceksp) != 0;
 
@@ -923,23 +2553,107 @@ kv_vidctx_frame(const char *framename, int i, int timems,
 	 * the last place finisher, since we usually won't have detected it by
 	 * itself.
 	 */
-	if (raceksp->ks_track[0] == 'y' && ksp->ks_events & KVE_RACE_DONE) {
+	if (kv_label_name(raceksp->ks_track)[0] == 'y' &&
+	    ksp->ks_events & KVE_RACE_DONE) {
 		for (j = 0; j < ksp->ks_nplayers; j++) {
 			if (ksp->ks_players[j].kp_place == 0) {
 				ksp->ks_players[j].kp_place =
 				    ksp->ks_nplayers;
-				ksp->ks_players[j].kp_placescore = 0.0001;
+				ksp->ks_players[j].kp_placescore =
+				    IMG_SCORE(0.0001);
 				break;
 			}
 		}
 	}
 
 	kv_vidctx_frame_emit(kvp, framename, i, timems, image, ksp,
-	    raceksp, stdout);
+	    raceksp, kvp->kv_out);
 	*pksp = *ksp;
 
-	if (ksp->ks_events & KVE_RACE_DONE)
+	if (ksp->ks_events & KVE_RACE_DONE) {
+		KV_PROBE2(race__done, framename, i);
 		kvp->kv_last_start = -1;
+		atomic_store(&kvp->kv_sched_start, -1);
+	}
+}
+
+/*
+ * Returns true if frame "i" would be processed by kv_vidctx_frame() as part of
+ * a race that's under way (and past the frames ignored after the start).  The
+ * frames of a race are only compared to each other, so during a race, a frame
+ * identified the same way as its predecessor (see kv_vidframe_same()) never
+ * changes anything but the item state machine, which only needs to see each
+ * frame once.
+ */
+boolean_t
+kv_vidctx_inrace(kv_vidctx_t *kvp, int i)
+{
+	return (kvp->kv_last_start != -1 &&
+	    i - kvp->kv_last_start >= KV_MIN_RACE_FRAMES);
+}
+
+/*
+ * Returns true if two frames were identified the same way, as far as anything
+ * kv_vidctx_frame() does or reports during a race is concerned.  That's every
+ * identified field except the scores, as long as both were identified with
+ * the same masks.  Race starts are never the same as
+ * anything, since what happens at a start depends on the frame number.
+ */
+boolean_t
+kv_vidframe_same(const kv_vidframe_t *kfp1, const kv_vidframe_t *kfp2)
+{
+	const kv_screen_t *ksp1 = &kfp1->kvf_screen;
+	const kv_screen_t *ksp2 = &kfp2->kvf_screen;
+	const kv_player_t *kpp1, *kpp2;
+	int i;
+
+	if (kfp1->kvf_which != kfp2->kvf_which ||
+	    ksp1->ks_events != ksp2->ks_events ||
+	    (ksp1->ks_events & KVE_RACE_START) != 0 ||
+	    ksp1->ks_nplayers != ksp2->ks_nplayers ||
+	    ksp1->ks_track != ksp2->ks_track)
+		return (B_FALSE);
+
+	for (i = 0; i < KV_MAXPLAYERS; i++) {
+		kpp1 = &ksp1->ks_players[i];
+		kpp2 = &ksp2->ks_players[i];
+		if (kpp1->kp_item != kpp2->kp_item ||
+		    kpp1->kp_place != kpp2->kp_place ||
+		    kpp1->kp_lapnum != kpp2->kp_lapnum ||
+		    kpp1->kp_character != kpp2->kp_character)
+			return (B_FALSE);
+	}
+
+	return (B_TRUE);
+}
+
+/*
+ * Returns true if the frames of a race between two frames identified as "kfp1"
+ * and "kfp2" can be assumed to have been identified the same way, so that they
+ * needn't be identified at all.  That requires the two to be the same (see
+ * kv_vidframe_same()), but around item boxes, even that isn't enough: the box
+ * flashes blank for only a frame or two between the slot machine and the item,
+ * and a player whose item state machine doesn't see that never gets the item.
+ * So while any player is spinning the slot machine or waiting for an item, or
+ * has an item box showing at either end, every frame is identified.
+ */
+boolean_t
+kv_vidctx_assume(kv_vidctx_t *kvp, const kv_vidframe_t *kfp1,
+    const kv_vidframe_t *kfp2)
+{
+	int j;
+
+	if (!kv_vidframe_same(kfp1, kfp2) ||
+	    atomic_load(&kvp->kv_sched_items) != 0)
+		return (B_FALSE);
+
+	/* Both frames show the same items, so checking one is enough. */
+	for (j = 0; j < KV_MAXPLAYERS; j++) {
+		if (kfp1->kvf_screen.ks_players[j].kp_item != KVI_NONE)
+			return (B_FALSE);
+	}
+
+	return (B_TRUE);
 }
 
 void
@@ -979,8 +2693,9 @@ static kv_item_info_t kv_items[] = {
 static int kv_nitems = sizeof (kv_items) / sizeof (kv_items[0]);
 
 /*
- * XXX This could be made faster by computing this once and hanging it off the
- * mask object itself.  Ditto all of kv_ident_matches().
+ * Returns the item shown by an item mask, given the part of its name between
+ * "item_" and the square.  This is only used when masks are loaded (see
+ * kv_mask_classify()).
  */
 kv_item_t
 kv_mask_item(const char *mask)
@@ -53,15 +53,29 @@ typedef enum {
 	KVS_WAIT_USE,		/* waiting to use item */
 } kv_itemstate_t;
 
+/*
+ * Track and character names are interned when the masks are loaded, and
+ * screens refer to them by id.  kv_label_name() returns the name for an id,
+ * which is "" for KV_LABEL_NONE.
+ */
+typedef uint16_t kv_label_t;
+#define	KV_LABEL_NONE	0
+
+const char *kv_label_name(kv_label_t);
+
+/*
+ * Screens are copied around several times for each frame, so these are kept
+ * small: enums that fit are stored in bytes, and scores are fixed-point.
+ */
 typedef struct {
-	char		kp_character[32];	/* name, "" = unknown */
-	double		kp_charscore;		/* score for character match */
-	kv_item_t	kp_item;		/* item state */
-	double		kp_itemscore;		/* score for item match */
-	short		kp_place;		/* 1-4, 0 = unknown */
-	double		kp_placescore;		/* score for pos match */
-	short		kp_lapnum;		/* 1-3, 0 = unknown, 4 = done */
-	kv_itemstate_t	kp_itemstate;		/* per-player item state */
+	kv_label_t	kp_character;		/* KV_LABEL_NONE = unknown */
+	uint8_t		kp_place;		/* 1-4, 0 = unknown */
+	uint8_t		kp_lapnum;		/* 1-3, 0 = unknown, 4 = done */
+	uint8_t		kp_item;		/* item (kv_item_t) */
+	uint8_t		kp_itemstate;		/* state (kv_itemstate_t) */
+	img_score_t	kp_charscore;		/* score for character match */
+	img_score_t	kp_itemscore;		/* score for item match */
+	img_score_t	kp_placescore;		/* score for pos match */
 } kv_player_t;
 
 typedef enum {
@@ -70,23 +84,33 @@ typedef enum {
 } kv_events_t;
 
 typedef struct {
-	kv_events_t	ks_events;		/* active events */
-	unsigned short	ks_nplayers;		/* number of active players */
-	char		ks_track[32];		/* name, "" = unknown */
-	double		ks_trackscore;		/* score for track match */
+	uint8_t		ks_events;		/* events (kv_events_t) */
+	uint8_t		ks_nplayers;		/* number of active players */
+	kv_label_t	ks_track;		/* KV_LABEL_NONE = unknown */
+	img_score_t	ks_trackscore;		/* score for track match */
 	kv_player_t	ks_players[KV_MAXPLAYERS];	/* player details */
 } kv_screen_t;
 
+/*
+ * KV_IDENT_ITEM only identifies items well enough to tell whether each
+ * player's item box is absent, blank, or showing something (KVI_NONE,
+ * KVI_BLANK, or KVI_UNKNOWN).  That's all the item state machine needs except
+ * while waiting for an item to appear.  To identify the actual item in a
+ * player's box, add KV_IDENT_ITEMS_SQUARE() for that player's square.
+ */
 typedef enum {
 	KV_IDENT_START   = 0x1,
 	KV_IDENT_TRACK   = 0x2,
 	KV_IDENT_CHARS   = 0x4,
 	KV_IDENT_ITEM	 = 0x8,
+	KV_IDENT_ITEMS	 = 0xf0,	/* all items, in every square */
 	KV_IDENT_ALL     = KV_IDENT_START | KV_IDENT_TRACK | KV_IDENT_CHARS |
-	    KV_IDENT_ITEM,
+	    KV_IDENT_ITEM | KV_IDENT_ITEMS,
 	KV_IDENT_NOTRACK = KV_IDENT_ALL & (~KV_IDENT_TRACK),
 } kv_ident_t;
 
+#define	KV_IDENT_ITEMS_SQUARE(square)	((kv_ident_t)(0x10 << ((square) - 1)))
+
 typedef enum {
 	KVF_NONE = 0,
 	KVF_COMPARE_ITEMS = 0x1,	/* include all item box changes */
@@ -94,8 +118,16 @@ typedef enum {
 } kv_flags_t;
 
 int kv_init(const char *);
+int kv_maskpack(const char *, const char *);
+int kv_ident_threads(unsigned int);
 void kv_ident(img_t *, kv_screen_t *, kv_ident_t);
-void kv_ident_matches(kv_screen_t *, const char *, double);
+int kv_init_yuv(void);
+void kv_ident_yuv(const img_yuv_t *, kv_screen_t *, kv_ident_t);
+double kv_start_score(img_t *, double);
+void kv_ident_stats(FILE *);
+int kv_mask_stats_enable(void);
+int kv_mask_stats_write(FILE *);
+unsigned int kv_regions(kv_ident_t, img_box_t *, unsigned int);
 int kv_screen_compare(kv_screen_t *, kv_screen_t *, kv_screen_t *, kv_flags_t);
 int kv_screen_invalid(kv_screen_t *, kv_screen_t *, kv_screen_t *);
 const char *kv_item_label(kv_item_t);
@@ -111,7 +143,36 @@ void kv_screen_json(const char *, int, int, kv_screen_t *, kv_screen_t *,
 struct kv_vidctx;
 typedef struct kv_vidctx kv_vidctx_t;
 kv_vidctx_t *kv_vidctx_init(const char *, kv_emit_f, const char *, kv_flags_t);
-void kv_vidctx_frame(const char *, int, int, img_t *, kv_vidctx_t *);
+void kv_vidctx_output(kv_vidctx_t *, FILE *);
+
+/*
+ * Results of identifying a video frame, computed by kv_vidctx_ident() and
+ * consumed by kv_vidctx_frame().
+ */
+typedef struct {
+	kv_ident_t	kvf_which;	/* masks used for kvf_screen */
+	kv_screen_t	kvf_screen;
+	kv_screen_t	kvf_start;	/* KV_IDENT_ALL, if a race start */
+} kv_vidframe_t;
+
+boolean_t kv_vidctx_ident(kv_vidctx_t *, int, img_t *, const img_yuv_t *,
+    kv_vidframe_t *);
+void kv_vidctx_frame(const char *, int, int, img_t *, const img_yuv_t *,
+    kv_vidframe_t *, kv_vidctx_t *);
+boolean_t kv_vidctx_inrace(kv_vidctx_t *, int);
+boolean_t kv_vidframe_same(const kv_vidframe_t *, const kv_vidframe_t *);
+boolean_t kv_vidctx_assume(kv_vidctx_t *, const kv_vidframe_t *,
+    const kv_vidframe_t *);
 void kv_vidctx_free(kv_vidctx_t *);
 
+/*
+ * See "kartvid yuvcal".
+ */
+struct kv_yuvcal;
+typedef struct kv_yuvcal kv_yuvcal_t;
+kv_yuvcal_t *kv_yuvcal_init(void);
+void kv_yuvcal_frame(kv_yuvcal_t *, img_t *, const img_yuv_t *);
+void kv_yuvcal_report(kv_yuvcal_t *, FILE *);
+void kv_yuvcal_free(kv_yuvcal_t *);
+
 #endif
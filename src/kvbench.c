@@ -0,0 +1,593 @@
+/*
+ * kvbench.c: microbenchmarks for the image kernels and kv_ident()
+ *
+ * Each benchmark repeats one operation on a full-size frame for at least
+ * KVB_MINTIME nanoseconds, and does that KVB_NRUNS times.  The fastest run is
+ * reported, since noise only ever makes things slower.  Results are given per
+ * operation, per pixel of the frame, and as the rate at which image data went
+ * through, counting each full image read or written by the operation.  The
+ * frames are the screenshots that the masks were made from, and the masks are
+ * the real ones, loaded the same way "kartvid" loads them.
+ *
+ * With -s, the results are saved to a baseline file.  With -c, they're compared
+ * to a baseline saved earlier, and any benchmark that got slower by more than
+ * the tolerance (-T, a percentage) is flagged, in which case kvbench exits with
+ * status 1.  Baselines are only meaningful on the machine they were saved on.
+ *
+ * With -e, kvbench runs no benchmarks, but instead checks that every mask in
+ * assets/masks scores each of the frames within IMG_CMP_EPSILON of the
+ * floating-point score, both with img_mask_compare() and with each comparison
+ * kernel the CPU supports.  It exits with status 1 if any score is off by more
+ * than that.
+ */
+
+#include <dirent.h>
+#include <err.h>
+#include <libgen.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compat.h"
+#include "img.h"
+#include "img_cmp.h"
+#include "kv.h"
+
+#define	KVB_MINTIME	200000000ULL	/* 0.2s */
+#define	KVB_NRUNS	5
+#define	KVB_MAXFRAMES	64
+#define	KVB_TOLERANCE	10.0		/* default for -T */
+#define	KVB_FRAME	"char_dwbm_mario.png"	/* in mask_sources */
+#define	KVB_MASK	"char_mario_1.png"	/* in masks */
+#define	KVB_TMPDIR	"/tmp/kvbench.XXXXXX"
+
+typedef struct {
+	const char	*kb_name;
+	void		(*kb_func)(void);
+	unsigned int	kb_nimages;	/* full images read or written */
+	double		kb_nsop;	/* fastest ns per operation */
+	unsigned long	kb_nops;	/* operations in the fastest run */
+} kvbench_t;
+
+static void kvb_compare(void);
+static void kvb_mask_compare(void);
+static void kvb_and(void);
+static void kvb_translatexy(void);
+static void kvb_read_png(void);
+static void kvb_read_ppm(void);
+static void kvb_write_png(void);
+static void kvb_write_ppm(void);
+static void kvb_ident(void);
+
+static kvbench_t kvb_benches[] = {
+	{ "img_compare", kvb_compare, 2 },
+	{ "img_mask_compare", kvb_mask_compare, 1 },
+	{ "img_and", kvb_and, 2 },
+	{ "img_translatexy", kvb_translatexy, 2 },
+	{ "img_read_png", kvb_read_png, 1 },
+	{ "img_read_ppm", kvb_read_ppm, 1 },
+	{ "img_write_png", kvb_write_png, 1 },
+	{ "img_write_ppm", kvb_write_ppm, 1 },
+	{ "kv_ident", kvb_ident, 1 },
+};
+
+static int kvb_nbenches = sizeof (kvb_benches) / sizeof (kvb_benches[0]);
+
+int kv_debug = 0;
+
+static img_t *kvb_frame;		/* KVB_FRAME */
+static img_t *kvb_scratch;		/* copy of kvb_frame for img_and */
+static img_t *kvb_mask;			/* KVB_MASK */
+static img_mask_t *kvb_compiled;	/* KVB_MASK, compiled */
+static img_t *kvb_frames[KVB_MAXFRAMES];	/* all of mask_sources */
+static char *kvb_names[KVB_MAXFRAMES];	/* their file names */
+static int kvb_nframes;
+static int kvb_next;			/* next of kvb_frames to identify */
+static char kvb_tmpdir[sizeof (KVB_TMPDIR)];
+static char kvb_png[sizeof (KVB_TMPDIR "/frame.png")];	/* kvb_frame, as PNG */
+static char kvb_ppm[sizeof (KVB_TMPDIR "/frame.ppm")];	/* kvb_frame, as PPM */
+
+static uint64_t
+kvb_now(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+kvb_compare(void)
+{
+	(void) img_compare(kvb_frame, kvb_mask, NULL);
+}
+
+static void
+kvb_mask_compare(void)
+{
+	(void) img_mask_compare(kvb_frame, kvb_compiled);
+}
+
+static void
+kvb_and(void)
+{
+	img_and(kvb_scratch, kvb_mask);
+}
+
+static void
+kvb_translatexy(void)
+{
+	img_free(img_translatexy(kvb_frame, 323, 240));
+}
+
+static void
+kvb_read_png(void)
+{
+	img_free(img_read(kvb_png));
+}
+
+static void
+kvb_read_ppm(void)
+{
+	img_free(img_read(kvb_ppm));
+}
+
+static void
+kvb_write_png(void)
+{
+	(void) img_write(kvb_frame, kvb_png);
+}
+
+static void
+kvb_write_ppm(void)
+{
+	(void) img_write(kvb_frame, kvb_ppm);
+}
+
+/*
+ * Consecutive frames are different, so kv_ident() can't reuse any results.
+ */
+static void
+kvb_ident(void)
+{
+	kv_screen_t ks;
+
+	kv_ident(kvb_frames[kvb_next], &ks, KV_IDENT_ALL);
+	kvb_next = (kvb_next + 1) % kvb_nframes;
+}
+
+static void
+kvb_run(kvbench_t *kbp)
+{
+	uint64_t start, elapsed;
+	unsigned long n;
+	double nsop;
+	int i;
+
+	for (i = 0; i < KVB_NRUNS; i++) {
+		n = 0;
+		start = kvb_now();
+		do {
+			kbp->kb_func();
+			n++;
+		} while ((elapsed = kvb_now() - start) < KVB_MINTIME);
+
+		nsop = (double)elapsed / n;
+		if (i == 0 || nsop < kbp->kb_nsop) {
+			kbp->kb_nsop = nsop;
+			kbp->kb_nops = n;
+		}
+	}
+}
+
+static boolean_t
+kvb_ispng(const char *name)
+{
+	size_t len = strlen(name);
+
+	return (len >= sizeof (".png") &&
+	    strcmp(name + len - sizeof (".png") + 1, ".png") == 0);
+}
+
+/*
+ * Load the frames and masks, and write the frame used by the image reading
+ * benchmarks in each format.
+ */
+static int
+kvb_init(const char *root)
+{
+	char path[PATH_MAX];
+	DIR *dirp;
+	struct dirent *entp;
+	img_t *image;
+
+	if (kv_init(root) != 0) {
+		warnx("failed to initialize masks");
+		return (-1);
+	}
+
+	(void) snprintf(path, sizeof (path), "%s/../assets/mask_sources", root);
+	if ((dirp = opendir(path)) == NULL) {
+		warn("opendir %s", path);
+		return (-1);
+	}
+
+	while ((entp = readdir(dirp)) != NULL && kvb_nframes < KVB_MAXFRAMES) {
+		if (!kvb_ispng(entp->d_name))
+			continue;
+
+		(void) snprintf(path, sizeof (path),
+		    "%s/../assets/mask_sources/%s", root, entp->d_name);
+		if ((image = img_read(path)) == NULL) {
+			(void) closedir(dirp);
+			return (-1);
+		}
+
+		if ((kvb_names[kvb_nframes] = strdup(entp->d_name)) == NULL) {
+			warn("strdup");
+			img_free(image);
+			(void) closedir(dirp);
+			return (-1);
+		}
+
+		kvb_frames[kvb_nframes++] = image;
+		if (strcmp(entp->d_name, KVB_FRAME) == 0)
+			kvb_frame = image;
+	}
+
+	(void) closedir(dirp);
+
+	if (kvb_frame == NULL) {
+		warnx("missing frame %s", KVB_FRAME);
+		return (-1);
+	}
+
+	(void) snprintf(path, sizeof (path), "%s/../assets/masks/%s", root,
+	    KVB_MASK);
+	if ((kvb_mask = img_read(path)) == NULL)
+		return (-1);
+
+	/* Translating by nothing makes a copy. */
+	if ((kvb_scratch = img_translatexy(kvb_frame, 0, 0)) == NULL) {
+		warn("img_translatexy");
+		return (-1);
+	}
+
+	if ((kvb_compiled = img_mask_compile(kvb_mask)) == NULL) {
+		warn("img_mask_compile");
+		return (-1);
+	}
+
+	(void) strlcpy(kvb_tmpdir, KVB_TMPDIR, sizeof (kvb_tmpdir));
+	if (mkdtemp(kvb_tmpdir) == NULL) {
+		warn("mkdtemp");
+		kvb_tmpdir[0] = '\0';
+		return (-1);
+	}
+
+	(void) snprintf(kvb_png, sizeof (kvb_png), "%s/frame.png", kvb_tmpdir);
+	(void) snprintf(kvb_ppm, sizeof (kvb_ppm), "%s/frame.ppm", kvb_tmpdir);
+	if (img_write(kvb_frame, kvb_png) != 0 ||
+	    img_write(kvb_frame, kvb_ppm) != 0)
+		return (-1);
+
+	return (0);
+}
+
+static void
+kvb_fini(void)
+{
+	int i;
+
+	if (kvb_tmpdir[0] != '\0') {
+		(void) unlink(kvb_png);
+		(void) unlink(kvb_ppm);
+		(void) rmdir(kvb_tmpdir);
+	}
+
+	for (i = 0; i < kvb_nframes; i++) {
+		img_free(kvb_frames[i]);
+		free(kvb_names[i]);
+	}
+
+	img_mask_free(kvb_compiled);
+	img_free(kvb_mask);
+	img_free(kvb_scratch);
+}
+
+/*
+ * Computes the score for "mask" against "image" the way img_mask_compare()
+ * does, but with the given kernel.
+ */
+static double
+kvb_kernel_score(const img_cmp_impl_t *icp, img_t *image, img_mask_t *mask)
+{
+	unsigned int i;
+	uint64_t sum = 0;
+	img_run_t *runp;
+
+	for (i = 0; i < mask->imm_nruns; i++) {
+		runp = &mask->imm_runs[i];
+		sum += icp->icm_span(&image->img_pixels[
+		    img_coord(image, runp->ir_x, runp->ir_y)],
+		    &mask->imm_pixels[runp->ir_off], runp->ir_len);
+	}
+
+	return (IMG_SCORE_DOUBLE(img_cmp_score(sum, mask->imm_npixels)));
+}
+
+/*
+ * Checks one fixed-point score against the floating-point one, keeping track of
+ * the largest difference in "maxdiffp".  Reports the score and returns B_TRUE
+ * if they differ by more than IMG_CMP_EPSILON.
+ */
+static boolean_t
+kvb_check_score(const char *how, const char *mask, int frame, double score,
+    double exact, double *maxdiffp)
+{
+	double diff = fabs(score - exact);
+
+	if (diff > *maxdiffp)
+		*maxdiffp = diff;
+
+	if (diff <= IMG_CMP_EPSILON)
+		return (B_FALSE);
+
+	(void) printf("%s: %s vs. %s: score %.9f, expected %.9f\n", how,
+	    mask, kvb_names[frame], score, exact);
+	return (B_TRUE);
+}
+
+/*
+ * Implements -e (see above).
+ */
+static int
+kvb_check(const char *root)
+{
+	char path[PATH_MAX];
+	DIR *dirp;
+	struct dirent *entp;
+	img_t *mask;
+	img_mask_t *compiled;
+	const img_cmp_impl_t *icp;
+	double exact, maxdiff;
+	unsigned long nscores, nbad;
+	int i, k, nmasks, nkernels;
+
+	(void) snprintf(path, sizeof (path), "%s/../assets/masks", root);
+	if ((dirp = opendir(path)) == NULL) {
+		warn("opendir %s", path);
+		return (-1);
+	}
+
+	for (nkernels = 0; img_cmp_impl_supported(nkernels) != NULL; nkernels++)
+		continue;
+
+	maxdiff = 0;
+	nscores = nbad = 0;
+	nmasks = 0;
+	while ((entp = readdir(dirp)) != NULL) {
+		if (!kvb_ispng(entp->d_name))
+			continue;
+
+		(void) snprintf(path, sizeof (path), "%s/../assets/masks/%s",
+		    root, entp->d_name);
+		if ((mask = img_read(path)) == NULL) {
+			(void) closedir(dirp);
+			return (-1);
+		}
+
+		if ((compiled = img_mask_compile(mask)) == NULL) {
+			warn("img_mask_compile %s", entp->d_name);
+			img_free(mask);
+			(void) closedir(dirp);
+			return (-1);
+		}
+
+		nmasks++;
+		for (i = 0; i < kvb_nframes; i++) {
+			if (kvb_frames[i]->img_width != mask->img_width ||
+			    kvb_frames[i]->img_height != mask->img_height) {
+				warnx("%s and %s are different sizes",
+				    entp->d_name, kvb_names[i]);
+				nbad++;
+				continue;
+			}
+
+			/* A mask with no pixels never matches anything. */
+			if (compiled->imm_npixels == 0)
+				continue;
+
+			exact = img_compare_float(kvb_frames[i], mask);
+			nbad += kvb_check_score("img_mask_compare",
+			    entp->d_name, i, IMG_SCORE_DOUBLE(
+			    img_mask_compare(kvb_frames[i], compiled)), exact,
+			    &maxdiff);
+			nscores++;
+
+			for (k = 0; k < nkernels; k++) {
+				icp = img_cmp_impl_supported(k);
+				nbad += kvb_check_score(icp->icm_name,
+				    entp->d_name, i, kvb_kernel_score(icp,
+				    kvb_frames[i], compiled), exact, &maxdiff);
+				nscores++;
+			}
+		}
+
+		img_mask_free(compiled);
+		img_free(mask);
+	}
+
+	(void) closedir(dirp);
+
+	(void) printf("checked %d masks against %d frames with "
+	    "img_mask_compare (%s) and %d kernels: %lu scores, maximum "
+	    "difference %.3g (epsilon %g)\n", nmasks, kvb_nframes,
+	    img_cmp_impl()->icm_name, nkernels, nscores, maxdiff,
+	    IMG_CMP_EPSILON);
+
+	if (nbad > 0) {
+		warnx("%lu score%s off by more than %g", nbad,
+		    nbad == 1 ? "" : "s", IMG_CMP_EPSILON);
+		return (1);
+	}
+
+	return (0);
+}
+
+/*
+ * Look up "name" in the baseline file "base", which has one benchmark name and
+ * its ns per operation on each line.  Returns the baseline ns per operation,
+ * or 0 if the benchmark isn't there.
+ */
+static double
+kvb_baseline(FILE *base, const char *name)
+{
+	char line[128], bname[64];
+	double nsop;
+
+	rewind(base);
+	while (fgets(line, sizeof (line), base) != NULL) {
+		if (sscanf(line, "%63s %lf", bname, &nsop) == 2 &&
+		    strcmp(bname, name) == 0)
+			return (nsop);
+	}
+
+	return (0);
+}
+
+static void
+usage(const char *arg0)
+{
+	(void) fprintf(stderr, "usage: %s [-c baseline] [-s baseline] "
+	    "[-T tolerance]\n", arg0);
+	(void) fprintf(stderr, "       %s -e\n", arg0);
+	exit(EXIT_USAGE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *check = NULL, *save = NULL;
+	boolean_t accuracy = B_FALSE;
+	FILE *base = NULL, *out;
+	double tolerance = KVB_TOLERANCE;
+	double npixels, nsbase, change;
+	kvbench_t *kbp;
+	int c, i, nslower, rv;
+	char *q, *root;
+
+	while ((c = getopt(argc, argv, "c:es:T:")) != -1) {
+		switch (c) {
+		case 'c':
+			check = optarg;
+			break;
+
+		case 'e':
+			accuracy = B_TRUE;
+			break;
+
+		case 's':
+			save = optarg;
+			break;
+
+		case 'T':
+			tolerance = strtod(optarg, &q);
+			if (*optarg == '\0' || *q != '\0' || tolerance < 0) {
+				warnx("invalid tolerance: %s", optarg);
+				usage(argv[0]);
+			}
+			break;
+
+		case '?':
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc ||
+	    (accuracy && (check != NULL || save != NULL)))
+		usage(argv[0]);
+
+	if (check != NULL && (base = fopen(check, "r")) == NULL) {
+		warn("fopen %s", check);
+		return (EXIT_FAILURE);
+	}
+
+	root = dirname(argv[0]);
+	if (kvb_init(root) != 0) {
+		kvb_fini();
+		return (EXIT_FAILURE);
+	}
+
+	if (accuracy) {
+		rv = kvb_check(root);
+		kvb_fini();
+		return (rv == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	npixels = (double)kvb_frame->img_width * kvb_frame->img_height;
+	(void) printf("%-18s %8s %12s %9s %7s", "BENCHMARK", "OPS", "NS/OP",
+	    "NS/PIXEL", "GB/S");
+	if (base != NULL)
+		(void) printf(" %12s %8s", "BASE NS/OP", "CHANGE");
+	(void) printf("\n");
+
+	nslower = 0;
+	for (i = 0; i < kvb_nbenches; i++) {
+		kbp = &kvb_benches[i];
+		kvb_run(kbp);
+
+		(void) printf("%-18s %8lu %12.1f %9.3f %7.2f", kbp->kb_name,
+		    kbp->kb_nops, kbp->kb_nsop, kbp->kb_nsop / npixels,
+		    kbp->kb_nimages * npixels * sizeof (img_pixel_t) /
+		    kbp->kb_nsop);
+
+		if (base != NULL &&
+		    (nsbase = kvb_baseline(base, kbp->kb_name)) > 0) {
+			change = 100 * (kbp->kb_nsop - nsbase) / nsbase;
+			(void) printf(" %12.1f %+7.1f%%", nsbase, change);
+			if (change > tolerance) {
+				(void) printf(" SLOWER");
+				nslower++;
+			}
+		}
+
+		(void) printf("\n");
+		(void) fflush(stdout);
+	}
+
+	kvb_fini();
+	rv = EXIT_SUCCESS;
+
+	if (base != NULL) {
+		(void) fclose(base);
+		if (nslower > 0) {
+			warnx("%d benchmark%s slower than %s by more than %g%%",
+			    nslower, nslower == 1 ? "" : "s", check, tolerance);
+			rv = 1;
+		}
+	}
+
+	if (save != NULL) {
+		if ((out = fopen(save, "w")) == NULL) {
+			warn("fopen %s", save);
+			return (EXIT_FAILURE);
+		}
+
+		for (i = 0; i < kvb_nbenches; i++)
+			(void) fprintf(out, "%s %.1f\n", kvb_benches[i].kb_name,
+			    kvb_benches[i].kb_nsop);
+
+		if (fclose(out) != 0) {
+			warn("write %s", save);
+			return (EXIT_FAILURE);
+		}
+	}
+
+	return (rv);
+}
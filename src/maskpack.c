@@ -0,0 +1,380 @@
+/*
+ * maskpack.c: precompiled mask packs
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "maskpack.h"
+
+#define	MASKPACK_NVIEWS		(1 + IMG_PYR_NLEVELS)
+#define	MASKPACK_ALIGN(off)	(((off) + 7) & ~(uint64_t)7)
+
+struct maskpack {
+	void			*mp_base;	/* mapping of the whole file */
+	size_t			mp_size;
+	unsigned int		mp_nmasks;
+	const maskpack_entry_t	*mp_entries;
+	img_mask_t		*mp_masks;	/* MASKPACK_NVIEWS per entry */
+};
+
+static const maskpack_rec_t *
+maskpack_entry_view(const maskpack_entry_t *mpe, unsigned int v)
+{
+	return (v == 0 ? &mpe->mpe_mask : &mpe->mpe_levels[v - 1]);
+}
+
+static const img_mask_t *
+maskpack_mask_view(img_mask_t *mask, unsigned int v)
+{
+	return (v == 0 ? mask : mask->imm_levels[v - 1]);
+}
+
+static int
+maskpack_pad(FILE *fp, uint64_t *offp)
+{
+	static const char zeros[8];
+	size_t npad = MASKPACK_ALIGN(*offp) - *offp;
+
+	if (npad > 0 && fwrite(zeros, 1, npad, fp) != npad)
+		return (-1);
+
+	*offp += npad;
+	return (0);
+}
+
+/*
+ * Write the given compiled masks to a new mask pack at "filename".  The masks
+ * should already have been ordered with img_mask_order(), since that's what
+ * callers of maskpack_open() will get.  The pack is written to a temporary
+ * file that's then renamed into place so that processes that have the old pack
+ * mapped are unaffected.
+ */
+int
+maskpack_write(const char *filename, const char **names, img_mask_t **masks,
+    unsigned int nmasks)
+{
+	maskpack_header_t mph;
+	maskpack_entry_t *entries;
+	maskpack_rec_t *mpr;
+	const img_mask_t *view;
+	char tmpname[PATH_MAX];
+	uint64_t off;
+	unsigned int i, v;
+	size_t len;
+	FILE *fp;
+
+	if ((entries = calloc(nmasks + 1, sizeof (entries[0]))) == NULL) {
+		warn("maskpack_write");
+		return (-1);
+	}
+
+	/*
+	 * Lay out the data section first so that we can fill in the offsets.
+	 */
+	off = MASKPACK_ALIGN(sizeof (mph) + nmasks * sizeof (entries[0]));
+	for (i = 0; i < nmasks; i++) {
+		if (strlen(names[i]) >= MASKPACK_NAMELEN) {
+			warnx("maskpack_write %s: mask name too long: %s",
+			    filename, names[i]);
+			free(entries);
+			return (-1);
+		}
+
+		(void) strlcpy(entries[i].mpe_name, names[i],
+		    sizeof (entries[i].mpe_name));
+
+		for (v = 0; v < MASKPACK_NVIEWS; v++) {
+			view = maskpack_mask_view(masks[i], v);
+			mpr = (maskpack_rec_t *)maskpack_entry_view(&entries[i],
+			    v);
+			mpr->mpr_width = view->imm_width;
+			mpr->mpr_height = view->imm_height;
+			mpr->mpr_minx = view->imm_minx;
+			mpr->mpr_maxx = view->imm_maxx;
+			mpr->mpr_miny = view->imm_miny;
+			mpr->mpr_maxy = view->imm_maxy;
+			mpr->mpr_npixels = view->imm_npixels;
+			mpr->mpr_nruns = view->imm_nruns;
+			mpr->mpr_runs_off = off;
+			off = MASKPACK_ALIGN(off +
+			    view->imm_nruns * sizeof (img_run_t));
+			mpr->mpr_pixels_off = off;
+			off = MASKPACK_ALIGN(off +
+			    view->imm_npixels * sizeof (img_pixel_t));
+		}
+	}
+
+	bzero(&mph, sizeof (mph));
+	mph.mph_magic = MASKPACK_MAGIC;
+	mph.mph_version = MASKPACK_VERSION;
+	mph.mph_nmasks = nmasks;
+	mph.mph_nlevels = IMG_PYR_NLEVELS;
+	mph.mph_seglen = IMG_MASK_SEGLEN;
+	mph.mph_runsize = sizeof (img_run_t);
+	mph.mph_size = off;
+
+	(void) snprintf(tmpname, sizeof (tmpname), "%s.tmp", filename);
+	if ((fp = fopen(tmpname, "w")) == NULL) {
+		warn("maskpack_write %s", tmpname);
+		free(entries);
+		return (-1);
+	}
+
+	off = sizeof (mph) + nmasks * sizeof (entries[0]);
+	if (fwrite(&mph, sizeof (mph), 1, fp) != 1 ||
+	    fwrite(entries, sizeof (entries[0]), nmasks, fp) != nmasks ||
+	    maskpack_pad(fp, &off) != 0)
+		goto err;
+
+	for (i = 0; i < nmasks; i++) {
+		for (v = 0; v < MASKPACK_NVIEWS; v++) {
+			view = maskpack_mask_view(masks[i], v);
+
+			len = view->imm_nruns * sizeof (img_run_t);
+			if (fwrite(view->imm_runs, 1, len, fp) != len)
+				goto err;
+			off += len;
+			if (maskpack_pad(fp, &off) != 0)
+				goto err;
+
+			len = view->imm_npixels * sizeof (img_pixel_t);
+			if (fwrite(view->imm_pixels, 1, len, fp) != len)
+				goto err;
+			off += len;
+			if (maskpack_pad(fp, &off) != 0)
+				goto err;
+		}
+	}
+
+	free(entries);
+	entries = NULL;
+
+	if (off != mph.mph_size || fclose(fp) != 0) {
+		fp = NULL;
+		goto err;
+	}
+
+	if (rename(tmpname, filename) != 0) {
+		warn("maskpack_write: rename %s", tmpname);
+		(void) unlink(tmpname);
+		return (-1);
+	}
+
+	return (0);
+
+err:
+	warn("maskpack_write %s", tmpname);
+	free(entries);
+	if (fp != NULL)
+		(void) fclose(fp);
+	(void) unlink(tmpname);
+	return (-1);
+}
+
+/*
+ * Fill in "mask" from the record "mpr", validating that everything it refers to
+ * lies within the pack and that its runs lie within its own bounds so that a
+ * damaged pack can't cause img_mask_compare() to read outside the image.
+ */
+static int
+maskpack_load_rec(maskpack_t *mp, const maskpack_rec_t *mpr, img_mask_t *mask)
+{
+	const img_run_t *runp;
+	unsigned int i;
+
+	if (mpr->mpr_width > UINT16_MAX || mpr->mpr_height > UINT16_MAX ||
+	    mpr->mpr_maxx > mpr->mpr_width || mpr->mpr_minx > mpr->mpr_maxx ||
+	    mpr->mpr_maxy > mpr->mpr_height || mpr->mpr_miny > mpr->mpr_maxy)
+		return (-1);
+
+	if (mpr->mpr_runs_off % sizeof (uint32_t) != 0 ||
+	    mpr->mpr_runs_off > mp->mp_size ||
+	    (mp->mp_size - mpr->mpr_runs_off) / sizeof (img_run_t) <
+	    mpr->mpr_nruns ||
+	    mpr->mpr_pixels_off > mp->mp_size ||
+	    (mp->mp_size - mpr->mpr_pixels_off) / sizeof (img_pixel_t) <
+	    mpr->mpr_npixels)
+		return (-1);
+
+	mask->imm_width = mpr->mpr_width;
+	mask->imm_height = mpr->mpr_height;
+	mask->imm_minx = mpr->mpr_minx;
+	mask->imm_maxx = mpr->mpr_maxx;
+	mask->imm_miny = mpr->mpr_miny;
+	mask->imm_maxy = mpr->mpr_maxy;
+	mask->imm_npixels = mpr->mpr_npixels;
+	mask->imm_nruns = mpr->mpr_nruns;
+	mask->imm_runs = (img_run_t *)
+	    ((char *)mp->mp_base + mpr->mpr_runs_off);
+	mask->imm_pixels = (img_pixel_t *)
+	    ((char *)mp->mp_base + mpr->mpr_pixels_off);
+
+	for (i = 0; i < mask->imm_nruns; i++) {
+		runp = &mask->imm_runs[i];
+		if (runp->ir_y >= mask->imm_height ||
+		    runp->ir_x > mask->imm_width ||
+		    runp->ir_len > mask->imm_width - runp->ir_x ||
+		    runp->ir_off > mask->imm_npixels ||
+		    runp->ir_len > mask->imm_npixels - runp->ir_off)
+			return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Map the mask pack at "filename".  If it doesn't exist, this fails silently
+ * with errno set to ENOENT.  If it can't be used (because it's damaged or was
+ * built by an incompatible version of kartvid), this fails with a warning and
+ * errno set to EINVAL.
+ *
+ * The masks returned by maskpack_mask() refer to the mapping, so they remain
+ * valid until maskpack_close() and must not be passed to img_mask_free() or
+ * modified.
+ */
+maskpack_t *
+maskpack_open(const char *filename)
+{
+	maskpack_t *mp;
+	const maskpack_header_t *mph;
+	const maskpack_entry_t *mpe;
+	img_mask_t *mask;
+	struct stat st;
+	unsigned int i, v;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		if (errno != ENOENT)
+			warn("maskpack_open %s", filename);
+		return (NULL);
+	}
+
+	if (fstat(fd, &st) != 0) {
+		warn("maskpack_open %s", filename);
+		(void) close(fd);
+		return (NULL);
+	}
+
+	if ((mp = calloc(1, sizeof (*mp))) == NULL) {
+		warn("maskpack_open %s", filename);
+		(void) close(fd);
+		return (NULL);
+	}
+
+	if (st.st_size < (off_t)sizeof (*mph)) {
+		warnx("maskpack_open %s: file too small", filename);
+		goto inval;
+	}
+
+	mp->mp_size = st.st_size;
+	mp->mp_base = mmap(NULL, mp->mp_size, PROT_READ, MAP_SHARED, fd, 0);
+	(void) close(fd);
+	fd = -1;
+
+	if (mp->mp_base == MAP_FAILED) {
+		warn("maskpack_open %s: mmap", filename);
+		mp->mp_base = NULL;
+		maskpack_close(mp);
+		return (NULL);
+	}
+
+	mph = mp->mp_base;
+	if (mph->mph_magic != MASKPACK_MAGIC) {
+		warnx("maskpack_open %s: bad magic", filename);
+		goto inval;
+	}
+
+	if (mph->mph_version != MASKPACK_VERSION ||
+	    mph->mph_nlevels != IMG_PYR_NLEVELS ||
+	    mph->mph_seglen != IMG_MASK_SEGLEN ||
+	    mph->mph_runsize != sizeof (img_run_t)) {
+		warnx("maskpack_open %s: unsupported version %u",
+		    filename, mph->mph_version);
+		goto inval;
+	}
+
+	if (mph->mph_size != mp->mp_size ||
+	    (mp->mp_size - sizeof (*mph)) / sizeof (*mpe) < mph->mph_nmasks) {
+		warnx("maskpack_open %s: file is truncated", filename);
+		goto inval;
+	}
+
+	mp->mp_nmasks = mph->mph_nmasks;
+	mp->mp_entries = (const maskpack_entry_t *)(mph + 1);
+	if ((mp->mp_masks = calloc(mp->mp_nmasks * MASKPACK_NVIEWS + 1,
+	    sizeof (mp->mp_masks[0]))) == NULL) {
+		warn("maskpack_open %s", filename);
+		maskpack_close(mp);
+		return (NULL);
+	}
+
+	for (i = 0; i < mp->mp_nmasks; i++) {
+		mpe = &mp->mp_entries[i];
+		mask = &mp->mp_masks[i * MASKPACK_NVIEWS];
+
+		if (strnlen(mpe->mpe_name, sizeof (mpe->mpe_name)) ==
+		    sizeof (mpe->mpe_name)) {
+			warnx("maskpack_open %s: mask %u: bad name",
+			    filename, i);
+			goto inval;
+		}
+
+		for (v = 0; v < MASKPACK_NVIEWS; v++) {
+			if (v > 0)
+				mask->imm_levels[v - 1] = &mask[v];
+
+			if (maskpack_load_rec(mp,
+			    maskpack_entry_view(mpe, v), &mask[v]) != 0) {
+				warnx("maskpack_open %s: mask %s is damaged",
+				    filename, mpe->mpe_name);
+				goto inval;
+			}
+		}
+	}
+
+	return (mp);
+
+inval:
+	if (fd >= 0)
+		(void) close(fd);
+	maskpack_close(mp);
+	errno = EINVAL;
+	return (NULL);
+}
+
+unsigned int
+maskpack_nmasks(maskpack_t *mp)
+{
+	return (mp->mp_nmasks);
+}
+
+const char *
+maskpack_name(maskpack_t *mp, unsigned int i)
+{
+	return (mp->mp_entries[i].mpe_name);
+}
+
+img_mask_t *
+maskpack_mask(maskpack_t *mp, unsigned int i)
+{
+	return (&mp->mp_masks[i * MASKPACK_NVIEWS]);
+}
+
+void
+maskpack_close(maskpack_t *mp)
+{
+	if (mp->mp_base != NULL)
+		(void) munmap(mp->mp_base, mp->mp_size);
+
+	free(mp->mp_masks);
+	free(mp);
+}
@@ -0,0 +1,72 @@
+/*
+ * maskpack.h: precompiled mask packs
+ */
+
+#ifndef MASKPACK_H
+#define	MASKPACK_H
+
+#include <stdint.h>
+
+#include "img.h"
+
+/*
+ * Compiling the masks from their PNG sources (and ordering them for
+ * img_mask_compare_thresh()) takes much longer than identifying a frame, so the
+ * build saves the compiled masks into a single "mask pack" file that kv_init()
+ * can map directly.  The runs and pixels of each mask (and its coarse views)
+ * are stored exactly as they're laid out in memory, so the masks returned by
+ * maskpack_open() point directly into the mapping, which is read-only and
+ * shared by all processes using the same pack.
+ *
+ * The file is laid out as a header, followed by one entry per mask, followed by
+ * the runs and pixels that the entries refer to by offset from the start of the
+ * file.  Everything is stored in native byte order: a pack built on a machine
+ * with different endianness or layout parameters is rejected, and the caller
+ * is expected to fall back to compiling the masks itself.  MASKPACK_VERSION
+ * must be bumped whenever the format or the compiled mask representation
+ * changes.
+ */
+#define	MASKPACK_MAGIC		0x504d564bU	/* "KVMP" */
+#define	MASKPACK_VERSION	1
+#define	MASKPACK_NAMELEN	64
+
+typedef struct maskpack_header {
+	uint32_t	mph_magic;		/* MASKPACK_MAGIC */
+	uint32_t	mph_version;		/* MASKPACK_VERSION */
+	uint32_t	mph_nmasks;		/* number of entries */
+	uint32_t	mph_nlevels;		/* IMG_PYR_NLEVELS */
+	uint32_t	mph_seglen;		/* IMG_MASK_SEGLEN */
+	uint32_t	mph_runsize;		/* sizeof (img_run_t) */
+	uint64_t	mph_size;		/* total file size */
+} maskpack_header_t;
+
+typedef struct maskpack_rec {
+	uint32_t	mpr_width;		/* see img_mask_t */
+	uint32_t	mpr_height;
+	uint32_t	mpr_minx;
+	uint32_t	mpr_maxx;
+	uint32_t	mpr_miny;
+	uint32_t	mpr_maxy;
+	uint32_t	mpr_npixels;
+	uint32_t	mpr_nruns;
+	uint64_t	mpr_runs_off;		/* file offset of imm_runs */
+	uint64_t	mpr_pixels_off;		/* file offset of imm_pixels */
+} maskpack_rec_t;
+
+typedef struct maskpack_entry {
+	char		mpe_name[MASKPACK_NAMELEN];
+	maskpack_rec_t	mpe_mask;			/* full resolution */
+	maskpack_rec_t	mpe_levels[IMG_PYR_NLEVELS];	/* coarse views */
+} maskpack_entry_t;
+
+struct maskpack;
+typedef struct maskpack maskpack_t;
+
+int maskpack_write(const char *, const char **, img_mask_t **, unsigned int);
+maskpack_t *maskpack_open(const char *);
+unsigned int maskpack_nmasks(maskpack_t *);
+const char *maskpack_name(maskpack_t *, unsigned int);
+img_mask_t *maskpack_mask(maskpack_t *, unsigned int);
+void maskpack_close(maskpack_t *);
+
+#endif
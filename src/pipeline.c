@@ -0,0 +1,869 @@
+/*
+ * pipeline.c: pipelined video processing
+ *
+ * The stages are connected by bounded queues (see queue.h) of frames.  There's
+ * a fixed pool of frame slots, which start out on the "free" queue.  The
+ * decoder takes a free slot, pulls the next frame from the video into it (see
+ * video_next_frame()), and puts it on the "todo" queue.  Each worker takes a
+ * frame from "todo", identifies it, and puts it on the "done" queue.  Since
+ * workers finish frames out of order, the consumer (the caller's thread) keeps
+ * completed frames in a reorder buffer until all of the frames before them
+ * have been processed, and then releases each frame and returns its slot to
+ * the free queue.  The video's frame buffer pool is sized to match, so frames
+ * are never copied, and the number of slots bounds both the memory used and
+ * how far the decoder can get ahead of the consumer.
+ *
+ * When the decoder runs out of frames, it puts one NULL on the todo queue for
+ * each worker.  Each worker passes its NULL on to the done queue and exits, so
+ * once the consumer has seen all of the NULLs, it has seen every frame.
+ *
+ * With a single decoder, decoding eventually becomes the bottleneck as workers
+ * are added.  pipeline_video_chunks() instead splits the video at keyframes
+ * into chunks of at least PIPELINE_CHUNK_MINPACKETS packets, and each worker
+ * decodes and identifies whole chunks on its own.  The results are stitched
+ * back together in order by the consumer.  Since only identification happens
+ * in parallel and kv_vidctx_frame() still sees every frame in order, races
+ * spanning a chunk boundary (and the look-back over the frames before a race
+ * start) work exactly as they would otherwise.
+ *
+ * The subtle part of stitching is that a decoder may not produce a frame for
+ * every packet it's given: frames are reordered, so the first few packets
+ * after a keyframe may complete frames that belong before the keyframe.  A
+ * worker starting at a keyframe can't produce those, so each worker decodes
+ * PIPELINE_CHUNK_LOOKAHEAD packets past the end of its chunk, and the consumer
+ * uses the frames from each chunk up to the packet that produced the first
+ * frame of the next chunk.  Frames are identified by the packet that completed
+ * them (vf_packet), which doesn't depend on where decoding started.
+ *
+ * pipeline_videos() works the same way on a batch of videos, with the chunks of
+ * all of them in one list, in order.  Workers take chunks from that list
+ * regardless of which video they belong to, reopening their decoder when they
+ * move to another video, so no worker sits idle at the end of one video while
+ * another has work left.  The consumer still goes through the videos one at a
+ * time.  A video that fails is marked so that workers skip its remaining
+ * chunks, and the consumer moves on to the next one.
+ *
+ * pipeline_video_sampled() is a different kind of shortcut.  During a race,
+ * kv_vidctx_frame() only acts on changes, and most of the time, nothing
+ * changes for many frames.  So within a race, it pulls frames from the video in
+ * windows of "stride" frames, holding onto all of them, and identifies only the
+ * last one.  If that's identified the same way as the frame before the window,
+ * the frames in between are assumed to be the same, too, unless an item box is
+ * involved (see kv_vidctx_assume()).  Otherwise, the window is bisected,
+ * identifying the middle frame and recursing on each half, which pins down each
+ * change to the exact frame with about log2(stride) identifications per change
+ * (and identifies every frame while an item box is showing).  Either way, every
+ * frame is then passed to kv_vidctx_frame() in order.  If the race ends within
+ * the window, the frames after it are identified after all, since outside of
+ * races, every frame counts.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipeline.h"
+#include "queue.h"
+
+#define	PIPELINE_FRAMES_PER_WORKER	2
+#define	PIPELINE_CHUNK_MINPACKETS	1800	/* about a minute at 30fps */
+#define	PIPELINE_CHUNK_LOOKAHEAD	32
+#define	PIPELINE_CHUNKS_PER_WORKER	2
+
+/* Identify frames in YUV if the decoder provides them. */
+#define	PIPELINE_YUV(vfp)	\
+	((vfp)->vf_yuv.iy_planes[0] != NULL ? &(vfp)->vf_yuv : NULL)
+
+typedef struct {
+	unsigned int	pf_seq;		/* index in decode order */
+	boolean_t	pf_identified;	/* kv_vidctx_ident() filled in result */
+	video_frame_t	*pf_frame;	/* held until consumed */
+	kv_vidframe_t	pf_result;
+} pipeline_frame_t;
+
+typedef struct {
+	video_t		*pl_video;
+	kv_vidctx_t	*pl_kvp;
+	unsigned int	pl_nworkers;
+	queue_t		*pl_free;
+	queue_t		*pl_todo;
+	queue_t		*pl_done;
+	unsigned int	pl_seq;		/* next sequence number (decoder) */
+	int		pl_rv;		/* video_next_frame() result */
+} pipeline_t;
+
+static void *
+pipeline_decoder(void *arg)
+{
+	pipeline_t *pl = arg;
+	pipeline_frame_t *pf;
+	unsigned int i;
+
+	for (;;) {
+		pf = queue_pop(pl->pl_free);
+		if ((pl->pl_rv = video_next_frame(pl->pl_video,
+		    &pf->pf_frame)) != 0 || pf->pf_frame == NULL) {
+			queue_push(pl->pl_free, pf);
+			break;
+		}
+
+		pf->pf_seq = pl->pl_seq++;
+		queue_push(pl->pl_todo, pf);
+	}
+
+	for (i = 0; i < pl->pl_nworkers; i++)
+		queue_push(pl->pl_todo, NULL);
+
+	return (NULL);
+}
+
+static void *
+pipeline_worker(void *arg)
+{
+	pipeline_t *pl = arg;
+	pipeline_frame_t *pf;
+
+	while ((pf = queue_pop(pl->pl_todo)) != NULL) {
+		pf->pf_identified = kv_vidctx_ident(pl->pl_kvp,
+		    pf->pf_frame->vf_framenum, &pf->pf_frame->vf_image,
+		    PIPELINE_YUV(pf->pf_frame), &pf->pf_result);
+		queue_push(pl->pl_done, pf);
+	}
+
+	queue_push(pl->pl_done, NULL);
+	return (NULL);
+}
+
+int
+pipeline_video(video_t *vp, kv_vidctx_t *kvp, unsigned int nworkers,
+    pipeline_frame_f func, void *arg)
+{
+	pipeline_t pl;
+	pipeline_frame_t *frames, *pf;
+	pipeline_frame_t **reorder;
+	pthread_t *workers, decoder;
+	unsigned int i, nframes, nstarted, nfinished, next;
+	int err;
+
+	bzero(&pl, sizeof (pl));
+	pl.pl_video = vp;
+	pl.pl_kvp = kvp;
+
+	nframes = nworkers * PIPELINE_FRAMES_PER_WORKER + 2;
+	if (nframes > VIDEO_MAX_BUFFERS)
+		nframes = VIDEO_MAX_BUFFERS;
+	frames = calloc(nframes, sizeof (frames[0]));
+	reorder = calloc(nframes, sizeof (reorder[0]));
+	workers = calloc(nworkers, sizeof (workers[0]));
+	pl.pl_free = queue_init(nframes);
+	pl.pl_todo = queue_init(nframes + nworkers);
+	pl.pl_done = queue_init(nframes + nworkers);
+
+	if (frames == NULL || reorder == NULL || workers == NULL ||
+	    pl.pl_free == NULL || pl.pl_todo == NULL || pl.pl_done == NULL) {
+		warn("failed to allocate pipeline");
+		err = -1;
+		goto out;
+	}
+
+	if (video_set_buffers(vp, nframes) != 0) {
+		err = -1;
+		goto out;
+	}
+
+	for (i = 0; i < nframes; i++)
+		queue_push(pl.pl_free, &frames[i]);
+
+	for (nstarted = 0; nstarted < nworkers; nstarted++) {
+		if ((err = pthread_create(&workers[nstarted], NULL,
+		    pipeline_worker, &pl)) != 0) {
+			warnx("failed to create worker thread: %s",
+			    strerror(err));
+			break;
+		}
+	}
+
+	/*
+	 * Carry on with however many workers we got, since the result doesn't
+	 * depend on the number of workers.
+	 */
+	pl.pl_nworkers = nstarted;
+	if (nstarted == 0) {
+		err = -1;
+		goto out;
+	}
+
+	if ((err = pthread_create(&decoder, NULL, pipeline_decoder,
+	    &pl)) != 0) {
+		warnx("failed to create decoder thread: %s", strerror(err));
+		pl.pl_rv = -1;
+		for (i = 0; i < nstarted; i++)
+			queue_push(pl.pl_todo, NULL);
+	}
+
+	next = 0;
+	nfinished = 0;
+	while (nfinished < nstarted) {
+		if ((pf = queue_pop(pl.pl_done)) == NULL) {
+			nfinished++;
+			continue;
+		}
+
+		assert(pf->pf_seq - next < nframes);
+		reorder[pf->pf_seq % nframes] = pf;
+
+		while ((pf = reorder[next % nframes]) != NULL) {
+			assert(pf->pf_seq == next);
+			reorder[next % nframes] = NULL;
+			func(pf->pf_frame,
+			    pf->pf_identified ? &pf->pf_result : NULL, arg);
+			next++;
+			video_frame_release(pf->pf_frame);
+			queue_push(pl.pl_free, pf);
+		}
+	}
+
+	for (i = 0; i < nstarted; i++)
+		(void) pthread_join(workers[i], NULL);
+
+	if (err == 0)
+		(void) pthread_join(decoder, NULL);
+
+	err = pl.pl_rv;
+
+out:
+	queue_fini(pl.pl_done);
+	queue_fini(pl.pl_todo);
+	queue_fini(pl.pl_free);
+	free(workers);
+	free(reorder);
+	free(frames);
+	return (err);
+}
+
+typedef struct {
+	int		pr_packet;	/* packet that completed the frame */
+	double		pr_frametime;
+	kv_vidframe_t	pr_result;
+} pipeline_result_t;
+
+typedef struct {
+	unsigned int	pc_source;	/* index in pcl_sources */
+	int		pc_first;	/* first packet (a keyframe) */
+	int		pc_last;	/* first packet of the next chunk */
+	int		pc_delay;	/* packets before first frame, or -1 */
+	boolean_t	pc_done;	/* all results available */
+	int		pc_rv;		/* video_iter_range() result */
+	pipeline_result_t *pc_results;
+	unsigned int	pc_nresults;
+	unsigned int	pc_nalloc;
+} pipeline_chunk_t;
+
+/*
+ * Everything a worker needs to decode a video's chunks with its own decoder.
+ */
+typedef struct {
+	const char	*ps_filename;
+	int		ps_formats;
+	img_box_t	ps_boxes[VIDEO_MAX_REGIONS];
+	unsigned int	ps_nboxes;
+	unsigned int	ps_first;	/* index of first chunk */
+	unsigned int	ps_nchunks;
+	boolean_t	ps_failed;	/* remaining chunks are unwanted */
+} pipeline_source_t;
+
+typedef struct {
+	pthread_mutex_t	pcl_lock;
+	pthread_cond_t	pcl_cv;		/* chunk progress or consumption */
+	pipeline_source_t *pcl_sources;
+	unsigned int	pcl_nsources;
+	pipeline_chunk_t *pcl_chunks;
+	unsigned int	pcl_nchunks;
+	unsigned int	pcl_nalloc;
+	unsigned int	pcl_next;	/* next chunk to claim */
+	unsigned int	pcl_consumed;	/* chunks consumed */
+	unsigned int	pcl_window;	/* max chunks ahead of the consumer */
+	boolean_t	pcl_abort;
+} pipeline_chunks_t;
+
+typedef struct {
+	pipeline_chunks_t *pcw_pcl;
+	pipeline_chunk_t *pcw_chunk;	/* current chunk */
+	video_t		*pcw_video;	/* worker's own decoder */
+	int		pcw_source;	/* source pcw_video is for, or -1 */
+	pthread_t	pcw_thread;
+} pipeline_chunk_worker_t;
+
+static int
+pipeline_chunk_frame(video_frame_t *vfp, void *arg)
+{
+	pipeline_chunk_worker_t *pcw = arg;
+	pipeline_chunks_t *pcl = pcw->pcw_pcl;
+	pipeline_chunk_t *pc = pcw->pcw_chunk;
+	pipeline_result_t *prp;
+	unsigned int nalloc;
+
+	if (pc->pc_nresults == 0) {
+		(void) pthread_mutex_lock(&pcl->pcl_lock);
+		pc->pc_delay = vfp->vf_packet - pc->pc_first;
+		(void) pthread_cond_broadcast(&pcl->pcl_cv);
+		(void) pthread_mutex_unlock(&pcl->pcl_lock);
+	}
+
+	if (pc->pc_nresults == pc->pc_nalloc) {
+		nalloc = pc->pc_nalloc == 0 ? 256 : pc->pc_nalloc * 2;
+		if ((prp = realloc(pc->pc_results,
+		    nalloc * sizeof (pc->pc_results[0]))) == NULL) {
+			warn("realloc");
+			return (-1);
+		}
+
+		pc->pc_results = prp;
+		pc->pc_nalloc = nalloc;
+	}
+
+	prp = &pc->pc_results[pc->pc_nresults++];
+	prp->pr_packet = vfp->vf_packet;
+	prp->pr_frametime = vfp->vf_frametime;
+	(void) kv_vidctx_ident(NULL, vfp->vf_framenum, &vfp->vf_image,
+	    PIPELINE_YUV(vfp), &prp->pr_result);
+	return (0);
+}
+
+/*
+ * Make sure the worker's decoder is for the given source, opening a new one
+ * (set up like the caller's, except that the workers are already decoding in
+ * parallel, so each decoder uses only one thread) if necessary.
+ */
+static video_t *
+pipeline_chunk_video(pipeline_chunk_worker_t *pcw, unsigned int s)
+{
+	pipeline_source_t *ps = &pcw->pcw_pcl->pcl_sources[s];
+
+	if (pcw->pcw_source == (int)s)
+		return (pcw->pcw_video);
+
+	if (pcw->pcw_video != NULL) {
+		video_free(pcw->pcw_video);
+		pcw->pcw_video = NULL;
+		pcw->pcw_source = -1;
+	}
+
+	if ((pcw->pcw_video = video_open(ps->ps_filename)) == NULL)
+		return (NULL);
+
+	if (video_set_threads(pcw->pcw_video, 1) != 0 ||
+	    video_set_formats(pcw->pcw_video, ps->ps_formats) != 0 ||
+	    video_set_regions(pcw->pcw_video, ps->ps_boxes,
+	    ps->ps_nboxes) != 0) {
+		video_free(pcw->pcw_video);
+		pcw->pcw_video = NULL;
+		return (NULL);
+	}
+
+	pcw->pcw_source = s;
+	return (pcw->pcw_video);
+}
+
+static void *
+pipeline_chunk_worker(void *arg)
+{
+	pipeline_chunk_worker_t *pcw = arg;
+	pipeline_chunks_t *pcl = pcw->pcw_pcl;
+	pipeline_chunk_t *pc;
+	video_t *vp;
+	int rv, last;
+
+	(void) pthread_mutex_lock(&pcl->pcl_lock);
+	for (;;) {
+		while (!pcl->pcl_abort && pcl->pcl_next < pcl->pcl_nchunks &&
+		    pcl->pcl_next - pcl->pcl_consumed >= pcl->pcl_window)
+			(void) pthread_cond_wait(&pcl->pcl_cv, &pcl->pcl_lock);
+
+		if (pcl->pcl_abort || pcl->pcl_next == pcl->pcl_nchunks)
+			break;
+
+		/*
+		 * Once a video has failed, the rest of its chunks are only
+		 * marked done, so that the consumer can move on.
+		 */
+		pc = &pcl->pcl_chunks[pcl->pcl_next++];
+		if (pcl->pcl_sources[pc->pc_source].ps_failed) {
+			pc->pc_delay = 0;
+			pc->pc_rv = -1;
+			pc->pc_done = B_TRUE;
+			(void) pthread_cond_broadcast(&pcl->pcl_cv);
+			continue;
+		}
+
+		(void) pthread_mutex_unlock(&pcl->pcl_lock);
+
+		last = pc->pc_last == INT_MAX ? INT_MAX :
+		    pc->pc_last + PIPELINE_CHUNK_LOOKAHEAD;
+		pcw->pcw_chunk = pc;
+		vp = pipeline_chunk_video(pcw, pc->pc_source);
+		rv = vp == NULL ? -1 : video_iter_range(vp, pc->pc_first, last,
+		    pipeline_chunk_frame, pcw);
+
+		(void) pthread_mutex_lock(&pcl->pcl_lock);
+		if (pc->pc_delay == -1)
+			pc->pc_delay = last - pc->pc_first;
+		pc->pc_rv = rv;
+		pc->pc_done = B_TRUE;
+		(void) pthread_cond_broadcast(&pcl->pcl_cv);
+	}
+	(void) pthread_mutex_unlock(&pcl->pcl_lock);
+
+	if (pcw->pcw_video != NULL)
+		video_free(pcw->pcw_video);
+
+	return (NULL);
+}
+
+/*
+ * Add a source for "filename", decoded the way "vp" is set up to decode it.
+ * If "vp" is NULL, the video has already failed.  Its chunks are added
+ * separately.
+ */
+static void
+pipeline_source_add(pipeline_chunks_t *pcl, const char *filename,
+    video_t *vp)
+{
+	pipeline_source_t *ps;
+	const img_box_t *boxes;
+
+	ps = &pcl->pcl_sources[pcl->pcl_nsources++];
+	ps->ps_filename = filename;
+	ps->ps_first = pcl->pcl_nchunks;
+	ps->ps_nchunks = 0;
+	ps->ps_failed = vp == NULL;
+	if (vp == NULL)
+		return;
+
+	ps->ps_formats = video_formats(vp);
+	ps->ps_nboxes = video_regions(vp, &boxes);
+	assert(ps->ps_nboxes <= VIDEO_MAX_REGIONS);
+	bcopy(boxes, ps->ps_boxes, ps->ps_nboxes * sizeof (boxes[0]));
+}
+
+/*
+ * Divide the most recently added source into chunks starting at the given
+ * keyframes.  With no keyframes, the whole video is one chunk.
+ */
+static int
+pipeline_chunks_add(pipeline_chunks_t *pcl, const int *keys, int nkeys)
+{
+	pipeline_source_t *ps = &pcl->pcl_sources[pcl->pcl_nsources - 1];
+	pipeline_chunk_t *pc;
+	unsigned int nalloc;
+	int i;
+
+	/* There's at most one chunk per keyframe, plus the first. */
+	if (pcl->pcl_nchunks + nkeys + 1 > pcl->pcl_nalloc) {
+		nalloc = pcl->pcl_nalloc == 0 ? 64 : pcl->pcl_nalloc;
+		while (pcl->pcl_nchunks + nkeys + 1 > nalloc)
+			nalloc *= 2;
+
+		if ((pc = realloc(pcl->pcl_chunks,
+		    nalloc * sizeof (pcl->pcl_chunks[0]))) == NULL) {
+			warn("realloc");
+			return (-1);
+		}
+
+		pcl->pcl_chunks = pc;
+		pcl->pcl_nalloc = nalloc;
+	}
+
+	pc = &pcl->pcl_chunks[pcl->pcl_nchunks];
+	bzero(pc, (nkeys + 1) * sizeof (*pc));
+	pc->pc_first = 0;
+	for (i = 0; i < nkeys; i++) {
+		if (keys[i] - pc->pc_first < PIPELINE_CHUNK_MINPACKETS)
+			continue;
+
+		pc->pc_last = keys[i];
+		pc++;
+		pc->pc_first = keys[i];
+	}
+
+	pc->pc_last = INT_MAX;
+	ps->ps_nchunks = pc - &pcl->pcl_chunks[pcl->pcl_nchunks] + 1;
+
+	for (i = 0; i < ps->ps_nchunks; i++) {
+		pc = &pcl->pcl_chunks[pcl->pcl_nchunks++];
+		pc->pc_source = pcl->pcl_nsources - 1;
+		pc->pc_delay = -1;
+	}
+
+	return (0);
+}
+
+/*
+ * Wait for chunk "k" to finish and for the delay of the chunk after it (in the
+ * same video) to be known, and return the first packet that belongs to the
+ * next chunk.
+ */
+static int
+pipeline_chunk_wait(pipeline_chunks_t *pcl, unsigned int k)
+{
+	pipeline_chunk_t *pc = &pcl->pcl_chunks[k];
+	pipeline_chunk_t *npc;
+	int delay;
+
+	npc = k + 1 < pcl->pcl_nchunks &&
+	    pc[1].pc_source == pc->pc_source ? pc + 1 : NULL;
+	(void) pthread_mutex_lock(&pcl->pcl_lock);
+	while (!pc->pc_done || (npc != NULL && npc->pc_delay == -1))
+		(void) pthread_cond_wait(&pcl->pcl_cv, &pcl->pcl_lock);
+	delay = npc == NULL ? 0 : npc->pc_delay;
+	(void) pthread_mutex_unlock(&pcl->pcl_lock);
+
+	if (npc == NULL)
+		return (INT_MAX);
+
+	if (delay > PIPELINE_CHUNK_LOOKAHEAD) {
+		warnx("%s: decoder delay at packet %d exceeds %d packets "
+		    "(frames may be missing)",
+		    pcl->pcl_sources[pc->pc_source].ps_filename, npc->pc_first,
+		    PIPELINE_CHUNK_LOOKAHEAD);
+		delay = PIPELINE_CHUNK_LOOKAHEAD;
+	}
+
+	return (npc->pc_first + delay);
+}
+
+static void
+pipeline_source_fail(pipeline_chunks_t *pcl, pipeline_source_t *ps)
+{
+	(void) pthread_mutex_lock(&pcl->pcl_lock);
+	ps->ps_failed = B_TRUE;
+	(void) pthread_mutex_unlock(&pcl->pcl_lock);
+}
+
+/*
+ * Start "nworkers" workers on the chunks of all of the sources, and pass the
+ * results to "func", in order, one video at a time.  "start" (if not NULL) is
+ * called before each video's first frame, and "done" (if not NULL) after its
+ * last, with the video's result.  Returns the number of videos that failed.
+ */
+static unsigned int
+pipeline_chunks_run(pipeline_chunks_t *pcl, unsigned int nworkers,
+    int (*start)(unsigned int, void *), pipeline_frame_f func,
+    void (*done)(unsigned int, int, void *), void *arg)
+{
+	pipeline_chunk_worker_t *pcws;
+	pipeline_source_t *ps;
+	pipeline_chunk_t *pc;
+	pipeline_result_t *prp;
+	video_frame_t frame;
+	unsigned int i, k, s, nstarted, nfailed;
+	int cut, err, rv, framenum;
+
+	if ((pcws = calloc(nworkers, sizeof (pcws[0]))) == NULL) {
+		warn("calloc");
+		return (pcl->pcl_nsources);
+	}
+
+	(void) pthread_mutex_init(&pcl->pcl_lock, NULL);
+	(void) pthread_cond_init(&pcl->pcl_cv, NULL);
+	pcl->pcl_window = nworkers * PIPELINE_CHUNKS_PER_WORKER;
+
+	/*
+	 * As with pipeline_video(), carry on with however many workers we get.
+	 * If we get none, every video fails, and no chunk will ever be
+	 * processed.
+	 */
+	for (nstarted = 0; nstarted < nworkers; nstarted++) {
+		pcws[nstarted].pcw_pcl = pcl;
+		pcws[nstarted].pcw_source = -1;
+		if ((err = pthread_create(&pcws[nstarted].pcw_thread, NULL,
+		    pipeline_chunk_worker, &pcws[nstarted])) != 0) {
+			warnx("failed to create worker thread: %s",
+			    strerror(err));
+			break;
+		}
+	}
+
+	if (nstarted == 0) {
+		for (s = 0; s < pcl->pcl_nsources; s++)
+			pcl->pcl_sources[s].ps_failed = B_TRUE;
+
+		for (k = 0; k < pcl->pcl_nchunks; k++) {
+			pcl->pcl_chunks[k].pc_delay = 0;
+			pcl->pcl_chunks[k].pc_rv = -1;
+			pcl->pcl_chunks[k].pc_done = B_TRUE;
+		}
+	}
+
+	/*
+	 * Frames are passed to "func" without their pixels, which are long
+	 * gone by now, but the identification results are complete.  A video
+	 * that fails doesn't hold up the others: its remaining chunks are
+	 * skipped, but we still wait for any that are under way, since
+	 * workers are writing to them.
+	 */
+	bzero(&frame, sizeof (frame));
+	nfailed = 0;
+	for (s = 0; s < pcl->pcl_nsources; s++) {
+		ps = &pcl->pcl_sources[s];
+		rv = ps->ps_failed ? -1 : 0;
+		if (rv == 0 && start != NULL && (rv = start(s, arg)) != 0)
+			pipeline_source_fail(pcl, ps);
+
+		framenum = 0;
+		for (k = ps->ps_first; k < ps->ps_first + ps->ps_nchunks; k++) {
+			cut = pipeline_chunk_wait(pcl, k);
+			pc = &pcl->pcl_chunks[k];
+			if (rv == 0 && (rv = pc->pc_rv) != 0)
+				pipeline_source_fail(pcl, ps);
+
+			for (i = 0; rv == 0 && i < pc->pc_nresults; i++) {
+				prp = &pc->pc_results[i];
+				if (prp->pr_packet >= cut)
+					break;
+
+				frame.vf_framenum = ++framenum;
+				frame.vf_frametime = prp->pr_frametime;
+				frame.vf_packet = prp->pr_packet;
+				func(&frame, &prp->pr_result, arg);
+			}
+
+			(void) pthread_mutex_lock(&pcl->pcl_lock);
+			free(pc->pc_results);
+			pc->pc_results = NULL;
+			pcl->pcl_consumed++;
+			(void) pthread_cond_broadcast(&pcl->pcl_cv);
+			(void) pthread_mutex_unlock(&pcl->pcl_lock);
+		}
+
+		if (rv != 0)
+			nfailed++;
+
+		if (done != NULL)
+			done(s, rv, arg);
+	}
+
+	(void) pthread_mutex_lock(&pcl->pcl_lock);
+	pcl->pcl_abort = B_TRUE;
+	(void) pthread_cond_broadcast(&pcl->pcl_cv);
+	(void) pthread_mutex_unlock(&pcl->pcl_lock);
+
+	for (i = 0; i < nstarted; i++)
+		(void) pthread_join(pcws[i].pcw_thread, NULL);
+
+	(void) pthread_cond_destroy(&pcl->pcl_cv);
+	(void) pthread_mutex_destroy(&pcl->pcl_lock);
+	free(pcws);
+	return (nfailed);
+}
+
+int
+pipeline_video_chunks(const char *filename, video_t *vp, kv_vidctx_t *kvp,
+    unsigned int nworkers, pipeline_frame_f func, void *arg)
+{
+	pipeline_chunks_t pcl;
+	pipeline_source_t source;
+	int *keys, nkeys, rv;
+
+	if (video_keyframes(vp, &keys, &nkeys) != 0) {
+		warnx("%s: no usable keyframe index; decoding serially",
+		    filename);
+		return (pipeline_video(vp, kvp, nworkers, func, arg));
+	}
+
+	bzero(&pcl, sizeof (pcl));
+	pcl.pcl_sources = &source;
+	pipeline_source_add(&pcl, filename, vp);
+	rv = pipeline_chunks_add(&pcl, keys, nkeys);
+	free(keys);
+
+	if (rv == 0 && pipeline_chunks_run(&pcl, nworkers, NULL, func, NULL,
+	    arg) != 0)
+		rv = -1;
+
+	free(pcl.pcl_chunks);
+	return (rv);
+}
+
+int
+pipeline_videos(const char **filenames, unsigned int nvideos,
+    unsigned int nworkers, const pipeline_batch_ops_t *ops, void *arg)
+{
+	pipeline_chunks_t pcl;
+	video_t *vp;
+	unsigned int s, nfailed;
+	int *keys, nkeys, rv;
+
+	bzero(&pcl, sizeof (pcl));
+	if ((pcl.pcl_sources = calloc(nvideos,
+	    sizeof (pcl.pcl_sources[0]))) == NULL) {
+		warn("calloc");
+		return (-1);
+	}
+
+	/*
+	 * Plan all of the work up front, so that workers can move on to the
+	 * next video as soon as every chunk of the current one is under way.
+	 * The video we open here is only needed to find the keyframes and how
+	 * to decode the frames, so we don't keep it (or its file) open.
+	 */
+	rv = 0;
+	for (s = 0; s < nvideos && rv == 0; s++) {
+		if ((vp = video_open(filenames[s])) != NULL &&
+		    ops->pbo_setup(s, vp, arg) != 0) {
+			video_free(vp);
+			vp = NULL;
+		}
+
+		pipeline_source_add(&pcl, filenames[s], vp);
+		if (vp == NULL)
+			continue;
+
+		if (video_keyframes(vp, &keys, &nkeys) != 0) {
+			keys = NULL;
+			nkeys = 0;
+		}
+
+		rv = pipeline_chunks_add(&pcl, keys, nkeys);
+		free(keys);
+		video_free(vp);
+	}
+
+	nfailed = rv != 0 ? nvideos : pipeline_chunks_run(&pcl, nworkers,
+	    ops->pbo_start, ops->pbo_frame, ops->pbo_done, arg);
+	free(pcl.pcl_chunks);
+	free(pcl.pcl_sources);
+	return (rv != 0 ? -1 : (int)nfailed);
+}
+
+typedef enum {
+	PS_UNKNOWN,			/* not yet identified */
+	PS_NONE,			/* kv_vidctx_ident() skipped it */
+	PS_IDENT,			/* identified */
+	PS_ASSUMED			/* same as a neighbour */
+} pipeline_sample_state_t;
+
+typedef struct {
+	video_frame_t	*ps_frame;
+	pipeline_sample_state_t ps_state;
+	kv_vidframe_t	ps_result;
+} pipeline_sample_t;
+
+static void
+pipeline_sample_ident(kv_vidctx_t *kvp, pipeline_sample_t *psp)
+{
+	video_frame_t *vfp = psp->ps_frame;
+
+	psp->ps_state = kv_vidctx_ident(kvp, vfp->vf_framenum, &vfp->vf_image,
+	    PIPELINE_YUV(vfp), &psp->ps_result) ? PS_IDENT : PS_NONE;
+}
+
+/*
+ * Given results for samples "lo" and "hi", work out results for the samples
+ * between them.
+ */
+static void
+pipeline_sample_bisect(kv_vidctx_t *kvp, pipeline_sample_t *samples,
+    unsigned int lo, unsigned int hi)
+{
+	unsigned int i, mid;
+
+	if (hi - lo < 2)
+		return;
+
+	if (samples[lo].ps_state != PS_NONE &&
+	    samples[hi].ps_state != PS_NONE &&
+	    kv_vidctx_assume(kvp, &samples[lo].ps_result,
+	    &samples[hi].ps_result)) {
+		for (i = lo + 1; i < hi; i++) {
+			samples[i].ps_state = PS_ASSUMED;
+			samples[i].ps_result = samples[lo].ps_result;
+		}
+
+		return;
+	}
+
+	mid = lo + (hi - lo) / 2;
+	pipeline_sample_ident(kvp, &samples[mid]);
+	pipeline_sample_bisect(kvp, samples, lo, mid);
+	pipeline_sample_bisect(kvp, samples, mid, hi);
+}
+
+int
+pipeline_video_sampled(video_t *vp, kv_vidctx_t *kvp, unsigned int stride,
+    pipeline_frame_f func, void *arg)
+{
+	pipeline_sample_t *samples, *psp;
+	video_frame_t *vfp;
+	unsigned int i, n;
+	int rv;
+
+	if (stride == 0 || stride > PIPELINE_MAX_STRIDE) {
+		warnx("invalid stride (max %d)", PIPELINE_MAX_STRIDE);
+		return (-1);
+	}
+
+	if (video_set_buffers(vp, stride) != 0)
+		return (-1);
+
+	/*
+	 * samples[0] holds the result for the frame before the current window
+	 * (without the frame itself), and samples[1..n] hold the window.
+	 */
+	if ((samples = calloc(stride + 1, sizeof (samples[0]))) == NULL) {
+		warn("calloc");
+		return (-1);
+	}
+
+	samples[0].ps_state = PS_NONE;
+	rv = 0;
+	for (;;) {
+		n = 0;
+		do {
+			if ((rv = video_next_frame(vp, &vfp)) != 0 ||
+			    vfp == NULL)
+				break;
+
+			psp = &samples[++n];
+			psp->ps_frame = vfp;
+			psp->ps_state = PS_UNKNOWN;
+		} while (n < stride && kv_vidctx_inrace(kvp, vfp->vf_framenum));
+
+		if (n == 0)
+			break;
+
+		if (n > 1) {
+			pipeline_sample_ident(kvp, &samples[n]);
+			if (samples[0].ps_state != PS_NONE) {
+				pipeline_sample_bisect(kvp, samples, 0, n);
+			} else {
+				pipeline_sample_ident(kvp, &samples[1]);
+				pipeline_sample_bisect(kvp, samples, 1, n);
+			}
+		}
+
+		for (i = 1; i <= n; i++) {
+			psp = &samples[i];
+			vfp = psp->ps_frame;
+			if (psp->ps_state == PS_UNKNOWN ||
+			    (psp->ps_state == PS_ASSUMED &&
+			    !kv_vidctx_inrace(kvp, vfp->vf_framenum)))
+				pipeline_sample_ident(kvp, psp);
+
+			func(vfp, psp->ps_state != PS_NONE ?
+			    &psp->ps_result : NULL, arg);
+			video_frame_release(vfp);
+			psp->ps_frame = NULL;
+		}
+
+		samples[0] = samples[n];
+		if (rv != 0)
+			break;
+	}
+
+	free(samples);
+	return (rv);
+}
@@ -0,0 +1,86 @@
+/*
+ * pipeline.h: pipelined video processing
+ */
+
+#ifndef PIPELINE_H
+#define	PIPELINE_H
+
+#include "kv.h"
+#include "video.h"
+
+/*
+ * pipeline_video() processes a video the way that video_iter_frames() would
+ * with a function that calls kv_vidctx_frame() for each frame, except that
+ * decoding and identification run in parallel.  One thread decodes frames,
+ * "nworkers" threads identify them with kv_vidctx_ident(), and the calling
+ * thread invokes "func" for each frame, in order, with the frame and the
+ * results of kv_vidctx_ident() (or NULL if it didn't identify the frame).
+ * "func" is expected to pass these to kv_vidctx_frame().
+ */
+typedef void (*pipeline_frame_f)(video_frame_t *, kv_vidframe_t *, void *);
+
+int pipeline_video(video_t *, kv_vidctx_t *, unsigned int, pipeline_frame_f,
+    void *);
+
+/*
+ * pipeline_video_chunks() is like pipeline_video(), except that the video is
+ * split at keyframes into chunks that are each decoded and identified by one of
+ * "nworkers" threads, each with its own decoder opened from "filename".  The
+ * frames passed to "func" have no pixels (vf_image.img_pixels is NULL).  If the
+ * video can't be split (because the container has no index), this falls back to
+ * pipeline_video().
+ */
+int pipeline_video_chunks(const char *, video_t *, kv_vidctx_t *, unsigned int,
+    pipeline_frame_f, void *);
+
+/*
+ * pipeline_videos() processes a batch of videos the way
+ * pipeline_video_chunks() processes one, with one set of "nworkers" threads
+ * for all of them.  Workers take chunks in order across the whole batch, so
+ * once every chunk of one video has been taken, they move on to the next
+ * rather than waiting for the slowest chunk to finish.  Videos without a
+ * keyframe index are taken as a single chunk.  For each video, in order:
+ *
+ *	pbo_setup(i, vp, arg)	is called with the newly opened video before
+ *				any work starts, to set its regions and formats
+ *				(and to note anything else it needs).  The
+ *				video is closed when this returns; each worker
+ *				opens its own.
+ *
+ *	pbo_start(i, arg)	is called before any of the video's frames.
+ *
+ *	pbo_frame(...)		is called for each frame, as with
+ *				pipeline_video_chunks().
+ *
+ *	pbo_done(i, rv, arg)	is called last, with 0 if the video was
+ *				processed completely or -1 if not.
+ *
+ * If the video can't be opened or pbo_setup() or pbo_start() fails, the video
+ * fails, and pbo_done() is still called.  A failed video doesn't affect the
+ * others.  Returns the number of videos that failed, or -1 if nothing could
+ * be processed at all.
+ */
+typedef struct {
+	int	(*pbo_setup)(unsigned int, video_t *, void *);
+	int	(*pbo_start)(unsigned int, void *);
+	pipeline_frame_f pbo_frame;
+	void	(*pbo_done)(unsigned int, int, void *);
+} pipeline_batch_ops_t;
+
+int pipeline_videos(const char **, unsigned int, unsigned int,
+    const pipeline_batch_ops_t *, void *);
+
+/*
+ * pipeline_video_sampled() is like pipeline_video(), except that everything
+ * happens in the calling thread and, during races, only every "stride"th frame
+ * is identified up front.  When two consecutive samples are identified
+ * differently, the frames between them are bisected to find exactly where
+ * things changed.  The other frames are passed to "func" with the results of
+ * an identical neighbour, so the output is the same as processing every frame,
+ * provided nothing changes and changes back within "stride" frames.
+ */
+#define	PIPELINE_MAX_STRIDE	VIDEO_MAX_BUFFERS
+int pipeline_video_sampled(video_t *, kv_vidctx_t *, unsigned int,
+    pipeline_frame_f, void *);
+
+#endif
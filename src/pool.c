@@ -0,0 +1,191 @@
+/*
+ * pool.c: worker thread pool
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "compat.h"
+#include "pool.h"
+
+struct pool {
+	pthread_mutex_t	pl_lock;
+	pthread_cond_t	pl_workcv;	/* signaled when work is posted */
+	pthread_cond_t	pl_donecv;	/* signaled when workers finish */
+	pthread_t	*pl_threads;	/* pl_nthreads - 1 workers */
+	unsigned int	pl_nthreads;	/* including the caller */
+	unsigned int	pl_nstarted;	/* workers successfully created */
+	uint64_t	pl_gen;		/* incremented for each pool_run() */
+	unsigned int	pl_nbusy;	/* workers still on this generation */
+	boolean_t	pl_shutdown;
+
+	pool_func_t	pl_func;	/* current work */
+	void		*pl_arg;
+	unsigned int	pl_nitems;
+	atomic_uint	pl_next;	/* next item to hand out */
+};
+
+typedef struct {
+	pool_t		*pw_pool;
+	unsigned int	pw_worker;
+} pool_worker_t;
+
+static void
+pool_work(pool_t *pool, unsigned int worker)
+{
+	unsigned int i;
+
+	while ((i = atomic_fetch_add(&pool->pl_next, 1)) < pool->pl_nitems)
+		pool->pl_func(pool->pl_arg, i, worker);
+}
+
+static void *
+pool_worker(void *rawarg)
+{
+	pool_worker_t *pwp = rawarg;
+	pool_t *pool = pwp->pw_pool;
+	unsigned int worker = pwp->pw_worker;
+	uint64_t gen = 0;
+
+	free(pwp);
+
+	(void) pthread_mutex_lock(&pool->pl_lock);
+	for (;;) {
+		while (pool->pl_gen == gen && !pool->pl_shutdown)
+			(void) pthread_cond_wait(&pool->pl_workcv,
+			    &pool->pl_lock);
+
+		if (pool->pl_shutdown)
+			break;
+
+		gen = pool->pl_gen;
+		(void) pthread_mutex_unlock(&pool->pl_lock);
+
+		pool_work(pool, worker);
+
+		(void) pthread_mutex_lock(&pool->pl_lock);
+		if (--pool->pl_nbusy == 0)
+			(void) pthread_cond_signal(&pool->pl_donecv);
+	}
+	(void) pthread_mutex_unlock(&pool->pl_lock);
+
+	return (NULL);
+}
+
+/*
+ * Create a pool of "nthreads" threads, including the caller.  A pool of one
+ * thread does all of its work in pool_run() without creating any threads.
+ */
+pool_t *
+pool_init(unsigned int nthreads)
+{
+	pool_t *pool;
+	pool_worker_t *pwp;
+	unsigned int i;
+	int err;
+
+	if (nthreads == 0) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	if ((pool = calloc(1, sizeof (*pool))) == NULL)
+		return (NULL);
+
+	if ((pool->pl_threads = calloc(nthreads,
+	    sizeof (pool->pl_threads[0]))) == NULL) {
+		free(pool);
+		return (NULL);
+	}
+
+	(void) pthread_mutex_init(&pool->pl_lock, NULL);
+	(void) pthread_cond_init(&pool->pl_workcv, NULL);
+	(void) pthread_cond_init(&pool->pl_donecv, NULL);
+	pool->pl_nthreads = nthreads;
+	atomic_init(&pool->pl_next, 0);
+
+	for (i = 1; i < nthreads; i++) {
+		if ((pwp = malloc(sizeof (*pwp))) == NULL) {
+			pool_fini(pool);
+			return (NULL);
+		}
+
+		pwp->pw_pool = pool;
+		pwp->pw_worker = i;
+		if ((err = pthread_create(&pool->pl_threads[i - 1], NULL,
+		    pool_worker, pwp)) != 0) {
+			free(pwp);
+			pool_fini(pool);
+			errno = err;
+			return (NULL);
+		}
+
+		pool->pl_nstarted++;
+	}
+
+	return (pool);
+}
+
+unsigned int
+pool_nthreads(pool_t *pool)
+{
+	return (pool->pl_nthreads);
+}
+
+void
+pool_run(pool_t *pool, pool_func_t func, void *arg, unsigned int nitems)
+{
+	unsigned int i;
+
+	/*
+	 * Waking up the workers isn't free, so don't bother for a single item.
+	 */
+	if (pool->pl_nstarted == 0 || nitems < 2) {
+		for (i = 0; i < nitems; i++)
+			func(arg, i, 0);
+		return;
+	}
+
+	(void) pthread_mutex_lock(&pool->pl_lock);
+	pool->pl_func = func;
+	pool->pl_arg = arg;
+	pool->pl_nitems = nitems;
+	atomic_store(&pool->pl_next, 0);
+	pool->pl_nbusy = pool->pl_nstarted;
+	pool->pl_gen++;
+	(void) pthread_cond_broadcast(&pool->pl_workcv);
+	(void) pthread_mutex_unlock(&pool->pl_lock);
+
+	pool_work(pool, 0);
+
+	(void) pthread_mutex_lock(&pool->pl_lock);
+	while (pool->pl_nbusy > 0)
+		(void) pthread_cond_wait(&pool->pl_donecv, &pool->pl_lock);
+	(void) pthread_mutex_unlock(&pool->pl_lock);
+}
+
+void
+pool_fini(pool_t *pool)
+{
+	unsigned int i;
+
+	if (pool == NULL)
+		return;
+
+	(void) pthread_mutex_lock(&pool->pl_lock);
+	pool->pl_shutdown = B_TRUE;
+	(void) pthread_cond_broadcast(&pool->pl_workcv);
+	(void) pthread_mutex_unlock(&pool->pl_lock);
+
+	for (i = 0; i < pool->pl_nstarted; i++)
+		(void) pthread_join(pool->pl_threads[i], NULL);
+
+	(void) pthread_cond_destroy(&pool->pl_donecv);
+	(void) pthread_cond_destroy(&pool->pl_workcv);
+	(void) pthread_mutex_destroy(&pool->pl_lock);
+	free(pool->pl_threads);
+	free(pool);
+}
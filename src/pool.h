@@ -0,0 +1,30 @@
+/*
+ * pool.h: worker thread pool
+ */
+
+#ifndef POOL_H
+#define	POOL_H
+
+/*
+ * A pool runs a function over a range of work items using a fixed set of
+ * threads.  pool_run(pool, func, arg, nitems) calls func(arg, item, worker)
+ * once for each item in [0, nitems), where "worker" identifies the thread
+ * (from 0 to pool_nthreads() - 1) so that callers can keep per-thread state.
+ * Items are handed out dynamically, so they may be processed in any order,
+ * and pool_run() returns only once all of them have been processed.  The
+ * calling thread counts as one of the pool's threads and does its share of
+ * the work.
+ *
+ * A pool may only be used by one caller at a time.
+ */
+struct pool;
+typedef struct pool pool_t;
+
+typedef void (*pool_func_t)(void *, unsigned int, unsigned int);
+
+pool_t *pool_init(unsigned int);
+unsigned int pool_nthreads(pool_t *);
+void pool_run(pool_t *, pool_func_t, void *, unsigned int);
+void pool_fini(pool_t *);
+
+#endif
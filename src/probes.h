@@ -0,0 +1,65 @@
+/*
+ * probes.h: static tracing probes
+ *
+ * kartvid's "kartvid" provider has USDT probes at the interesting points of
+ * processing a video, for use with DTrace, bpftrace, perf, or SystemTap.  On
+ * systems with <sys/sdt.h> in the SystemTap style (see the Makefile), each
+ * probe compiles to a single no-op instruction plus a note describing where to
+ * find its arguments, so probes cost essentially nothing until a tracer
+ * attaches.  Elsewhere they compile to nothing at all.  Because their arguments
+ * are always computed, probes should only be given values that are already at
+ * hand.
+ *
+ *	decode__start	(int packet)
+ *	decode__done	(int packet, int gotframe)
+ *		around each call to the decoder
+ *
+ *	ident__start	(int which)
+ *	ident__done	(int which, int duplicate)
+ *		around identifying a frame with kv_ident() and friends, where
+ *		"which" is the kv_ident_t and "duplicate" is whether the
+ *		result came straight from the cache
+ *
+ *	mask__start	(const char *class, const char *mask)
+ *	mask__done	(const char *class, const char *mask, uint32_t score,
+ *			    uint32_t thresh)
+ *		around evaluating one mask, where "class" is "position",
+ *		"character", "item", "start", or "track", and the score and its
+ *		threshold are img_score_t (fixed-point, with IMG_SCORE_SHIFT
+ *		fractional bits).  A score over the threshold may only be a
+ *		lower bound.
+ *
+ *	race__start	(const char *framename, int frame)
+ *	race__done	(const char *framename, int frame)
+ *	race__abort	(const char *framename, int frame)
+ *		when kv_vidctx_frame() sees a race start, a race finish, or a
+ *		new race start while a race was under way
+ *
+ *	emit		(const char *framename, int frame, int timems,
+ *			    int events)
+ *		for every frame state emitted, where "events" is ks_events
+ */
+
+#ifndef PROBES_H
+#define	PROBES_H
+
+#ifdef KV_USDT
+
+#include <sys/sdt.h>
+
+#define	KV_PROBE1(name, a1)	\
+	DTRACE_PROBE1(kartvid, name, a1)
+#define	KV_PROBE2(name, a1, a2)	\
+	DTRACE_PROBE2(kartvid, name, a1, a2)
+#define	KV_PROBE4(name, a1, a2, a3, a4)	\
+	DTRACE_PROBE4(kartvid, name, a1, a2, a3, a4)
+
+#else
+
+#define	KV_PROBE1(name, a1)
+#define	KV_PROBE2(name, a1, a2)
+#define	KV_PROBE4(name, a1, a2, a3, a4)
+
+#endif
+
+#endif
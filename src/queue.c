@@ -0,0 +1,187 @@
+/*
+ * queue.c: bounded lock-free queues
+ *
+ * This is the well-known bounded multi-producer, multi-consumer queue built on
+ * an array of cells, each with a sequence number.  A cell whose sequence
+ * number equals a producer's position is free for that producer to fill, and
+ * a cell whose sequence number is one greater than a consumer's position is
+ * full and ready for that consumer.  Producers and consumers each claim a
+ * position with a compare-and-swap, so the only contention is between threads
+ * on the same side of the queue.
+ */
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "queue.h"
+
+#define	QUEUE_CACHELINE	64
+
+typedef struct {
+	atomic_size_t	qc_seq;
+	void		*qc_data;
+} queue_cell_t;
+
+struct queue {
+	queue_cell_t	*q_cells;
+	size_t		q_mask;		/* number of cells - 1 */
+	char		q_pad0[QUEUE_CACHELINE];
+	atomic_size_t	q_head;		/* next position to push */
+	char		q_pad1[QUEUE_CACHELINE];
+	atomic_size_t	q_tail;		/* next position to pop */
+	char		q_pad2[QUEUE_CACHELINE];
+};
+
+/*
+ * Create a queue that holds at least "capacity" entries.
+ */
+queue_t *
+queue_init(unsigned int capacity)
+{
+	queue_t *q;
+	size_t i, ncells;
+
+	for (ncells = 2; ncells < capacity; ncells <<= 1)
+		continue;
+
+	if ((q = calloc(1, sizeof (*q))) == NULL)
+		return (NULL);
+
+	if ((q->q_cells = calloc(ncells, sizeof (q->q_cells[0]))) == NULL) {
+		free(q);
+		return (NULL);
+	}
+
+	for (i = 0; i < ncells; i++)
+		atomic_init(&q->q_cells[i].qc_seq, i);
+
+	q->q_mask = ncells - 1;
+	atomic_init(&q->q_head, 0);
+	atomic_init(&q->q_tail, 0);
+	return (q);
+}
+
+boolean_t
+queue_trypush(queue_t *q, void *data)
+{
+	queue_cell_t *cell;
+	size_t pos, seq;
+	intptr_t diff;
+
+	pos = atomic_load_explicit(&q->q_head, memory_order_relaxed);
+	for (;;) {
+		cell = &q->q_cells[pos & q->q_mask];
+		seq = atomic_load_explicit(&cell->qc_seq, memory_order_acquire);
+		diff = (intptr_t)seq - (intptr_t)pos;
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&q->q_head,
+			    &pos, pos + 1, memory_order_relaxed,
+			    memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return (B_FALSE);
+		} else {
+			pos = atomic_load_explicit(&q->q_head,
+			    memory_order_relaxed);
+		}
+	}
+
+	cell->qc_data = data;
+	atomic_store_explicit(&cell->qc_seq, pos + 1, memory_order_release);
+	return (B_TRUE);
+}
+
+boolean_t
+queue_trypop(queue_t *q, void **datap)
+{
+	queue_cell_t *cell;
+	size_t pos, seq;
+	intptr_t diff;
+
+	pos = atomic_load_explicit(&q->q_tail, memory_order_relaxed);
+	for (;;) {
+		cell = &q->q_cells[pos & q->q_mask];
+		seq = atomic_load_explicit(&cell->qc_seq, memory_order_acquire);
+		diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&q->q_tail,
+			    &pos, pos + 1, memory_order_relaxed,
+			    memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return (B_FALSE);
+		} else {
+			pos = atomic_load_explicit(&q->q_tail,
+			    memory_order_relaxed);
+		}
+	}
+
+	*datap = cell->qc_data;
+	atomic_store_explicit(&cell->qc_seq, pos + q->q_mask + 1,
+	    memory_order_release);
+	return (B_TRUE);
+}
+
+/*
+ * Wait for a queue operation to be able to make progress.  The pipeline stages
+ * connected by these queues usually take much longer than a context switch, so
+ * after spinning briefly, we back off to sleeping so that a waiting stage
+ * doesn't steal CPU time from the stage it's waiting for.
+ */
+static void
+queue_backoff(unsigned int *triesp)
+{
+	struct timespec ts;
+	unsigned int tries = *triesp;
+
+	if (tries < 64)
+		(*triesp)++;
+
+	if (tries < 16)
+		return;
+
+	if (tries < 32) {
+		(void) sched_yield();
+		return;
+	}
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = tries < 64 ? 50000 : 500000;
+	(void) nanosleep(&ts, NULL);
+}
+
+void
+queue_push(queue_t *q, void *data)
+{
+	unsigned int tries = 0;
+
+	while (!queue_trypush(q, data))
+		queue_backoff(&tries);
+}
+
+void *
+queue_pop(queue_t *q)
+{
+	unsigned int tries = 0;
+	void *data;
+
+	while (!queue_trypop(q, &data))
+		queue_backoff(&tries);
+
+	return (data);
+}
+
+void
+queue_fini(queue_t *q)
+{
+	if (q == NULL)
+		return;
+
+	free(q->q_cells);
+	free(q);
+}
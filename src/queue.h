@@ -0,0 +1,27 @@
+/*
+ * queue.h: bounded lock-free queues
+ */
+
+#ifndef QUEUE_H
+#define	QUEUE_H
+
+#include "compat.h"
+
+/*
+ * A queue holds up to a fixed number of pointers and may be used by any number
+ * of producers and consumers concurrently without locks.  queue_trypush() and
+ * queue_trypop() fail immediately if the queue is full or empty, respectively.
+ * queue_push() and queue_pop() instead wait (spinning briefly, then yielding
+ * the CPU, then sleeping) until they can proceed.  NULL may be queued.
+ */
+struct queue;
+typedef struct queue queue_t;
+
+queue_t *queue_init(unsigned int);
+boolean_t queue_trypush(queue_t *, void *);
+boolean_t queue_trypop(queue_t *, void **);
+void queue_push(queue_t *, void *);
+void *queue_pop(queue_t *);
+void queue_fini(queue_t *);
+
+#endif
@@ -1,34 +1,133 @@
 /*
  * video.c: video input/output facilities
+ *
+ * Frames are produced into buffers from a fixed pool owned by the video.  Each
+ * buffer has a reference count: video_next_frame() hands out a buffer with one
+ * reference, video_frame_hold() adds one, and video_frame_release() drops one,
+ * returning the buffer to the pool when the last is gone.  The pool starts
+ * empty and grows on demand up to the limit set with video_set_buffers(), so
+ * there are no allocations per frame once it's warmed up.  When every buffer
+ * is in use, video_next_frame() waits for another thread to release one, so a
+ * single thread must not hold the whole pool while asking for more frames.
+ *
+ * RGB frames are converted straight into their buffer.  With the version of
+ * libavcodec we use, the decoder owns (and reuses) the buffers it decodes
+ * into, so YUV frames are copied into their buffer, which is much cheaper than
+ * the conversion it replaces.
+ *
+ * Only one thread at a time may call video_next_frame() (or anything else that
+ * decodes), but frames may be held and released from any thread.
  */
 
 #include <err.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <unistd.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavutil/pixdesc.h>
 #include <libswscale/swscale.h>
 
+#include "bench.h"
 #include "img.h"
+#include "probes.h"
 #include "video.h"
 
+/*
+ * Frames are converted to RGB without scaling, so there's nothing to be gained
+ * by filtering.  Point sampling also means that each converted pixel depends
+ * only on the corresponding source pixel, so converting a region of a frame
+ * (see video_set_regions()) produces exactly the same pixels as converting
+ * the whole frame.
+ */
+#define	VIDEO_SWS_FLAGS	SWS_POINT
+
+#define	VIDEO_DEFAULT_BUFFERS	4
+#define	VIDEO_MAX_THREADS	8	/* default decoder threads, at most */
+
+/* Size of a chroma plane in one dimension, given the luma size and shift. */
+#define	VIDEO_CHROMA(n, shift)	(((n) + (1U << (shift)) - 1) >> (shift))
+
+typedef struct video_buf {
+	video_frame_t	vb_frame;	/* must be first (see VIDEO_BUF()) */
+	video_t		*vb_video;
+	atomic_uint	vb_refs;
+	struct video_buf *vb_next;	/* on free list */
+	img_pixel_t	*vb_rgb;	/* RGB pixels, if allocated */
+	uint8_t		*vb_yuv;	/* YUV planes, if allocated */
+} video_buf_t;
+
+#define	VIDEO_BUF(vfp)	((video_buf_t *)(vfp))
+
 struct video {
 	AVFormatContext	*vf_formatctx;
 	AVCodecContext	*vf_codecctx;
 	AVCodec		*vf_codec;
 	AVFrame		*vf_frame;
-	AVFrame		*vf_framergb;
-	uint8_t		*vf_buffer;
+	struct SwsContext *vf_swsctx;
+	unsigned int	vf_nregions;	/* see video_set_regions() */
+	img_box_t	vf_regions[VIDEO_MAX_REGIONS];
+	struct SwsContext *vf_regionctx[VIDEO_MAX_REGIONS];
 	int		vf_stream;
+	int		vf_stride;	/* see video_set_stride() */
+	int		vf_formats;	/* see video_set_formats() */
+	boolean_t	vf_started;	/* packets have been read */
 	double		vf_framerate;
 	int		vf_nframes;
 	char		vf_crtime[64];
+
+	/* decoding position (see video_seek()) */
+	boolean_t	vf_positioned;	/* video_seek() has been called */
+	boolean_t	vf_synced;	/* found the first packet */
+	boolean_t	vf_draining;	/* no more packets; flushing decoder */
+	int64_t		vf_target;	/* dts of the first packet */
+	int		vf_first;	/* first packet to decode */
+	int		vf_last;	/* stop before this packet */
+	int		vf_packet;	/* index of the next packet */
+	int		vf_next;	/* next packet to produce (stride) */
+	int		vf_ndecoded;	/* frames decoded since video_seek() */
+	int64_t		vf_pts;		/* pts of the last packet */
+
+	/* frame buffer pool */
+	pthread_mutex_t	vf_lock;
+	pthread_cond_t	vf_bufcv;	/* a buffer was released */
+	video_buf_t	*vf_bufs[VIDEO_MAX_BUFFERS];
+	unsigned int	vf_nbufs;	/* buffers allocated */
+	unsigned int	vf_maxbufs;	/* see video_set_buffers() */
+	video_buf_t	*vf_free;	/* buffers not in use */
 };
 
+/*
+ * By default, decode with frame threading using one thread per CPU, up to a
+ * point.  Frame threading delays each frame by a packet per extra thread.
+ */
+static unsigned int
+video_default_threads(void)
+{
+	long ncpus;
+
+	if ((ncpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		return (1);
+
+	return (ncpus > VIDEO_MAX_THREADS ? VIDEO_MAX_THREADS : ncpus);
+}
+
+static void
+video_codec_threads(AVCodecContext *ccp, unsigned int nthreads)
+{
+	ccp->thread_count = nthreads;
+	ccp->thread_type = nthreads > 1 ? FF_THREAD_FRAME : 0;
+}
+
 video_t *
 video_open(const char *filename)
 {
-	int i, nbytes;
+	int i;
 	video_t *rv;
 	AVDictionaryEntry *tag;
 
@@ -37,6 +136,10 @@ video_open(const char *filename)
 		return (NULL);
 	}
 
+	(void) pthread_mutex_init(&rv->vf_lock, NULL);
+	(void) pthread_cond_init(&rv->vf_bufcv, NULL);
+	rv->vf_maxbufs = VIDEO_DEFAULT_BUFFERS;
+
 	av_register_all();
 
 
@@ -83,6 +186,7 @@ video_open(const char *filename)
 		return (NULL);
 	}
 
+	video_codec_threads(rv->vf_codecctx, video_default_threads());
 	if (avcodec_open(rv->vf_codecctx, rv->vf_codec) < 0) {
 		warnx("failed to open video codec");
 		free(rv);
@@ -93,27 +197,26 @@ video_open(const char *filename)
 	rv->vf_nframes = rv->vf_formatctx->streams[i]->nb_frames;
 
 	rv->vf_frame = avcodec_alloc_frame();
-	rv->vf_framergb = avcodec_alloc_frame();
-	if (rv->vf_frame == NULL || rv->vf_framergb == NULL) {
+	if (rv->vf_frame == NULL) {
 		warnx("failed to allocate video frames");
 		/* XXX */
 		free(rv);
 		return (NULL);
 	}
 
-	nbytes = avpicture_get_size(PIX_FMT_RGB24, rv->vf_codecctx->width,
-	    rv->vf_codecctx->height);
-	rv->vf_buffer = malloc(nbytes);
-
-	if (rv->vf_buffer == NULL) {
-		warnx("failed to allocate video buffer");
+	rv->vf_stride = 1;
+	rv->vf_formats = VIDEO_FMT_RGB;
+	rv->vf_swsctx = sws_getContext(rv->vf_codecctx->width,
+	    rv->vf_codecctx->height, rv->vf_codecctx->pix_fmt,
+	    rv->vf_codecctx->width, rv->vf_codecctx->height, PIX_FMT_RGB24,
+	    VIDEO_SWS_FLAGS, NULL, NULL, NULL);
+	if (rv->vf_swsctx == NULL) {
+		warnx("failed to initialize conversion context");
 		/* XXX */
 		free(rv);
 		return (NULL);
 	}
 
-	avpicture_fill((AVPicture *)rv->vf_framergb, rv->vf_buffer,
-	    PIX_FMT_RGB24, rv->vf_codecctx->width, rv->vf_codecctx->height);
 	return (rv);
 }
 
@@ -135,84 +238,662 @@ video_crtime(video_t *vp)
 	return (vp->vf_crtime);
 }
 
+/*
+ * Returns the indexes of the packets in the video stream that start with a
+ * keyframe (in decode order), according to the container's index.  These are
+ * the points from which video_iter_range() can start decoding.  Fails if the
+ * container doesn't have a usable index.
+ */
+int
+video_keyframes(video_t *vp, int **keysp, int *nkeysp)
+{
+	AVStream *st = vp->vf_formatctx->streams[vp->vf_stream];
+	int i, nkeys, *keys;
+
+	if (st->nb_index_entries <= 0)
+		return (-1);
+
+	if ((keys = calloc(st->nb_index_entries, sizeof (keys[0]))) == NULL) {
+		warn("malloc");
+		return (-1);
+	}
+
+	nkeys = 0;
+	for (i = 0; i < st->nb_index_entries; i++) {
+		/*
+		 * Packets are identified by their position in the index, so
+		 * the index had better be in decode order.
+		 */
+		if (i > 0 && st->index_entries[i].timestamp <=
+		    st->index_entries[i - 1].timestamp) {
+			free(keys);
+			return (-1);
+		}
+
+		if (st->index_entries[i].flags & AVINDEX_KEYFRAME)
+			keys[nkeys++] = i;
+	}
+
+	*keysp = keys;
+	*nkeysp = nkeys;
+	return (0);
+}
+
+/*
+ * Tells subsequent video_iter_frames() and video_iter_range() calls to skip
+ * work by only producing some frames.  With a stride of 1 (the default), every
+ * frame is produced.  With a larger stride, frames that no other frame depends
+ * on aren't decoded at all, and of the rest, only frames at least "stride"
+ * packets after the previous frame produced are converted and passed to the
+ * iterator.  With VIDEO_STRIDE_KEYFRAMES, only keyframes are decoded.  Frame
+ * numbers (vf_framenum) count only the frames actually decoded, so callers
+ * that skip frames should use vf_frametime or vf_packet instead.
+ */
+void
+video_set_stride(video_t *vp, int stride)
+{
+	vp->vf_stride = stride;
+	if (stride == VIDEO_STRIDE_KEYFRAMES)
+		vp->vf_codecctx->skip_frame = AVDISCARD_NONKEY;
+	else if (stride > 1)
+		vp->vf_codecctx->skip_frame = AVDISCARD_NONREF;
+	else
+		vp->vf_codecctx->skip_frame = AVDISCARD_DEFAULT;
+}
+
+/*
+ * Selects the forms in which subsequent video_iter_frames() and
+ * video_iter_range() calls provide each frame: RGB (vf_image), which requires
+ * converting each frame, and/or YUV (vf_yuv), which is what the decoder
+ * produces and costs nothing extra.  Whichever isn't selected has NULL pixels.
+ * YUV is only available for planar 8-bit limited-range sources, which is what
+ * nearly all video uses.
+ */
+int
+video_set_formats(video_t *vp, int formats)
+{
+	if ((formats & VIDEO_FMT_YUV) != 0) {
+		switch (vp->vf_codecctx->pix_fmt) {
+		case PIX_FMT_YUV420P:
+		case PIX_FMT_YUV422P:
+		case PIX_FMT_YUV444P:
+		case PIX_FMT_YUV410P:
+		case PIX_FMT_YUV411P:
+		case PIX_FMT_YUV440P:
+			break;
+
+		default:
+			warnx("YUV frames are not supported for pixel "
+			    "format %s", av_pix_fmt_descriptors[
+			    vp->vf_codecctx->pix_fmt].name);
+			return (-1);
+		}
+	}
+
+	vp->vf_formats = formats;
+	return (0);
+}
+
+/*
+ * Returns the forms selected with video_set_formats().
+ */
+int
+video_formats(video_t *vp)
+{
+	return (vp->vf_formats);
+}
+
+/*
+ * Sets how many threads the decoder uses to decode frames in parallel.  This
+ * must be called before any frames are read.  Callers that decode several
+ * parts of a video in parallel themselves should use a single thread each.
+ */
+int
+video_set_threads(video_t *vp, unsigned int nthreads)
+{
+	if (vp->vf_started || nthreads == 0) {
+		warnx("can't set decoder threads now");
+		return (-1);
+	}
+
+	avcodec_close(vp->vf_codecctx);
+	video_codec_threads(vp->vf_codecctx, nthreads);
+	if (avcodec_open(vp->vf_codecctx, vp->vf_codec) < 0) {
+		warnx("failed to open video codec");
+		return (-1);
+	}
+
+	video_set_stride(vp, vp->vf_stride);
+	return (0);
+}
+
+/*
+ * Sets the maximum number of frame buffers, and so the number of frames that
+ * may be held at once.  The default is enough for callers that hold only a
+ * frame or two.
+ */
+int
+video_set_buffers(video_t *vp, unsigned int nbuffers)
+{
+	if (nbuffers == 0 || nbuffers > VIDEO_MAX_BUFFERS) {
+		warnx("invalid number of frame buffers (max %d)",
+		    VIDEO_MAX_BUFFERS);
+		return (-1);
+	}
+
+	(void) pthread_mutex_lock(&vp->vf_lock);
+	vp->vf_maxbufs = nbuffers;
+	(void) pthread_cond_broadcast(&vp->vf_bufcv);
+	(void) pthread_mutex_unlock(&vp->vf_lock);
+	return (0);
+}
+
+/*
+ * Tells subsequent video_iter_frames() and video_iter_range() calls to convert
+ * only the given regions of each frame to RGB.  The rest of each frame's image
+ * is left with whatever it had before, so this is only useful for consumers
+ * (like kv_ident()) that look at nothing else.  Regions are expanded as needed
+ * to line up with the source's chroma subsampling.  With no regions, whole
+ * frames are converted.  If the source's pixel format can't be converted in
+ * pieces, this has no effect.
+ */
+int
+video_set_regions(video_t *vp, const img_box_t *boxes, unsigned int nboxes)
+{
+	const AVPixFmtDescriptor *desc;
+	AVCodecContext *ccp = vp->vf_codecctx;
+	img_box_t *bp;
+	unsigned int i, xalign, yalign, width, height;
+
+	for (i = 0; i < vp->vf_nregions; i++)
+		sws_freeContext(vp->vf_regionctx[i]);
+	vp->vf_nregions = 0;
+
+	if (nboxes > VIDEO_MAX_REGIONS) {
+		warnx("too many regions (max %d)", VIDEO_MAX_REGIONS);
+		return (-1);
+	}
+
+	desc = &av_pix_fmt_descriptors[ccp->pix_fmt];
+	if (desc->flags & (PIX_FMT_PAL | PIX_FMT_BITSTREAM | PIX_FMT_HWACCEL))
+		return (0);
+
+	xalign = 1U << desc->log2_chroma_w;
+	yalign = 1U << desc->log2_chroma_h;
+	width = ccp->width;
+	height = ccp->height;
+
+	for (i = 0; i < nboxes; i++) {
+		bp = &vp->vf_regions[vp->vf_nregions];
+		bp->ib_minx = boxes[i].ib_minx & ~(xalign - 1);
+		bp->ib_miny = boxes[i].ib_miny & ~(yalign - 1);
+		bp->ib_maxx = (boxes[i].ib_maxx + xalign - 1) & ~(xalign - 1);
+		bp->ib_maxy = (boxes[i].ib_maxy + yalign - 1) & ~(yalign - 1);
+		if (bp->ib_maxx > width)
+			bp->ib_maxx = width;
+		if (bp->ib_maxy > height)
+			bp->ib_maxy = height;
+
+		if (bp->ib_minx >= bp->ib_maxx || bp->ib_miny >= bp->ib_maxy)
+			continue;
+
+		if ((vp->vf_regionctx[vp->vf_nregions] = sws_getContext(
+		    bp->ib_maxx - bp->ib_minx, bp->ib_maxy - bp->ib_miny,
+		    ccp->pix_fmt, bp->ib_maxx - bp->ib_minx,
+		    bp->ib_maxy - bp->ib_miny, PIX_FMT_RGB24, VIDEO_SWS_FLAGS,
+		    NULL, NULL, NULL)) == NULL) {
+			warnx("failed to initialize conversion context");
+			(void) video_set_regions(vp, NULL, 0);
+			return (-1);
+		}
+
+		vp->vf_nregions++;
+	}
+
+	return (0);
+}
+
+/*
+ * Returns the regions in effect (see video_set_regions()).
+ */
+unsigned int
+video_regions(video_t *vp, const img_box_t **boxesp)
+{
+	*boxesp = vp->vf_regions;
+	return (vp->vf_nregions);
+}
+
+/*
+ * Convert the current frame to RGB into "pixels", either whole or just the
+ * regions we were asked for.  A region is converted by pointing each of the
+ * source planes and the destination at the region's first pixel and
+ * converting it as though it were a whole (smaller) image with the same row
+ * stride.
+ */
+static void
+video_convert(video_t *vp, img_pixel_t *pixels)
+{
+	const AVPixFmtDescriptor *desc;
+	const AVComponentDescriptor *comp;
+	AVFrame *src = vp->vf_frame;
+	const uint8_t *planes[4];
+	uint8_t *out[4];
+	int outstride[4];
+	img_box_t *bp;
+	unsigned int i, c, xshift, yshift;
+
+	bzero(outstride, sizeof (outstride));
+	outstride[0] = vp->vf_codecctx->width * sizeof (img_pixel_t);
+	out[0] = (uint8_t *)pixels;
+	out[1] = out[2] = out[3] = NULL;
+
+	if (vp->vf_nregions == 0) {
+		(void) sws_scale(vp->vf_swsctx,
+		    (const uint8_t *const*)src->data, src->linesize, 0,
+		    vp->vf_codecctx->height, out, outstride);
+		return;
+	}
+
+	desc = &av_pix_fmt_descriptors[vp->vf_codecctx->pix_fmt];
+	for (i = 0; i < vp->vf_nregions; i++) {
+		bp = &vp->vf_regions[i];
+
+		for (c = 0; c < 4; c++)
+			planes[c] = src->data[c];
+
+		/* Components 1 and 2 are the (possibly subsampled) chroma. */
+		for (c = 0; c < desc->nb_components; c++) {
+			comp = &desc->comp[c];
+			xshift = c == 1 || c == 2 ? desc->log2_chroma_w : 0;
+			yshift = c == 1 || c == 2 ? desc->log2_chroma_h : 0;
+			planes[comp->plane] = src->data[comp->plane] +
+			    (bp->ib_miny >> yshift) *
+			    src->linesize[comp->plane] +
+			    (bp->ib_minx >> xshift) * (comp->step_minus1 + 1);
+		}
+
+		out[0] = (uint8_t *)pixels + bp->ib_miny * outstride[0] +
+		    bp->ib_minx * sizeof (img_pixel_t);
+		(void) sws_scale(vp->vf_regionctx[i], planes, src->linesize, 0,
+		    bp->ib_maxy - bp->ib_miny, out, outstride);
+	}
+}
+
 int
 video_iter_frames(video_t *vp, frame_iter_t func, void *arg)
 {
-	AVPacket avp;
-	AVFrame *fp;
-	int width, height, rv, done;
-	video_frame_t frame;
-	struct SwsContext *swsctx;
+	return (video_iter_range(vp, 0, INT_MAX, func, arg));
+}
 
-	fp = vp->vf_framergb;
-	width = vp->vf_codecctx->width;
-	height = vp->vf_codecctx->height;
+/*
+ * Like video_iter_frames(), but starts decoding at packet "first" of the video
+ * stream, which must be 0 or a keyframe (see video_keyframes()), and stops
+ * before decoding packet "last".  Frames are numbered (vf_framenum) from 1 for
+ * the first frame decoded, but vf_packet identifies the packet that completed
+ * each frame, which is the same regardless of where decoding started.  Each
+ * frame is released when "func" returns, unless "func" holds it.
+ */
+int
+video_iter_range(video_t *vp, int first, int last, frame_iter_t func,
+    void *arg)
+{
+	video_frame_t *vfp;
+	int rv;
+
+	if (video_seek(vp, first, last) != 0)
+		return (-1);
 
-	swsctx = sws_getContext(width, height, vp->vf_codecctx->pix_fmt,
-	    width, height, PIX_FMT_RGB24, SWS_BICUBIC, NULL, NULL, NULL);
+	while ((rv = video_next_frame(vp, &vfp)) == 0 && vfp != NULL) {
+		rv = func(vfp, arg);
+		video_frame_release(vfp);
+		if (rv != 0)
+			break;
+	}
 
-	if (swsctx == NULL) {
-		warnx("failed to initialize conversion context");
+	return (rv);
+}
+
+/*
+ * Positions the video so that subsequent video_next_frame() calls produce
+ * frames from packet "first" (which must be 0 or a keyframe) up to, but not
+ * including, packet "last".  Without this, video_next_frame() starts at the
+ * beginning and continues to the end.
+ */
+int
+video_seek(video_t *vp, int first, int last)
+{
+	AVStream *st = vp->vf_formatctx->streams[vp->vf_stream];
+
+	vp->vf_positioned = B_TRUE;
+	vp->vf_draining = B_FALSE;
+	vp->vf_first = first;
+	vp->vf_last = last;
+	vp->vf_packet = first;
+	vp->vf_next = first;
+	vp->vf_ndecoded = 0;
+	vp->vf_pts = 0;
+
+	/*
+	 * Seeking takes us to the keyframe at or before the target timestamp,
+	 * so we skip packets until we find the one we want.  We don't need to
+	 * seek at all to start at the beginning of a video we haven't read yet.
+	 */
+	vp->vf_target = 0;
+	vp->vf_synced = first == 0 && !vp->vf_started;
+	vp->vf_started = B_TRUE;
+	if (vp->vf_synced)
+		return (0);
+
+	if (first >= st->nb_index_entries) {
+		warnx("packet %d is not in the index", first);
+		return (-1);
+	}
+
+	vp->vf_target = st->index_entries[first].timestamp;
+	if (av_seek_frame(vp->vf_formatctx, vp->vf_stream, vp->vf_target,
+	    AVSEEK_FLAG_BACKWARD) < 0) {
+		warnx("failed to seek to packet %d", first);
 		return (-1);
 	}
 
-	rv = 0;
-	frame.vf_framenum = 0;
-	frame.vf_frametime = 0;
-	frame.vf_image.img_width = width;
-	frame.vf_image.img_height = height;
-	frame.vf_image.img_minx = 0;
-	frame.vf_image.img_maxx = width;
-	frame.vf_image.img_miny = 0;
-	frame.vf_image.img_maxy = height;
-	frame.vf_image.img_pixels = NULL;
+	avcodec_flush_buffers(vp->vf_codecctx);
+	return (0);
+}
+
+/*
+ * Read the next packet from the container (see bench.h).
+ */
+static int
+video_read(video_t *vp, AVPacket *avp)
+{
+	uint64_t start;
+	int rv;
+
+	start = bench_start();
+	rv = av_read_frame(vp->vf_formatctx, avp);
+	bench_done(BENCH_DEMUX, start);
+	return (rv);
+}
 
-	while (av_read_frame(vp->vf_formatctx, &avp) >= 0) {
-		if (avp.stream_index != vp->vf_stream) {
+/*
+ * Decode until the decoder produces the next frame we want, returning 1 when
+ * there is one (in vf_frame), 0 when there are no more, or -1 on error.  Once
+ * we run out of packets, the decoder still has as many frames as its delay,
+ * which we get by feeding it empty packets.
+ */
+static int
+video_decode(video_t *vp, int *packetp)
+{
+	AVPacket avp;
+	int done, packet;
+	uint64_t start;
+
+	while (vp->vf_packet < vp->vf_last) {
+		if (vp->vf_draining) {
+			av_init_packet(&avp);
+			avp.data = NULL;
+			avp.size = 0;
+		} else if (video_read(vp, &avp) < 0) {
+			vp->vf_draining = B_TRUE;
+			continue;
+		} else if (avp.stream_index != vp->vf_stream) {
 			av_free_packet(&avp);
 			continue;
+		} else if (!vp->vf_synced) {
+			if (avp.dts < vp->vf_target) {
+				av_free_packet(&avp);
+				continue;
+			}
+
+			if (avp.dts != vp->vf_target) {
+				warnx("failed to seek to packet %d",
+				    vp->vf_first);
+				av_free_packet(&avp);
+				return (-1);
+			}
+
+			vp->vf_synced = B_TRUE;
 		}
 
+		KV_PROBE1(decode__start, vp->vf_packet);
+		start = bench_start();
 		avcodec_decode_video2(vp->vf_codecctx, vp->vf_frame,
 		    &done, &avp);
+		bench_done(BENCH_DECODE, start);
+		KV_PROBE2(decode__done, vp->vf_packet, done);
 
-		if (!done) {
+		if (!vp->vf_draining) {
+			vp->vf_pts = avp.pts;
 			av_free_packet(&avp);
-			continue;
+		} else if (!done) {
+			return (0);
 		}
 
-		(void) sws_scale(swsctx,
-		    (const uint8_t *const*)vp->vf_frame->data,
-		    vp->vf_frame->linesize, 0, height,
-		    vp->vf_framergb->data,
-		    vp->vf_framergb->linesize);
+		packet = vp->vf_packet++;
+		if (!done)
+			continue;
 
-		/*
-		 * It turns out that the layout of the data in the video frame
-		 * (fp->data[0]) matches the layout we used in the "img" class,
-		 * so we can just point img_pixels at it.  While a
-		 * pixel-by-pixel copy would keep the abstractions separate, we
-		 * save about 30% of total execution time by skipping the copy.
-		 */
-		frame.vf_image.img_pixels = (img_pixel_t *)fp->data[0];
-		frame.vf_framenum++;
-		frame.vf_frametime = vp->vf_framerate * avp.pts * MILLISEC;
-		rv = func(&frame, arg);
-		av_free_packet(&avp);
+		vp->vf_ndecoded++;
+		if (vp->vf_stride > 1 && packet < vp->vf_next)
+			continue;
 
-		if (rv != 0)
-			break;
+		vp->vf_next = packet + vp->vf_stride;
+		*packetp = packet;
+		return (1);
 	}
 
-	return (rv);
+	return (0);
+}
+
+/*
+ * Return a buffer to the pool.
+ */
+static void
+video_frame_release_buf(video_buf_t *vb)
+{
+	video_t *vp = vb->vb_video;
+
+	(void) pthread_mutex_lock(&vp->vf_lock);
+	vb->vb_next = vp->vf_free;
+	vp->vf_free = vb;
+	(void) pthread_cond_signal(&vp->vf_bufcv);
+	(void) pthread_mutex_unlock(&vp->vf_lock);
+}
+
+/*
+ * Take a buffer from the pool, waiting for one if they're all in use, and make
+ * sure it has room for the formats we produce.
+ */
+static video_buf_t *
+video_buf_get(video_t *vp)
+{
+	video_buf_t *vb;
+	size_t npixels, nbytes;
+	unsigned int width, height, xshift, yshift;
+	const AVPixFmtDescriptor *desc;
+
+	(void) pthread_mutex_lock(&vp->vf_lock);
+	while (vp->vf_free == NULL && vp->vf_nbufs >= vp->vf_maxbufs)
+		(void) pthread_cond_wait(&vp->vf_bufcv, &vp->vf_lock);
+
+	if ((vb = vp->vf_free) != NULL) {
+		vp->vf_free = vb->vb_next;
+	} else if ((vb = calloc(1, sizeof (*vb))) != NULL) {
+		vb->vb_video = vp;
+		vp->vf_bufs[vp->vf_nbufs++] = vb;
+	}
+	(void) pthread_mutex_unlock(&vp->vf_lock);
+
+	if (vb == NULL) {
+		warn("malloc");
+		return (NULL);
+	}
+
+	/*
+	 * Zero-filling the RGB pixels matters when only some regions are
+	 * converted, since the rest of the image is never written.
+	 */
+	width = vp->vf_codecctx->width;
+	height = vp->vf_codecctx->height;
+	npixels = (size_t)width * height;
+	if ((vp->vf_formats & VIDEO_FMT_RGB) != 0 && vb->vb_rgb == NULL &&
+	    (vb->vb_rgb = calloc(npixels, sizeof (vb->vb_rgb[0]))) == NULL) {
+		warn("malloc");
+		video_frame_release_buf(vb);
+		return (NULL);
+	}
+
+	desc = &av_pix_fmt_descriptors[vp->vf_codecctx->pix_fmt];
+	xshift = desc->log2_chroma_w;
+	yshift = desc->log2_chroma_h;
+	nbytes = npixels + 2 * (size_t)VIDEO_CHROMA(width, xshift) *
+	    VIDEO_CHROMA(height, yshift);
+	if ((vp->vf_formats & VIDEO_FMT_YUV) != 0 && vb->vb_yuv == NULL &&
+	    (vb->vb_yuv = malloc(nbytes)) == NULL) {
+		warn("malloc");
+		video_frame_release_buf(vb);
+		return (NULL);
+	}
+
+	atomic_store(&vb->vb_refs, 1);
+	return (vb);
+}
+
+/*
+ * Fill in a buffer with the frame the decoder just produced.
+ */
+static void
+video_buf_fill(video_t *vp, video_buf_t *vb, int packet)
+{
+	video_frame_t *vfp = &vb->vb_frame;
+	const AVPixFmtDescriptor *desc;
+	AVFrame *src = vp->vf_frame;
+	img_yuv_t *yp = &vfp->vf_yuv;
+	unsigned int i, w, h, row;
+	int64_t pts;
+	uint64_t start;
+	uint8_t *p;
+
+	/*
+	 * The decoder passes along the timestamp of the packet each frame came
+	 * from, which isn't the packet that completed it when frames are
+	 * reordered or when the decoder is threaded.
+	 */
+	pts = src->pkt_pts != AV_NOPTS_VALUE ? src->pkt_pts : vp->vf_pts;
+	vfp->vf_framenum = vp->vf_ndecoded;
+	vfp->vf_frametime = vp->vf_framerate * pts * MILLISEC;
+	vfp->vf_packet = packet;
+
+	vfp->vf_image.img_width = vp->vf_codecctx->width;
+	vfp->vf_image.img_height = vp->vf_codecctx->height;
+	vfp->vf_image.img_minx = 0;
+	vfp->vf_image.img_maxx = vp->vf_codecctx->width;
+	vfp->vf_image.img_miny = 0;
+	vfp->vf_image.img_maxy = vp->vf_codecctx->height;
+	vfp->vf_image.img_pixels = NULL;
+	bzero(yp, sizeof (*yp));
+
+	/*
+	 * It turns out that the layout of the converted frame matches the
+	 * layout we used in the "img" class, so we convert it directly into
+	 * the image's pixels.  While a pixel-by-pixel copy would keep the
+	 * abstractions separate, we save about 30% of total execution time by
+	 * skipping the copy.
+	 */
+	start = bench_start();
+	if (vp->vf_formats & VIDEO_FMT_RGB) {
+		video_convert(vp, vb->vb_rgb);
+		vfp->vf_image.img_pixels = vb->vb_rgb;
+	}
+
+	/*
+	 * The decoder's planes may have padding at the end of each row, which
+	 * we leave out of the copy.
+	 */
+	if (vp->vf_formats & VIDEO_FMT_YUV) {
+		desc = &av_pix_fmt_descriptors[vp->vf_codecctx->pix_fmt];
+		yp->iy_width = vp->vf_codecctx->width;
+		yp->iy_height = vp->vf_codecctx->height;
+		yp->iy_xshift = desc->log2_chroma_w;
+		yp->iy_yshift = desc->log2_chroma_h;
+
+		p = vb->vb_yuv;
+		for (i = 0; i < 3; i++) {
+			w = i == 0 ? yp->iy_width :
+			    VIDEO_CHROMA(yp->iy_width, yp->iy_xshift);
+			h = i == 0 ? yp->iy_height :
+			    VIDEO_CHROMA(yp->iy_height, yp->iy_yshift);
+			yp->iy_planes[i] = p;
+			yp->iy_strides[i] = w;
+			for (row = 0; row < h; row++, p += w)
+				(void) memcpy(p,
+				    src->data[i] + row * src->linesize[i], w);
+		}
+	}
+	bench_done(BENCH_CONVERT, start);
+}
+
+/*
+ * Produce the next frame (see video_seek()) in a buffer with one reference,
+ * which the caller must eventually release.  At the end of the video, this
+ * returns 0 with *framep set to NULL.
+ */
+int
+video_next_frame(video_t *vp, video_frame_t **framep)
+{
+	video_buf_t *vb;
+	int rv, packet;
+
+	*framep = NULL;
+	if (!vp->vf_positioned && video_seek(vp, 0, INT_MAX) != 0)
+		return (-1);
+
+	if ((rv = video_decode(vp, &packet)) <= 0)
+		return (rv);
+
+	if ((vb = video_buf_get(vp)) == NULL)
+		return (-1);
+
+	video_buf_fill(vp, vb, packet);
+	*framep = &vb->vb_frame;
+	return (0);
 }
 
+void
+video_frame_hold(video_frame_t *vfp)
+{
+	(void) atomic_fetch_add(&VIDEO_BUF(vfp)->vb_refs, 1);
+}
+
+void
+video_frame_release(video_frame_t *vfp)
+{
+	video_buf_t *vb = VIDEO_BUF(vfp);
+
+	if (atomic_fetch_sub(&vb->vb_refs, 1) == 1)
+		video_frame_release_buf(vb);
+}
+
+/*
+ * All frames must have been released.
+ */
 void
 video_free(video_t *vp)
 {
-	free(vp->vf_buffer);
-	av_free(vp->vf_framergb);
+	unsigned int i;
+
+	for (i = 0; i < vp->vf_nbufs; i++) {
+		free(vp->vf_bufs[i]->vb_rgb);
+		free(vp->vf_bufs[i]->vb_yuv);
+		free(vp->vf_bufs[i]);
+	}
+
+	(void) video_set_regions(vp, NULL, 0);
+	sws_freeContext(vp->vf_swsctx);
 	av_free(vp->vf_frame);
 	avcodec_close(vp->vf_codecctx);
 	av_close_input_file(vp->vf_formatctx);
+	(void) pthread_cond_destroy(&vp->vf_bufcv);
+	(void) pthread_mutex_destroy(&vp->vf_lock);
+	free(vp);
 }
@@ -18,13 +18,45 @@ typedef struct video video_t;
 typedef struct {
 	int 	vf_framenum;
 	double	vf_frametime;
-	img_t 	vf_image;
+	int	vf_packet;	/* packet that completed the frame (index) */
+	img_t 	vf_image;	/* RGB, if VIDEO_FMT_RGB */
+	img_yuv_t vf_yuv;	/* YUV, if VIDEO_FMT_YUV */
 } video_frame_t;
 
 typedef int (*frame_iter_t)(video_frame_t *, void *);
 
 video_t *video_open(const char *);
 int video_iter_frames(video_t *, frame_iter_t, void *);
+int video_keyframes(video_t *, int **, int *);
+int video_iter_range(video_t *, int, int, frame_iter_t, void *);
+
+/*
+ * Frames can also be pulled one at a time.  Each frame returned by
+ * video_next_frame() lives in its own buffer from a fixed pool and stays valid
+ * until every reference to it has been released, so consumers (including
+ * other threads) may hold several frames at once.  See video.c for details.
+ */
+int video_seek(video_t *, int, int);
+int video_next_frame(video_t *, video_frame_t **);
+void video_frame_hold(video_frame_t *);
+void video_frame_release(video_frame_t *);
+
+#define	VIDEO_MAX_BUFFERS	64
+int video_set_buffers(video_t *, unsigned int);
+int video_set_threads(video_t *, unsigned int);
+
+#define	VIDEO_STRIDE_KEYFRAMES	0
+void video_set_stride(video_t *, int);
+
+#define	VIDEO_FMT_RGB	0x1
+#define	VIDEO_FMT_YUV	0x2
+int video_set_formats(video_t *, int);
+int video_formats(video_t *);
+
+#define	VIDEO_MAX_REGIONS	16
+int video_set_regions(video_t *, const img_box_t *, unsigned int);
+unsigned int video_regions(video_t *, const img_box_t **);
+
 double video_framerate(video_t *);
 int video_nframes(video_t *);
 const char *video_crtime(video_t *);